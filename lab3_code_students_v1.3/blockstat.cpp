@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "blocktrace.h"
+
+// blockstat [-n hot] <tracefile>
+//
+// Summarizes a block trace written by the shell's blocktrace command: how
+// far the disk head moves between accesses (seek distance), how many other
+// blocks are touched before a block is touched again (LRU reuse distance,
+// and from it the hit ratio an LRU cache of each size would get), the
+// hottest blocks with the call that touches them most, and the accesses of
+// every kind of call.
+
+static const char* kinds[] = { "read", "write", "meta" };
+
+// Counts of positions 1..n, for the distinct blocks between two accesses
+class Fenwick {
+private:
+    std::vector<int> tree;
+public:
+    Fenwick(size_t n) : tree(n + 1, 0) {}
+    void add(size_t i, int delta)
+    {
+        for (++i; i < tree.size(); i += i & -i) {
+            tree[i] += delta;
+        }
+    }
+    // sum of positions 0..i-1
+    int sum(size_t i) const
+    {
+        int total = 0;
+        for (; i > 0; i -= i & -i) {
+            total += tree[i];
+        }
+        return total;
+    }
+};
+
+static std::string
+opName(const std::vector<std::string>& opNames, uint8_t op)
+{
+    return op < opNames.size() ? opNames[op] : "(none)";
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned hot = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': hot = std::atoi(optarg); break;
+        default:
+            optind = argc;
+        }
+    }
+    if (optind != argc - 1) {
+        std::cerr << "Usage: blockstat [-n hot] <tracefile>\n";
+        return 1;
+    }
+    std::vector<BlockAccess> accesses;
+    std::vector<std::string> opNames, files;
+    uint64_t overwritten;
+    if (!readBlockTrace(argv[optind], accesses, opNames, files, overwritten)) {
+        std::cerr << "blockstat: " << argv[optind] << " is not a block trace\n";
+        return 1;
+    }
+    if (accesses.empty()) {
+        std::cout << "no accesses\n";
+        return 0;
+    }
+
+    // seek distances, in buckets 0, 1, 2-7, 8-63, 64-511, 512+
+    const char* seekNames[] = { "0", "1", "2-7", "8-63", "64-511", "512+" };
+    uint64_t seeks[6] = {};
+    uint64_t seekSum = 0;
+    // reuse distances, in powers of two, and first touches
+    std::vector<uint64_t> reuse(18, 0);
+    uint64_t cold = 0;
+    std::vector<int64_t> last(1 << 16, -1);
+    Fenwick marked(accesses.size());
+    struct Block {
+        uint64_t count = 0;
+        std::map<uint64_t, uint64_t> calls; // op << 32 | file
+    };
+    std::map<unsigned, Block> blocks;
+    std::map<uint8_t, uint64_t[3]> ops;
+    uint64_t kindCounts[3] = {};
+
+    for (size_t i = 0; i < accesses.size(); ++i) {
+        const BlockAccess& a = accesses[i];
+        unsigned kind = std::min<unsigned>(a.kind, 2);
+        ++kindCounts[kind];
+        ++ops[a.op][kind];
+        Block& b = blocks[a.block];
+        ++b.count;
+        ++b.calls[(uint64_t)a.op << 32 | a.file];
+        if (i > 0) {
+            unsigned d = std::abs((int)a.block - (int)accesses[i - 1].block);
+            seekSum += d;
+            ++seeks[d == 0 ? 0 : d == 1 ? 1 : d < 8 ? 2 : d < 64 ? 3 : d < 512 ? 4 : 5];
+        }
+        if (last[a.block] < 0) {
+            ++cold;
+        } else {
+            // the distinct blocks touched since, each marked at its latest access
+            unsigned d = marked.sum(i) - marked.sum(last[a.block] + 1);
+            unsigned bucket = d == 0 ? 0 : 64 - __builtin_clzll(d);
+            ++reuse[std::min<size_t>(bucket, reuse.size() - 1)];
+            marked.add(last[a.block], -1);
+        }
+        marked.add(i, 1);
+        last[a.block] = i;
+    }
+
+    uint64_t n = accesses.size();
+    double ms = (accesses.back().timeNs - accesses.front().timeNs) / 1e6;
+    std::cout << std::fixed << std::setprecision(1)
+              << n << " accesses (" << kindCounts[0] << " reads, " << kindCounts[1] << " writes, " << kindCounts[2]
+              << " metadata writes) of " << blocks.size() << " blocks in " << ms << " ms";
+    if (overwritten) {
+        std::cout << ", " << overwritten << " older accesses overwritten";
+    }
+    std::cout << "\n\nseek distance\taccesses\tshare\n";
+    for (int b = 0; b < 6; ++b) {
+        std::cout << seekNames[b] << "\t" << seeks[b] << "\t" << 100.0 * seeks[b] / std::max<uint64_t>(1, n - 1)
+                  << "%\n";
+    }
+    std::cout << "mean " << (double)seekSum / std::max<uint64_t>(1, n - 1) << " blocks, "
+              << 100.0 * (seeks[0] + seeks[1]) / std::max<uint64_t>(1, n - 1) << "% sequential\n";
+
+    std::cout << "\nreuse distance\taccesses\n";
+    for (size_t b = 0; b < reuse.size(); ++b) {
+        if (reuse[b] == 0) {
+            continue;
+        }
+        if (b == 0) {
+            std::cout << "0";
+        } else if (b + 1 == reuse.size()) {
+            std::cout << (1u << (b - 1)) << "+";
+        } else {
+            std::cout << (1u << (b - 1)) << "-" << (1u << b) - 1;
+        }
+        std::cout << "\t" << reuse[b] << "\n";
+    }
+    std::cout << "cold\t" << cold << "\n";
+    // a reuse distance below the cache size is a hit in an LRU cache
+    std::cout << "\nLRU blocks\thit ratio\n";
+    for (unsigned size = 16; size <= 2048; size *= 2) {
+        uint64_t hits = 0;
+        for (size_t b = 0; b < reuse.size() && (b == 0 || (1u << b) <= size); ++b) {
+            hits += reuse[b];
+        }
+        std::cout << size << "\t" << 100.0 * hits / n << "%\n";
+    }
+
+    std::vector<std::pair<uint64_t, unsigned>> order;
+    for (auto& b : blocks) {
+        order.push_back({ b.second.count, b.first });
+    }
+    std::sort(order.begin(), order.end(), [](auto& x, auto& y) {
+        return x.first != y.first ? x.first > y.first : x.second < y.second;
+    });
+    std::cout << "\nhot block\taccesses\tmost by\n";
+    for (size_t i = 0; i < order.size() && i < hot; ++i) {
+        const Block& b = blocks[order[i].second];
+        auto most = std::max_element(b.calls.begin(), b.calls.end(),
+                                     [](auto& x, auto& y) { return x.second < y.second; });
+        uint32_t file = (uint32_t)most->first;
+        std::cout << order[i].second << "\t" << order[i].first << "\t" << opName(opNames, most->first >> 32);
+        if (file < files.size() && !files[file].empty()) {
+            std::cout << " " << files[file];
+        }
+        std::cout << " (" << most->second << ")\n";
+    }
+
+    std::cout << "\noperation\t" << kinds[0] << "s\t" << kinds[1] << "s\t" << kinds[2] << " writes\n";
+    for (auto& op : ops) {
+        std::cout << opName(opNames, op.first) << "\t" << op.second[0] << "\t" << op.second[1] << "\t"
+                  << op.second[2] << "\n";
+    }
+    return 0;
+}
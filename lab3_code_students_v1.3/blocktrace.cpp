@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <fstream>
+#include "blocktrace.h"
+
+int
+BlockTrace::start(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!slots) {
+        slots.reset(new Slot[BLOCK_TRACE_RECORDS]);
+    }
+    this->path = path;
+    names.clear();
+    ids.clear();
+    names.push_back("");
+    ids[""] = 0;
+    next = 0;
+    started = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    tracing = true;
+    return 0;
+}
+
+template <typename T>
+static void
+put(std::ofstream& out, T value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename Length>
+static void
+putString(std::ofstream& out, const std::string& s)
+{
+    Length length = std::min<size_t>(s.size(), (Length)~0);
+    put(out, length);
+    out.write(s.data(), length);
+}
+
+int
+BlockTrace::stop(const std::vector<std::string>& opNames)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!tracing) {
+        return -1;
+    }
+    tracing = false;
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return -1;
+    }
+    uint64_t end = next.load();
+    uint64_t first = end > BLOCK_TRACE_RECORDS ? end - BLOCK_TRACE_RECORDS : 0;
+    put<uint32_t>(out, BLOCK_TRACE_MAGIC);
+    put<uint32_t>(out, BLOCK_TRACE_VERSION);
+    put<uint64_t>(out, end - first);
+    put<uint64_t>(out, first);
+    put<uint32_t>(out, opNames.size());
+    for (const std::string& op : opNames) {
+        putString<uint8_t>(out, op);
+    }
+    put<uint32_t>(out, names.size());
+    for (const std::string& file : names) {
+        putString<uint16_t>(out, file);
+    }
+    for (uint64_t i = first; i < end; ++i) {
+        const Slot& slot = slots[i & (BLOCK_TRACE_RECORDS - 1)];
+        uint64_t info = slot.info.load(std::memory_order_relaxed);
+        BlockAccess access = { slot.time.load(std::memory_order_relaxed), (uint16_t)info, (uint8_t)(info >> 16),
+                               (uint8_t)(info >> 24), (uint32_t)(info >> 32) };
+        put(out, access);
+    }
+    return out ? 0 : -1;
+}
+
+uint32_t
+BlockTrace::name(const std::string& file)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = ids.find(file);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    names.push_back(file);
+    return ids[file] = names.size() - 1;
+}
+
+void
+BlockTrace::add(unsigned block, BlockAccessKind kind, const BlockOrigin& origin)
+{
+    uint64_t i = next.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots[i & (BLOCK_TRACE_RECORDS - 1)];
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    slot.time.store(now - started.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot.info.store((uint64_t)(block & 0xFFFF) | (uint64_t)kind << 16 | (uint64_t)origin.op << 24 |
+                    (uint64_t)origin.file << 32, std::memory_order_relaxed);
+}
+
+template <typename T>
+static bool
+get(std::ifstream& in, T& value)
+{
+    return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+template <typename Length>
+static bool
+getString(std::ifstream& in, std::string& s)
+{
+    Length length;
+    if (!get(in, length)) {
+        return false;
+    }
+    s.resize(length);
+    return (bool)in.read(&s[0], length);
+}
+
+bool
+readBlockTrace(const std::string& path, std::vector<BlockAccess>& accesses, std::vector<std::string>& opNames,
+               std::vector<std::string>& files, uint64_t& overwritten)
+{
+    std::ifstream in(path, std::ios::binary);
+    uint32_t magic, version, count;
+    uint64_t records;
+    if (!get(in, magic) || magic != BLOCK_TRACE_MAGIC || !get(in, version) || version != BLOCK_TRACE_VERSION ||
+        !get(in, records) || !get(in, overwritten) || !get(in, count)) {
+        return false;
+    }
+    opNames.resize(count);
+    for (std::string& op : opNames) {
+        if (!getString<uint8_t>(in, op)) return false;
+    }
+    if (!get(in, count)) {
+        return false;
+    }
+    files.resize(count);
+    for (std::string& file : files) {
+        if (!getString<uint16_t>(in, file)) return false;
+    }
+    accesses.resize(records);
+    return records == 0 || (bool)in.read(reinterpret_cast<char*>(accesses.data()), records * sizeof(BlockAccess));
+}
@@ -0,0 +1,76 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef __BLOCKTRACE_H__
+#define __BLOCKTRACE_H__
+
+// Accesses the ring holds, the oldest are overwritten (a power of two)
+#define BLOCK_TRACE_RECORDS (1 << 20)
+#define BLOCK_TRACE_MAGIC 0x43525442 // "BTRC"
+#define BLOCK_TRACE_VERSION 1
+// op of accesses made outside any call, e.g. while mounting
+#define BLOCK_TRACE_NO_OP 0xFF
+
+enum BlockAccessKind { BLOCK_READ, BLOCK_WRITE, BLOCK_META_WRITE };
+
+// The call a thread is working for, kept with each access it makes
+struct BlockOrigin {
+    uint8_t op = BLOCK_TRACE_NO_OP; // FsStat of the call
+    uint32_t file = 0;              // BlockTrace::name() of its arguments
+};
+
+// One access as stored in a dump, 16 bytes
+struct BlockAccess {
+    uint64_t timeNs;
+    uint16_t block;
+    uint8_t kind;
+    uint8_t op;
+    uint32_t file;
+};
+
+// Records the block accesses of the file system in a ring in memory and
+// dumps them to a file for blockstat. Adding an access is two relaxed
+// atomic stores, so it can stay on while a workload runs. A dump is
+//   magic, version (u32), accesses, overwritten (u64),
+//   op names (u32 count, u8 length + bytes each),
+//   files (u32 count, u16 length + bytes each),
+//   the accesses, oldest first
+class BlockTrace {
+private:
+    struct Slot {
+        std::atomic<uint64_t> time;
+        std::atomic<uint64_t> info; // block | kind << 16 | op << 24 | file << 32
+    };
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> next;
+    std::atomic<bool> tracing;
+    std::atomic<int64_t> started; // steady clock, ns
+    std::mutex mutex; // guards the names and the start and stop
+    std::vector<std::string> names;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::string path;
+public:
+    BlockTrace() : next(0), tracing(false), started(0) {}
+    // starts recording, to be dumped to path when stopped
+    int start(const std::string& path);
+    // stops recording and writes the dump; accesses racing with the stop
+    // may come out torn, which an analysis can live with
+    int stop(const std::vector<std::string>& opNames);
+    // acquire, so a caller that sees it on sees the ring
+    bool active() const { return tracing.load(std::memory_order_acquire); }
+    // the id of a file name (the arguments of a call)
+    uint32_t name(const std::string& file);
+    void add(unsigned block, BlockAccessKind kind, const BlockOrigin& origin);
+};
+
+// Reads a dump, false if it is not one
+bool readBlockTrace(const std::string& path, std::vector<BlockAccess>& accesses, std::vector<std::string>& opNames,
+                    std::vector<std::string>& files, uint64_t& overwritten);
+
+#endif // __BLOCKTRACE_H__
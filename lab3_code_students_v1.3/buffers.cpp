@@ -0,0 +1,69 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include "buffers.h"
+
+namespace {
+// set once the pool of the thread is gone, buffers released later (by
+// other thread-local objects) go straight back to the heap
+thread_local bool closed = false;
+// the free buffers of a thread, freed with it
+struct LocalPool {
+    std::vector<uint8_t*> free;
+    ~LocalPool()
+    {
+        closed = true;
+        for (uint8_t* bytes : free) {
+            std::free(bytes);
+        }
+    }
+};
+thread_local LocalPool pool;
+}
+
+uint8_t*
+BlockBuffer::take()
+{
+    if (!closed && !pool.free.empty()) {
+        uint8_t* bytes = pool.free.back();
+        pool.free.pop_back();
+        return bytes;
+    }
+    void* bytes;
+    if (posix_memalign(&bytes, BUFFER_ALIGN, FsGeometry::blockSize) != 0) {
+        throw std::bad_alloc();
+    }
+    return static_cast<uint8_t*>(bytes);
+}
+
+void
+BlockBuffer::give(uint8_t* bytes)
+{
+    if (!bytes) {
+        return;
+    }
+    if (!closed && pool.free.size() < BUFFER_POOL_LOCAL) {
+        pool.free.push_back(bytes);
+    } else {
+        std::free(bytes);
+    }
+}
+
+BlockBuffer::BlockBuffer(bool zero) : bytes(take())
+{
+    if (zero) {
+        std::memset(bytes, 0, FsGeometry::blockSize);
+    }
+}
+
+BlockBuffer&
+BlockBuffer::operator=(BlockBuffer&& other) noexcept
+{
+    if (this != &other) {
+        give(bytes);
+        bytes = other.bytes;
+        other.bytes = nullptr;
+    }
+    return *this;
+}
@@ -0,0 +1,34 @@
+#include <cstdint>
+#include "geometry.h"
+
+#ifndef __BUFFERS_H__
+#define __BUFFERS_H__
+
+// Alignment of block buffers, a page as O_DIRECT wants it
+#define BUFFER_ALIGN 4096
+// Free buffers a thread keeps for reuse, more go back to the heap
+#define BUFFER_POOL_LOCAL 32
+
+// A block-sized, page-aligned buffer from the buffer pool, handed back when
+// the handle goes out of scope. Handles move but do not copy, so copying a
+// block is always a visible memcpy. Each thread keeps a small free list, so
+// taking and returning a buffer takes no lock.
+class BlockBuffer {
+private:
+    uint8_t* bytes;
+    static uint8_t* take();
+    static void give(uint8_t* bytes);
+public:
+    // a zeroed buffer, or with zero false one holding whatever it held
+    explicit BlockBuffer(bool zero = true);
+    ~BlockBuffer() { give(bytes); }
+    BlockBuffer(BlockBuffer&& other) noexcept : bytes(other.bytes) { other.bytes = nullptr; }
+    BlockBuffer& operator=(BlockBuffer&& other) noexcept;
+    BlockBuffer(const BlockBuffer&) = delete;
+    BlockBuffer& operator=(const BlockBuffer&) = delete;
+    uint8_t* data() { return bytes; }
+    const uint8_t* data() const { return bytes; }
+    operator uint8_t*() { return bytes; }
+};
+
+#endif // __BUFFERS_H__
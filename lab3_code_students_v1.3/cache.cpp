@@ -0,0 +1,402 @@
+#include <algorithm>
+#include <cstring>
+#include "cache.h"
+
+// longest run of blocks written with a single vectored write
+#define MAX_RUN 64
+
+BlockCache::BlockCache(Disk& disk, const CacheOptions& options)
+    : disk(disk), options(options), dirty(0), generation(0),
+      hits(0), misses(0), flushedBlocks(0), flushWrites(0), readAheadBlocks(0), stopping(false)
+{
+    this->options.blocks = std::max(1u, options.blocks);
+}
+
+BlockCache::~BlockCache()
+{
+    stop();
+}
+
+void
+BlockCache::start(std::function<void()> tick)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (flusher.joinable()) {
+        return;
+    }
+    this->tick = tick;
+    stopping = false;
+    flusher = std::thread(&BlockCache::run, this);
+    reader = std::thread(&BlockCache::readAhead, this);
+}
+
+void
+BlockCache::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeFlusher.notify_all();
+    wakeReader.notify_all();
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+    if (reader.joinable()) {
+        reader.join();
+    }
+    flush();
+}
+
+int
+BlockCache::read(unsigned block_no, uint8_t* blk)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // a block being read ahead is waited for rather than read twice
+    loaded.wait(lock, [this, block_no] { return loading.count(block_no) == 0; });
+    auto it = entries.find(block_no);
+    if (it != entries.end()) {
+        ++hits;
+        std::memcpy(blk, it->second.data.data(), BLOCK_SIZE);
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return 0;
+    }
+    ++misses;
+    // caught up with the read-ahead: read its queued run right here
+    unsigned count = takeRun(block_no);
+    if (count > 0) {
+        return loadRun(block_no, count, lock, blk);
+    }
+    uint64_t seen = generation;
+    lock.unlock();
+    if (disk.read(block_no, blk) != 0) {
+        return -1;
+    }
+    lock.lock();
+    // skip it if the block was written or invalidated meanwhile
+    if (seen == generation && entries.find(block_no) == entries.end()) {
+        insert(block_no, blk, false, lock);
+    }
+    return 0;
+}
+
+int
+BlockCache::write(unsigned block_no, const uint8_t* blk)
+{
+    if (!options.writeBehind && disk.write(block_no, const_cast<uint8_t*>(blk)) != 0) {
+        return -1;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    insert(block_no, blk, options.writeBehind, lock);
+    if (dirty * 100 > (size_t)options.dirtyRatio * options.blocks) {
+        wakeFlusher.notify_one();
+    }
+    return 0;
+}
+
+void
+BlockCache::prefetch(const std::vector<unsigned>& blocks)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned b : blocks) {
+            // more than fits in the cache would only evict itself
+            if (wanted.size() < options.blocks / 2 && entries.find(b) == entries.end()) {
+                wanted.push_back(b);
+            }
+        }
+    }
+    wakeReader.notify_one();
+}
+
+// Puts a block in the cache, making room first. When every block in the
+// cache is dirty the least recently used one is written back right here,
+// which throttles writers that outrun the flusher. Clean blocks are not
+// worth that and are not cached then; they are also never inserted after
+// the lock was dropped, when the copy might have gone stale.
+void
+BlockCache::insert(unsigned block_no, const uint8_t* blk, bool makeDirty, std::unique_lock<std::mutex>& lock,
+                   BlockBuffer* adopt)
+{
+    while (entries.find(block_no) == entries.end() && entries.size() >= options.blocks) {
+        auto victim = std::find_if(lru.rbegin(), lru.rend(), [this](unsigned b) { return !entries[b].dirty; });
+        if (victim != lru.rend()) {
+            drop(*victim);
+        } else if (!makeDirty) {
+            return;
+        } else {
+            // a block that cannot be written back is lost either way
+            unsigned oldest = lru.back();
+            if (writeOut({ oldest }, lock) != 0) {
+                drop(oldest);
+            }
+        }
+    }
+    auto it = entries.find(block_no);
+    if (it == entries.end()) {
+        Entry& entry = entries[block_no];
+        lru.push_front(block_no);
+        entry.lru = lru.begin();
+        it = entries.find(block_no);
+    } else {
+        lru.splice(lru.begin(), lru, it->second.lru);
+    }
+    Entry& entry = it->second;
+    if (adopt) {
+        entry.data = std::move(*adopt);
+    } else {
+        std::memcpy(entry.data.data(), blk, BLOCK_SIZE);
+    }
+    ++entry.version;
+    ++generation;
+    if (makeDirty && !entry.dirty) {
+        entry.dirty = true;
+        entry.dirtySince = std::chrono::steady_clock::now();
+        ++dirty;
+    }
+}
+
+void
+BlockCache::drop(unsigned block_no)
+{
+    auto it = entries.find(block_no);
+    if (it == entries.end()) {
+        return;
+    }
+    if (it->second.dirty) {
+        --dirty;
+    }
+    lru.erase(it->second.lru);
+    entries.erase(it);
+}
+
+void
+BlockCache::invalidate(unsigned block_no)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    drop(block_no);
+    ++generation;
+}
+
+// A write-back in flight may hold a copy of the blocks, it is waited for so
+// its write can't land after the punch. invalidate needs no such wait, the
+// block is only written again after a commit, and commits flush first.
+int
+BlockCache::discard(unsigned block_no, unsigned no_blks)
+{
+    std::lock_guard<std::mutex> writeLock(writing);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned i = 0; i < no_blks; ++i) {
+            drop(block_no + i);
+        }
+        ++generation;
+    }
+    return disk.discard(block_no, no_blks);
+}
+
+// as discard, after a write-back in flight, which format would wipe
+void
+BlockCache::reset()
+{
+    std::lock_guard<std::mutex> writeLock(writing);
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    lru.clear();
+    dirty = 0;
+    ++generation;
+}
+
+int
+BlockCache::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<unsigned> blocks;
+    for (auto& entry : entries) {
+        if (entry.second.dirty) {
+            blocks.push_back(entry.first);
+        }
+    }
+    return writeOut(blocks, lock);
+}
+
+// Writes blocks back, runs of adjacent blocks with one vectored write each.
+// Called and returns with lock held, but drops it for the I/O. Write-backs
+// are serialized, so an older copy of a block never lands after a newer one.
+int
+BlockCache::writeOut(std::vector<unsigned> blocks, std::unique_lock<std::mutex>& lock)
+{
+    lock.unlock();
+    std::lock_guard<std::mutex> writeLock(writing);
+    lock.lock();
+
+    struct Copy {
+        unsigned block_no;
+        uint64_t version;
+        BlockBuffer data;
+    };
+    std::vector<Copy> copies;
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    for (unsigned b : blocks) {
+        auto it = entries.find(b);
+        if (it != entries.end() && it->second.dirty) {
+            copies.push_back({ b, it->second.version, BlockBuffer(false) });
+            std::memcpy(copies.back().data.data(), it->second.data.data(), BLOCK_SIZE);
+        }
+    }
+    lock.unlock();
+
+    int result = 0;
+    uint64_t writes = 0;
+    std::vector<size_t> written;
+    size_t first = 0;
+    for (size_t i = 1; i <= copies.size(); ++i) {
+        if (i < copies.size() && copies[i].block_no == copies[i - 1].block_no + 1 && i - first < MAX_RUN) {
+            continue;
+        }
+        std::vector<uint8_t*> run;
+        for (size_t j = first; j < i; ++j) {
+            run.push_back(copies[j].data.data());
+        }
+        if (disk.writev(copies[first].block_no, run.data(), run.size()) == 0) {
+            for (size_t j = first; j < i; ++j) {
+                written.push_back(j);
+            }
+            ++writes;
+        } else {
+            result = -1;
+        }
+        first = i;
+    }
+
+    lock.lock();
+    for (size_t j : written) {
+        auto it = entries.find(copies[j].block_no);
+        // still dirty if it was written again while we were at it
+        if (it != entries.end() && it->second.dirty && it->second.version == copies[j].version) {
+            it->second.dirty = false;
+            --dirty;
+        }
+    }
+    flushedBlocks += written.size();
+    flushWrites += writes;
+    return result;
+}
+
+// The flusher: writes back expired dirty blocks, or all of them when the
+// dirty ratio is exceeded, then lets the owner age its own data (the journal)
+void
+BlockCache::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        wakeFlusher.wait_for(lock, std::chrono::milliseconds(options.flushIntervalMs));
+        if (stopping) {
+            break;
+        }
+        auto expired = std::chrono::steady_clock::now() - std::chrono::milliseconds(options.dirtyExpireMs);
+        bool overRatio = dirty * 100 > (size_t)options.dirtyRatio * options.blocks;
+        std::vector<unsigned> blocks;
+        for (auto& entry : entries) {
+            if (entry.second.dirty && (overRatio || entry.second.dirtySince <= expired)) {
+                blocks.push_back(entry.first);
+            }
+        }
+        if (!blocks.empty()) {
+            writeOut(blocks, lock);
+        }
+        if (tick) {
+            std::function<void()> ageing = tick;
+            lock.unlock();
+            ageing();
+            lock.lock();
+        }
+    }
+}
+
+// Takes the run of adjacent blocks starting at first out of the read-ahead
+// queue, returns its length (0 if first is not queued or already cached)
+unsigned
+BlockCache::takeRun(unsigned first)
+{
+    unsigned count = 0;
+    auto it = std::find(wanted.begin(), wanted.end(), first);
+    while (it != wanted.end() && *it == first + count && count < MAX_RUN &&
+           entries.find(*it) == entries.end() && loading.count(*it) == 0) {
+        it = wanted.erase(it);
+        ++count;
+    }
+    return count;
+}
+
+// Reads count blocks starting at first into the cache with one vectored
+// read, and the first one into blk unless it is null. Called and returns
+// with lock held, but drops it for the I/O; readers of the blocks wait.
+int
+BlockCache::loadRun(unsigned first, unsigned count, std::unique_lock<std::mutex>& lock, uint8_t* blk)
+{
+    for (unsigned i = 0; i < count; ++i) {
+        loading.insert(first + i);
+    }
+    uint64_t seen = generation;
+    lock.unlock();
+    std::vector<BlockBuffer> run;
+    std::vector<uint8_t*> blks;
+    for (unsigned i = 0; i < count; ++i) {
+        run.emplace_back(false);
+        blks.push_back(run.back().data());
+    }
+    int result = disk.readv(first, blks.data(), count);
+    if (result == 0 && blk) {
+        std::memcpy(blk, blks[0], BLOCK_SIZE);
+    }
+    lock.lock();
+    // as for a read miss, a block written meanwhile must not be replaced.
+    // Clean inserts keep the lock, so the check holds for the whole run.
+    bool fresh = result == 0 && seen == generation;
+    for (unsigned i = 0; i < count; ++i) {
+        if (fresh && entries.find(first + i) == entries.end()) {
+            insert(first + i, blks[i], false, lock, &run[i]);
+            readAheadBlocks += (i > 0 || !blk) && entries.find(first + i) != entries.end();
+        }
+        loading.erase(first + i);
+    }
+    loaded.notify_all();
+    return result;
+}
+
+// The read-ahead thread: reads the queued blocks that are not cached yet
+void
+BlockCache::readAhead()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wakeReader.wait(lock, [this] { return stopping || !wanted.empty(); });
+        if (stopping) {
+            break;
+        }
+        unsigned first = wanted.front();
+        unsigned count = takeRun(first);
+        if (count == 0) {
+            wanted.pop_front();
+            continue;
+        }
+        loadRun(first, count, lock, nullptr);
+    }
+}
+
+CacheMetrics
+BlockCache::metrics()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    CacheMetrics m = { dirty, 0, flushedBlocks, flushWrites, hits, misses, readAheadBlocks };
+    auto now = std::chrono::steady_clock::now();
+    for (auto& entry : entries) {
+        if (entry.second.dirty) {
+            auto age = std::chrono::duration_cast<std::chrono::milliseconds>(now - entry.second.dirtySince);
+            m.lagMs = std::max<uint64_t>(m.lagMs, age.count());
+        }
+    }
+    return m;
+}
@@ -0,0 +1,104 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "buffers.h"
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// Settings of the block cache, chosen when the file system is mounted. Data
+// written is at risk for at most about dirtyExpireMs + flushIntervalMs.
+struct CacheOptions {
+    unsigned blocks = 256;          // capacity of the cache in blocks
+    unsigned dirtyRatio = 20;       // % of the capacity dirty before the flusher writes everything
+    unsigned dirtyExpireMs = 500;   // age at which dirty data, and pending metadata, are written
+    unsigned flushIntervalMs = 100; // how often the flusher wakes up
+    bool writeBehind = true;        // false writes data through to the disk
+};
+
+struct CacheMetrics {
+    size_t queueDepth;      // dirty blocks waiting for the flusher
+    uint64_t lagMs;         // age of the oldest dirty block
+    uint64_t flushedBlocks; // blocks written back so far
+    uint64_t flushWrites;   // vectored writes used for them
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readAhead;     // blocks read ahead of their readers
+};
+
+// Write-behind cache of data blocks in front of the disk. Writes complete in
+// memory; a background flusher writes dirty blocks back once they reach
+// dirtyExpireMs or the dirty ratio is exceeded, adjacent blocks together in
+// one vectored write. Metadata goes through the journal, not this cache.
+// A read-ahead thread fills the cache with blocks readers announce they
+// will want, runs of adjacent blocks with one vectored read.
+class BlockCache {
+private:
+    struct Entry {
+        BlockBuffer data = BlockBuffer(false);
+        bool dirty = false;
+        uint64_t version = 0; // bumped by every write, to spot writes during a flush
+        std::chrono::steady_clock::time_point dirtySince;
+        std::list<unsigned>::iterator lru;
+    };
+    Disk& disk;
+    CacheOptions options;
+    std::mutex mutex;
+    std::mutex writing;      // serializes write-backs
+    std::condition_variable wakeFlusher;
+    std::condition_variable wakeReader;
+    std::condition_variable loaded;
+    std::unordered_map<unsigned, Entry> entries;
+    std::list<unsigned> lru; // most recently used first
+    size_t dirty;
+    uint64_t generation;     // bumped by invalidations, so a racing miss is not cached
+    uint64_t hits, misses, flushedBlocks, flushWrites, readAheadBlocks;
+    std::deque<unsigned> wanted; // blocks to read ahead, in the order they will be read
+    std::unordered_set<unsigned> loading; // blocks the read-ahead is reading now
+    std::thread flusher;
+    std::thread reader;
+    bool stopping;
+    std::function<void()> tick;
+    void run();
+    void readAhead();
+    unsigned takeRun(unsigned first);
+    int loadRun(unsigned first, unsigned count, std::unique_lock<std::mutex>& lock, uint8_t* blk);
+    int writeOut(std::vector<unsigned> blocks, std::unique_lock<std::mutex>& lock);
+    // adopt, if given, becomes the cached copy instead of a copy of blk
+    void insert(unsigned block_no, const uint8_t* blk, bool dirty, std::unique_lock<std::mutex>& lock,
+                BlockBuffer* adopt = nullptr);
+    void drop(unsigned block_no);
+public:
+    BlockCache(Disk& disk, const CacheOptions& options = CacheOptions());
+    ~BlockCache();
+    // starts the flusher and the read-ahead thread, tick runs on every wake up after the data is written
+    void start(std::function<void()> tick);
+    // stops the threads and writes back what is dirty
+    void stop();
+    int read(unsigned block_no, uint8_t* blk);
+    int write(unsigned block_no, const uint8_t* blk);
+    // queues blocks to be read into the cache in the background
+    void prefetch(const std::vector<unsigned>& blocks);
+    // forgets a block without writing it back, e.g. when it is freed or
+    // becomes a metadata block
+    void invalidate(unsigned block_no);
+    // forgets a block and punches it out of the disk file, returns what
+    // Disk::discard returns
+    int discard(unsigned block_no, unsigned no_blks = 1);
+    // writes back all dirty blocks
+    int flush();
+    // forgets everything, dirty or not (format)
+    void reset();
+    CacheMetrics metrics();
+};
+
+#endif // __CACHE_H__
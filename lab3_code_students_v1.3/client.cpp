@@ -0,0 +1,88 @@
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "client.h"
+
+Client::Client() : fd(-1)
+{
+}
+
+Client::~Client()
+{
+    disconnect();
+}
+
+int
+Client::connect(const std::string& path)
+{
+    disconnect();
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return CLIENT_ERROR;
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return CLIENT_ERROR;
+    }
+    if (::connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+        disconnect();
+        return CLIENT_ERROR;
+    }
+    return 0;
+}
+
+void
+Client::disconnect()
+{
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+// sends one request and waits for its response
+int
+Client::call(Opcode op, const std::vector<std::string>& args)
+{
+    lastOutput.clear();
+    if (fd < 0) {
+        return CLIENT_ERROR;
+    }
+    std::string request(1, static_cast<char>(op));
+    for (auto& arg : args) {
+        putString(request, arg);
+    }
+    std::string response;
+    int32_t status;
+    if (!sendFrame(fd, request) || !recvFrame(fd, response) || response.size() < sizeof(status)) {
+        disconnect();
+        return CLIENT_ERROR;
+    }
+    std::memcpy(&status, response.data(), sizeof(status));
+    lastOutput.assign(response, sizeof(status), std::string::npos);
+    return status;
+}
+
+int Client::format() { return call(OP_FORMAT); }
+int Client::create(const std::string& filepath, const std::string& content) { return call(OP_CREATE, { filepath, content }); }
+int Client::cat(const std::string& filepath) { return call(OP_CAT, { filepath }); }
+int Client::ls() { return call(OP_LS); }
+int Client::cp(const std::string& sourcepath, const std::string& destpath, bool recursive) { return call(recursive ? OP_CP_TREE : OP_CP, { sourcepath, destpath }); }
+int Client::mv(const std::string& sourcepath, const std::string& destpath) { return call(OP_MV, { sourcepath, destpath }); }
+int Client::rm(const std::string& filepath, bool recursive) { return call(recursive ? OP_RM_TREE : OP_RM, { filepath }); }
+int Client::append(const std::string& filepath1, const std::string& filepath2) { return call(OP_APPEND, { filepath1, filepath2 }); }
+int Client::mkdir(const std::string& dirpath) { return call(OP_MKDIR, { dirpath }); }
+int Client::cd(const std::string& dirpath) { return call(OP_CD, { dirpath }); }
+int Client::pwd() { return call(OP_PWD); }
+int Client::chmod(const std::string& accessrights, const std::string& filepath) { return call(OP_CHMOD, { accessrights, filepath }); }
+int Client::compress(const std::string& mode, const std::string& path) { return call(OP_COMPRESS, { mode, path }); }
+int Client::du(const std::string& path) { return call(OP_DU, { path }); }
+int Client::find(const std::string& dirpath, const std::string& name) { return call(OP_FIND, { dirpath, name }); }
+int Client::fsck(bool repair) { return call(repair ? OP_FSCK_REPAIR : OP_FSCK); }
+int Client::sync() { return call(OP_SYNC); }
+int Client::begin() { return call(OP_BEGIN); }
+int Client::commit() { return call(OP_COMMIT); }
@@ -0,0 +1,49 @@
+#include <string>
+#include <vector>
+#include "protocol.h"
+
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+// Returned by Client calls when the server could not be reached
+#define CLIENT_ERROR -2
+
+// Connection to a file system server. Every call returns what the FS call
+// returned on the server (0 or -1), or CLIENT_ERROR; what the call printed,
+// such as the listing of ls or the content of cat, is kept in output().
+class Client {
+private:
+    int fd;
+    std::string lastOutput;
+    int call(Opcode op, const std::vector<std::string>& args = std::vector<std::string>());
+public:
+    Client();
+    ~Client();
+    int connect(const std::string& path = DEFAULT_SOCKET);
+    void disconnect();
+    const std::string& output() const { return lastOutput; }
+
+    int format();
+    // content is the data the shell would read, lines ended by an empty line
+    // or the end of content
+    int create(const std::string& filepath, const std::string& content);
+    int cat(const std::string& filepath);
+    int ls();
+    int cp(const std::string& sourcepath, const std::string& destpath, bool recursive = false);
+    int mv(const std::string& sourcepath, const std::string& destpath);
+    int rm(const std::string& filepath, bool recursive = false);
+    int append(const std::string& filepath1, const std::string& filepath2);
+    int mkdir(const std::string& dirpath);
+    int cd(const std::string& dirpath);
+    int pwd();
+    int chmod(const std::string& accessrights, const std::string& filepath);
+    int compress(const std::string& mode, const std::string& path);
+    int du(const std::string& path);
+    int find(const std::string& dirpath, const std::string& name);
+    int fsck(bool repair = false);
+    int sync();
+    int begin();
+    int commit();
+};
+
+#endif // __CLIENT_H__
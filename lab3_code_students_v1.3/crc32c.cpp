@@ -0,0 +1,91 @@
+#include <cstring>
+#include "crc32c.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// reflected CRC-32C polynomial
+#define POLY 0x82f63b78
+
+// Tables for slicing by 8: table[k][b] is the CRC of byte b followed by k
+// zero bytes, so eight bytes are folded in with eight lookups
+struct Tables {
+    uint32_t table[8][256];
+    Tables() {
+        for (uint32_t b = 0; b < 256; ++b) {
+            uint32_t crc = b;
+            for (int i = 0; i < 8; ++i) {
+                crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+            }
+            table[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; ++b) {
+            for (int k = 1; k < 8; ++k) {
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+            }
+        }
+    }
+};
+static const Tables tables;
+
+uint32_t
+crc32cTable(const void* data, size_t len, uint32_t crc)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const auto& t = tables.table;
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        word ^= crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^
+              t[4][(word >> 24) & 0xff] ^ t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+              t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+    }
+    for (; len > 0; ++p, --len) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cSSE42(const void* data, size_t len, uint32_t crc)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint64_t crc64 = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    uint32_t crc32 = crc64;
+    for (; len > 0; ++p, --len) {
+        crc32 = _mm_crc32_u8(crc32, *p);
+    }
+    return ~crc32;
+}
+#endif
+
+bool
+crc32cHardware()
+{
+#if defined(__x86_64__)
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    return sse42;
+#else
+    return false;
+#endif
+}
+
+uint32_t
+crc32c(const void* data, size_t len, uint32_t crc)
+{
+#if defined(__x86_64__)
+    if (crc32cHardware()) {
+        return crc32cSSE42(data, len, crc);
+    }
+#endif
+    return crc32cTable(data, len, crc);
+}
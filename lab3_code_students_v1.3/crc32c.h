@@ -0,0 +1,15 @@
+#include <cstddef>
+#include <cstdint>
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+// CRC-32C (Castagnoli) of len bytes, continuing from crc (0 to start). Uses
+// the SSE4.2 crc32 instruction when the CPU has it, a lookup table otherwise.
+uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0);
+// the same computed with the lookup table only
+uint32_t crc32cTable(const void* data, size_t len, uint32_t crc = 0);
+// whether crc32c runs on the SSE4.2 instruction
+bool crc32cHardware();
+
+#endif // __CRC32C_H__
@@ -0,0 +1,91 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+#include "crc32c.h"
+#include "disk.h"
+
+// crcbench [-n blocks]
+//
+// Measures what the block checksums cost: the CRC-32C of a block with the
+// SSE4.2 instruction and with the table fallback, and a block written and
+// read through the disk, which computes it once each way. The disk file is
+// made in a scratch directory, the real one is not touched.
+
+static double
+nsPerBlock(std::chrono::steady_clock::time_point start, unsigned blocks)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / blocks;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned blocks = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': blocks = std::atoi(optarg); break;
+        default:
+            std::cerr << "usage: crcbench [-n blocks]\n";
+            return 1;
+        }
+    }
+    std::vector<uint8_t> blk(BLOCK_SIZE);
+    for (size_t i = 0; i < blk.size(); ++i) {
+        blk[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    volatile uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < blocks; ++i) {
+        sink = crc32c(blk.data(), BLOCK_SIZE, sink);
+    }
+    double hardware = nsPerBlock(start, blocks);
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < blocks; ++i) {
+        sink = crc32cTable(blk.data(), BLOCK_SIZE, sink);
+    }
+    double table = nsPerBlock(start, blocks);
+
+    char dir[] = "/tmp/crcbench.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        std::cerr << "crcbench: can't make a scratch directory\n";
+        return 1;
+    }
+    double writes, reads;
+    {
+        Disk disk;
+        unsigned n = disk.get_no_blocks();
+        start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < blocks; ++i) {
+            blk[0] = (uint8_t)i;
+            disk.write(i % n, blk.data());
+        }
+        writes = nsPerBlock(start, blocks);
+        start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < blocks; ++i) {
+            disk.read(i % n, blk.data());
+        }
+        reads = nsPerBlock(start, blocks);
+    }
+    unlink(DISKNAME);
+    rmdir(dir);
+
+    double crc = crc32cHardware() ? hardware : table;
+    std::cout << std::fixed << std::setprecision(0);
+    if (crc32cHardware()) {
+        std::cout << "crc32c sse4.2: " << hardware << " ns/block\n";
+    } else {
+        std::cout << "crc32c sse4.2: not supported\n";
+    }
+    std::cout << "crc32c table:  " << table << " ns/block\n"
+              << "disk write:    " << writes << " ns/block\n"
+              << "disk read:     " << reads << " ns/block\n"
+              << "checksums:     " << (CHECKSUMS ? "on" : "off") << ", "
+              << 100.0 * crc / reads << "% of a read\n";
+    return 0;
+}
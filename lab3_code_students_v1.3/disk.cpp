@@ -1,27 +1,554 @@
 #include <iostream>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "buffers.h"
+#include "crc32c.h"
 #include "disk.h"
+#include "lz.h"
 
-Disk::Disk()
+DiskOptions
+DiskOptions::fromEnvironment()
 {
-    // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
-        std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
-        f.write("", 1);
+    DiskOptions options;
+    const char *disk = std::getenv(DISK_ENV);
+    if (disk && std::string(disk) == DISK_MEMORY) {
+        options.memory = true;
+    } else if (disk && *disk) {
+        options.path = disk;
     }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
-        exit(-1);
+    const char *direct = std::getenv(DISK_DIRECT_ENV);
+    options.direct = direct && std::string(direct) == "1";
+    const char *stripes = std::getenv(DISK_STRIPES_ENV);
+    if (stripes && std::atoi(stripes) > 1) {
+        options.stripes = std::atoi(stripes);
     }
+    return options;
+}
+
+// diskfile.bin becomes diskfile.<i>.bin, a name without an extension gets .<i>
+std::string
+DiskOptions::stripePath(unsigned i) const
+{
+    if (stripes <= 1) {
+        return path;
+    }
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == slash + 1) {
+        return path + "." + std::to_string(i);
+    }
+    return path.substr(0, dot) + "." + std::to_string(i) + path.substr(dot);
+}
+
+Disk::Disk(const DiskOptions& options)
+    : options(options), file_blocks(no_blocks), compressible(new std::atomic<bool>[no_blocks]()), packed_blocks(0),
+      packed_bytes(0), latencies({ "read", "write", "readv", "writev", "discard", "sync" })
+{
+    off_t table = (CHECKSUMS ? (no_blocks + 1) * sizeof(uint32_t) : 0) +
+                  (COMPRESSION ? no_blocks * sizeof(uint16_t) + sizeof(uint32_t) : 0);
+    if (options.memory) {
+        memory.assign(disk_size + table, 0);
+    } else {
+        unsigned stripes = std::max(1u, options.stripes);
+        if (stripes > 1) {
+            unsigned units = (no_blocks + STRIPE_BLOCKS - 1) / STRIPE_BLOCKS;
+            file_blocks = (units + stripes - 1) / stripes * STRIPE_BLOCKS;
+        }
+        files.resize(stripes);
+        for (unsigned i = 0; i < stripes; ++i) {
+            DiskFile& file = files[i];
+            file.path = options.stripePath(i);
+            const char *name = file.path.c_str();
+            off_t blocks = (off_t)file_blocks * BLOCK_SIZE;
+            off_t size = blocks + (i == 0 ? table : 0);
+            // first check if the disk file exists, otherwise create it.
+            if (!disk_file_exists(name)) {
+                std::cout << "No disk file found...\n";
+                std::cout << "Creating disk file: " << name << std::endl;
+            }
+            // the disk is simulated as a binary file, kept sparse on the host
+            file.fd = open(name, O_RDWR | O_CREAT, 0644);
+            // the image of another geometry, or another number of stripes,
+            // has another size, and must not be cut to this one; one with
+            // a shorter table behind the blocks is from before the block map
+            struct stat st;
+            if (file.fd >= 0 && fstat(file.fd, &st) == 0 && st.st_size != 0 &&
+                (st.st_size < blocks || st.st_size > size)) {
+                std::cerr << "ERROR: " << name << " is not a disk of " << no_blocks << " blocks of " << BLOCK_SIZE
+                          << " bytes";
+                if (stripes > 1) {
+                    std::cerr << " in " << stripes << " stripes";
+                }
+                std::cerr << ", not using it" << std::endl;
+                usable = false;
+                return;
+            }
+            if (file.fd < 0 || ftruncate(file.fd, size) != 0) {
+                std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
+                exit(-1);
+            }
+            if (options.direct) {
+                open_direct(file);
+            }
+            if (stripes > 1) {
+                file.worker.reset(new TaskPool(1));
+            }
+        }
+    }
+    // a table of checksums missing is built from the blocks as the map
+    // has them
+    if (COMPRESSION) {
+        load_slots();
+    }
+    if (CHECKSUMS) {
+        load_checksums();
+    }
+}
+
+// opens a disk file a second time with O_DIRECT, and keeps it if an
+// aligned read of a block works; file systems like tmpfs refuse O_DIRECT
+// when opening, others only on the first I/O
+void
+Disk::open_direct(DiskFile& file)
+{
+#ifdef O_DIRECT
+    file.direct_fd = open(file.path.c_str(), O_RDWR | O_DIRECT);
+    BlockBuffer probe(false);
+    if (file.direct_fd >= 0 && pread(file.direct_fd, probe, BLOCK_SIZE, 0) == BLOCK_SIZE) {
+        return;
+    }
+    if (file.direct_fd >= 0) {
+        close(file.direct_fd);
+        file.direct_fd = -1;
+    }
+#endif
+    std::cout << "No direct I/O on " << file.path << ", using the page cache\n";
+}
+
+// reads the checksum table, or builds it from the blocks when the disk file
+// has none yet (new, or written without checksums)
+void
+Disk::load_checksums()
+{
+    checksums.assign(no_blocks + 1, 0);
+    size_t length = checksums.size() * sizeof(uint32_t);
+    if (raw_read(checksums.data(), length, checksum_offset()) == (ssize_t)length &&
+        checksums[no_blocks] == CHECKSUM_MAGIC) {
+        return;
+    }
+    BlockBuffer blk(false);
+    for (unsigned i = 0; i < no_blocks; ++i) {
+        if (get_block(i, blk) != 0) {
+            std::memset(blk, 0, BLOCK_SIZE);
+        }
+        checksums[i] = crc32c(blk, BLOCK_SIZE);
+    }
+    checksums[no_blocks] = CHECKSUM_MAGIC;
+    if (raw_write(checksums.data(), length, checksum_offset()) != (ssize_t)length ||
+        (!files.empty() && fdatasync(files[0].fd) != 0)) {
+        std::cerr << "ERROR: Can't write the checksums of " << options.path << std::endl;
+    }
+}
+
+// writes the table entries of no_blks blocks from block_no, after the
+// blocks themselves, so both are durable after the next sync
+int
+Disk::store_checksums(unsigned block_no, unsigned no_blks)
+{
+    size_t length = no_blks * sizeof(uint32_t);
+    off_t offset = checksum_offset() + (off_t)block_no * sizeof(uint32_t);
+    return raw_write(&checksums[block_no], length, offset) == (ssize_t)length ? 0 : -1;
+}
+
+off_t
+Disk::slot_offset() const
+{
+    return checksum_offset() + (CHECKSUMS ? (no_blocks + 1) * sizeof(uint32_t) : 0);
+}
+
+// reads the block map, or starts an empty one when the disk file has none
+// yet, with every block stored as it is
+void
+Disk::load_slots()
+{
+    slots.assign(no_blocks, 0);
+    size_t length = slots.size() * sizeof(uint16_t);
+    uint32_t magic = 0;
+    if (raw_read(slots.data(), length, slot_offset()) == (ssize_t)length &&
+        raw_read(&magic, sizeof(magic), slot_offset() + length) == sizeof(magic) && magic == SLOT_MAGIC) {
+        for (uint16_t slot : slots) {
+            if (slot > 0) {
+                ++packed_blocks;
+                packed_bytes += (slot + COMPRESSION_SECTOR - 1) / COMPRESSION_SECTOR * COMPRESSION_SECTOR;
+            }
+        }
+        return;
+    }
+    slots.assign(no_blocks, 0);
+    magic = SLOT_MAGIC;
+    if (raw_write(slots.data(), length, slot_offset()) != (ssize_t)length ||
+        raw_write(&magic, sizeof(magic), slot_offset() + length) != sizeof(magic) ||
+        (!files.empty() && fdatasync(files[0].fd) != 0)) {
+        std::cerr << "ERROR: Can't write the block map of " << options.path << std::endl;
+    }
+}
+
+// writes the map entries of no_blks blocks from block_no, after the blocks
+// themselves, like the checksums
+int
+Disk::store_slots(unsigned block_no, unsigned no_blks)
+{
+    size_t length = no_blks * sizeof(uint16_t);
+    off_t offset = slot_offset() + (off_t)block_no * sizeof(uint16_t);
+    return raw_write(&slots[block_no], length, offset) == (ssize_t)length ? 0 : -1;
+}
+
+void
+Disk::set_slot(unsigned block_no, uint16_t length)
+{
+    auto sectors = [](uint16_t slot) {
+        return (slot + COMPRESSION_SECTOR - 1) / COMPRESSION_SECTOR * COMPRESSION_SECTOR;
+    };
+    packed_blocks += (length > 0) - (slots[block_no] > 0);
+    packed_bytes += sectors(length) - sectors(slots[block_no]);
+    slots[block_no] = length;
+}
+
+void
+Disk::set_compressed(unsigned block_no, bool on)
+{
+    if (COMPRESSION && block_no < no_blocks) {
+        compressible[block_no].store(on, std::memory_order_relaxed);
+    }
+}
+
+// A block that doesn't compress by at least a sector is stored as it is
+int
+Disk::put_block(unsigned block_no, const uint8_t *blk)
+{
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    uint16_t length = 0;
+    if (COMPRESSION && compressible[block_no].load(std::memory_order_relaxed)) {
+        BlockBuffer slot(false);
+        length = lzCompress(blk, BLOCK_SIZE, slot, BLOCK_SIZE - COMPRESSION_SECTOR);
+        if (length > 0) {
+            size_t stored = (length + COMPRESSION_SECTOR - 1) / COMPRESSION_SECTOR * COMPRESSION_SECTOR;
+            std::memset(slot + length, 0, stored - length);
+            if (raw_write(slot, stored, offset) != (ssize_t)stored) {
+                return -1;
+            }
+            // the rest of the block is given back to the host where it
+            // covers whole pages, which it can't always do
+            off_t rest = (stored + BUFFER_ALIGN - 1) / BUFFER_ALIGN * BUFFER_ALIGN;
+            if (rest < BLOCK_SIZE) {
+                raw_punch(offset + rest, BLOCK_SIZE - rest);
+            }
+        }
+    }
+    if (length == 0 && raw_write(blk, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+        return -1;
+    }
+    if (!COMPRESSION || slots[block_no] == length) {
+        return 0;
+    }
+    set_slot(block_no, length);
+    return store_slots(block_no, 1);
+}
+
+int
+Disk::get_block(unsigned block_no, uint8_t *blk)
+{
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    uint16_t length = COMPRESSION ? slots[block_no] : 0;
+    if (length == 0) {
+        return raw_read(blk, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+    }
+    // put_block stores nothing longer, the map is damaged
+    if (length > BLOCK_SIZE - COMPRESSION_SECTOR) {
+        std::cout << "Disk::read - ERROR: Block " << block_no << " has a bad slot length (" << length << ")\n";
+        return -1;
+    }
+    BlockBuffer slot(false);
+    size_t stored = (length + COMPRESSION_SECTOR - 1) / COMPRESSION_SECTOR * COMPRESSION_SECTOR;
+    if (raw_read(slot, stored, offset) != (ssize_t)stored) {
+        return -1;
+    }
+    if (!lzDecompress(slot, length, blk, BLOCK_SIZE)) {
+        std::cout << "Disk::read - ERROR: Can't decompress block " << block_no << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+// Stripe s of STRIPE_BLOCKS blocks is in file s % files, where it follows
+// the stripes of that file before it. The checksum table is behind the
+// blocks of the first file. With one file the image is the file.
+unsigned
+Disk::locate(off_t offset, off_t& file_offset, off_t& contiguous) const
+{
+    if (offset >= checksum_offset()) {
+        file_offset = (off_t)file_blocks * BLOCK_SIZE + offset - checksum_offset();
+        contiguous = LLONG_MAX;
+        return 0;
+    }
+    if (files.size() == 1) {
+        file_offset = offset;
+        contiguous = checksum_offset() - offset;
+        return 0;
+    }
+    off_t unit = (off_t)STRIPE_BLOCKS * BLOCK_SIZE;
+    off_t stripe = offset / unit;
+    file_offset = stripe / files.size() * unit + offset % unit;
+    contiguous = unit - offset % unit;
+    return stripe % files.size();
+}
+
+// O_DIRECT wants the memory, the offset and the length aligned. Offsets
+// and lengths of blocks are whole blocks, buffers are aligned when they
+// come from the buffer pool. The slots of compressed blocks, whole sectors
+// only, go through the page cache.
+bool
+Disk::direct_io(const DiskFile& file, const void *buf, size_t length, off_t offset) const
+{
+    return file.direct_fd >= 0 && offset < (off_t)file_blocks * BLOCK_SIZE && (uintptr_t)buf % BUFFER_ALIGN == 0 &&
+           length % BLOCK_SIZE == 0;
+}
+
+ssize_t
+Disk::file_read(DiskFile& file, void *buf, size_t length, off_t offset)
+{
+    if (direct_io(file, buf, length, offset)) {
+        return pread(file.direct_fd, buf, length, offset);
+    }
+    if (file.direct_fd < 0 || offset >= (off_t)file_blocks * BLOCK_SIZE || length % BLOCK_SIZE != 0) {
+        return pread(file.fd, buf, length, offset);
+    }
+    // an unaligned buffer of blocks is read through an aligned one
+    BlockBuffer bounce(false);
+    size_t done = 0;
+    while (done < length) {
+        if (pread(file.direct_fd, bounce, BLOCK_SIZE, offset + done) != BLOCK_SIZE) {
+            return -1;
+        }
+        std::memcpy(static_cast<uint8_t*>(buf) + done, bounce, BLOCK_SIZE);
+        done += BLOCK_SIZE;
+    }
+    return done;
+}
+
+ssize_t
+Disk::file_write(DiskFile& file, const void *buf, size_t length, off_t offset)
+{
+    if (direct_io(file, buf, length, offset)) {
+        return pwrite(file.direct_fd, buf, length, offset);
+    }
+    if (file.direct_fd < 0 || offset >= (off_t)file_blocks * BLOCK_SIZE || length % BLOCK_SIZE != 0) {
+        return pwrite(file.fd, buf, length, offset);
+    }
+    BlockBuffer bounce(false);
+    size_t done = 0;
+    while (done < length) {
+        std::memcpy(bounce, static_cast<const uint8_t*>(buf) + done, BLOCK_SIZE);
+        if (pwrite(file.direct_fd, bounce, BLOCK_SIZE, offset + done) != BLOCK_SIZE) {
+            return -1;
+        }
+        done += BLOCK_SIZE;
+    }
+    return done;
+}
+
+ssize_t
+Disk::file_vector(DiskFile& file, const struct iovec *iov, unsigned count, off_t offset, bool write)
+{
+    bool direct = file.direct_fd >= 0;
+    for (unsigned i = 0; i < count && direct; ++i) {
+        direct = direct_io(file, iov[i].iov_base, iov[i].iov_len, offset);
+    }
+    if (direct || file.direct_fd < 0) {
+        int fd = direct ? file.direct_fd : file.fd;
+        return write ? pwritev(fd, iov, count, offset) : preadv(fd, iov, count, offset);
+    }
+    ssize_t done = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        ssize_t n = write ? file_write(file, iov[i].iov_base, iov[i].iov_len, offset + done)
+                          : file_read(file, iov[i].iov_base, iov[i].iov_len, offset + done);
+        if (n != (ssize_t)iov[i].iov_len) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t
+Disk::raw_read(void *buf, size_t length, off_t offset)
+{
+    if (files.empty()) {
+        std::memcpy(buf, &memory[offset], length);
+        return length;
+    }
+    size_t done = 0;
+    while (done < length) {
+        off_t at, contiguous;
+        DiskFile& file = files[locate(offset + done, at, contiguous)];
+        size_t n = std::min<off_t>(length - done, contiguous);
+        if (file_read(file, static_cast<uint8_t*>(buf) + done, n, at) != (ssize_t)n) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t
+Disk::raw_write(const void *buf, size_t length, off_t offset)
+{
+    if (files.empty()) {
+        std::memcpy(&memory[offset], buf, length);
+        return length;
+    }
+    size_t done = 0;
+    while (done < length) {
+        off_t at, contiguous;
+        DiskFile& file = files[locate(offset + done, at, contiguous)];
+        size_t n = std::min<off_t>(length - done, contiguous);
+        if (file_write(file, static_cast<const uint8_t*>(buf) + done, n, at) != (ssize_t)n) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// The blocks a file holds of a run follow each other in it, so a vectored
+// I/O becomes one per file. When it spans several files their workers do
+// them at the same time.
+ssize_t
+Disk::transfer(const struct iovec *iov, unsigned count, off_t offset, bool write)
+{
+    std::vector<std::vector<struct iovec>> parts(files.size());
+    std::vector<off_t> starts(files.size());
+    off_t at = offset;
+    for (unsigned i = 0; i < count; ++i) {
+        // a block never straddles two stripes
+        off_t file_offset, contiguous;
+        unsigned f = locate(at, file_offset, contiguous);
+        if (parts[f].empty()) {
+            starts[f] = file_offset;
+        }
+        parts[f].push_back(iov[i]);
+        at += iov[i].iov_len;
+    }
+    unsigned used = std::count_if(parts.begin(), parts.end(), [](auto& part) { return !part.empty(); });
+    std::vector<ssize_t> results(files.size(), 0);
+    TaskGroup group;
+    for (unsigned f = 0; f < files.size(); ++f) {
+        if (parts[f].empty()) {
+            continue;
+        }
+        auto io = [this, f, write, &parts, &starts, &results] {
+            results[f] = file_vector(files[f], parts[f].data(), parts[f].size(), starts[f], write);
+        };
+        if (used == 1) {
+            io();
+        } else {
+            files[f].worker->submit(group, io);
+        }
+    }
+    if (used > 1) {
+        files[0].worker->wait(group);
+    }
+    ssize_t done = 0;
+    for (unsigned f = 0; f < files.size(); ++f) {
+        if (results[f] < 0) {
+            return -1;
+        }
+        done += results[f];
+    }
+    return done;
+}
+
+ssize_t
+Disk::raw_readv(const struct iovec *iov, unsigned count, off_t offset)
+{
+    if (!files.empty()) {
+        return transfer(iov, count, offset, false);
+    }
+    ssize_t done = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        done += raw_read(iov[i].iov_base, iov[i].iov_len, offset + done);
+    }
+    return done;
+}
+
+ssize_t
+Disk::raw_writev(const struct iovec *iov, unsigned count, off_t offset)
+{
+    if (!files.empty()) {
+        return transfer(iov, count, offset, true);
+    }
+    ssize_t done = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        done += raw_write(iov[i].iov_base, iov[i].iov_len, offset + done);
+    }
+    return done;
+}
+
+int
+Disk::raw_punch(off_t offset, off_t length)
+{
+    if (files.empty()) {
+        std::memset(&memory[offset], 0, length);
+        return 0;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    off_t done = 0;
+    while (done < length) {
+        off_t at, contiguous;
+        DiskFile& file = files[locate(offset + done, at, contiguous)];
+        off_t n = std::min(length - done, contiguous);
+        if (fallocate(file.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, n) != 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+bool
+Disk::verify(unsigned block_no, const uint8_t *blk, uint32_t expected)
+{
+    if (crc32c(blk, BLOCK_SIZE) == expected) {
+        return true;
+    }
+    std::cout << "Disk::read - ERROR: Checksum mismatch in block " << block_no << "\n";
+    return false;
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    for (DiskFile& file : files) {
+        file.worker.reset();
+        if (file.direct_fd >= 0) {
+            close(file.direct_fd);
+        }
+        if (file.fd >= 0) {
+            close(file.fd);
+        }
+    }
+    files.clear();
 }
 
 bool
@@ -34,17 +561,91 @@ Disk::disk_file_exists (const std::string& name) {
 int
 Disk::write(unsigned block_no, uint8_t *blk)
 {
+    LatencyTimer timer(latencies[DISK_WRITE]);
     if (DEBUG)
         std::cout << "Disk::write(" << block_no << ")\n";
+    if (!usable) {
+        return -1;
+    }
     // check if valid block number
     if (block_no >= no_blocks) {
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (!CHECKSUMS && !COMPRESSION) {
+        return raw_write(blk, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+    }
+    uint32_t crc = CHECKSUMS ? crc32c(blk, BLOCK_SIZE) : 0;
+    std::unique_lock<std::shared_mutex> lock(checksumLocks.get(LockTable::stripe(block_no)));
+    if (put_block(block_no, blk) != 0) {
+        return -1;
+    }
+    if (!CHECKSUMS) {
+        return 0;
+    }
+    checksums[block_no] = crc;
+    return store_checksums(block_no, 1);
+}
+
+// writes no_blks consecutive blocks starting at block_no with one call
+int
+Disk::writev(unsigned block_no, uint8_t* const* blks, unsigned no_blks)
+{
+    LatencyTimer timer(latencies[DISK_WRITEV]);
+    if (DEBUG)
+        std::cout << "Disk::writev(" << block_no << ", " << no_blks << ")\n";
+    if (!usable) {
+        return -1;
+    }
+    if (block_no >= no_blocks || no_blks > no_blocks - block_no || no_blks > IOV_MAX) {
+        std::cout << "Disk::writev - ERROR: Invalid block range (" << block_no << ", " << no_blks << ")\n";
+        return -1;
+    }
+    std::vector<struct iovec> iov(no_blks);
+    for (unsigned i = 0; i < no_blks; ++i) {
+        iov[i].iov_base = blks[i];
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (!CHECKSUMS && !COMPRESSION) {
+        return raw_writev(iov.data(), no_blks, offset) == (ssize_t)no_blks * BLOCK_SIZE ? 0 : -1;
+    }
+    std::vector<uint32_t> crcs(no_blks);
+    for (unsigned i = 0; i < no_blks && CHECKSUMS; ++i) {
+        crcs[i] = crc32c(blks[i], BLOCK_SIZE);
+    }
+    for (unsigned done = 0; done < no_blks; done += CHECKSUM_RUN) {
+        unsigned n = std::min(no_blks - done, (unsigned)CHECKSUM_RUN);
+        LockSet lock(checksumLocks);
+        for (unsigned i = 0; i < n; ++i) {
+            lock.exclusive(block_no + done + i);
+        }
+        lock.lock();
+        // a run with compressed blocks, or blocks to be compressed, has
+        // holes, so it is written block by block
+        bool packed = false;
+        for (unsigned i = 0; i < n && COMPRESSION && !packed; ++i) {
+            unsigned b = block_no + done + i;
+            packed = slots[b] > 0 || compressible[b].load(std::memory_order_relaxed);
+        }
+        if (packed) {
+            for (unsigned i = 0; i < n; ++i) {
+                if (put_block(block_no + done + i, blks[done + i]) != 0) {
+                    return -1;
+                }
+            }
+        } else if (raw_writev(&iov[done], n, offset + (off_t)done * BLOCK_SIZE) != (ssize_t)n * BLOCK_SIZE) {
+            return -1;
+        }
+        if (!CHECKSUMS) {
+            continue;
+        }
+        std::copy(crcs.begin() + done, crcs.begin() + done + n, checksums.begin() + block_no + done);
+        if (store_checksums(block_no + done, n) != 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -52,15 +653,176 @@ Disk::write(unsigned block_no, uint8_t *blk)
 int
 Disk::read(unsigned block_no, uint8_t *blk)
 {
+    LatencyTimer timer(latencies[DISK_READ]);
     if (DEBUG)
         std::cout << "Disk::read(" << block_no << ")\n";
+    if (!usable) {
+        return -1;
+    }
     // check if valid block number
     if (block_no >= no_blocks) {
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (!CHECKSUMS && !COMPRESSION) {
+        return raw_read(blk, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+    }
+    uint32_t expected;
+    {
+        std::shared_lock<std::shared_mutex> lock(checksumLocks.get(LockTable::stripe(block_no)));
+        if (get_block(block_no, blk) != 0) {
+            return -1;
+        }
+        expected = CHECKSUMS ? checksums[block_no] : 0;
+    }
+    return !CHECKSUMS || verify(block_no, blk, expected) ? 0 : -1;
+}
+
+// reads no_blks consecutive blocks starting at block_no with one call
+int
+Disk::readv(unsigned block_no, uint8_t* const* blks, unsigned no_blks)
+{
+    LatencyTimer timer(latencies[DISK_READV]);
+    if (DEBUG)
+        std::cout << "Disk::readv(" << block_no << ", " << no_blks << ")\n";
+    if (!usable) {
+        return -1;
+    }
+    if (block_no >= no_blocks || no_blks > no_blocks - block_no || no_blks > IOV_MAX) {
+        std::cout << "Disk::readv - ERROR: Invalid block range (" << block_no << ", " << no_blks << ")\n";
+        return -1;
+    }
+    std::vector<struct iovec> iov(no_blks);
+    for (unsigned i = 0; i < no_blks; ++i) {
+        iov[i].iov_base = blks[i];
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (!CHECKSUMS && !COMPRESSION) {
+        return raw_readv(iov.data(), no_blks, offset) == (ssize_t)no_blks * BLOCK_SIZE ? 0 : -1;
+    }
+    std::vector<uint32_t> expected(no_blks);
+    for (unsigned done = 0; done < no_blks; done += CHECKSUM_RUN) {
+        unsigned n = std::min(no_blks - done, (unsigned)CHECKSUM_RUN);
+        LockSet lock(checksumLocks);
+        for (unsigned i = 0; i < n; ++i) {
+            lock.shared(block_no + done + i);
+        }
+        lock.lock();
+        bool packed = false;
+        for (unsigned i = 0; i < n && COMPRESSION && !packed; ++i) {
+            packed = slots[block_no + done + i] > 0;
+        }
+        if (packed) {
+            for (unsigned i = 0; i < n; ++i) {
+                if (get_block(block_no + done + i, blks[done + i]) != 0) {
+                    return -1;
+                }
+            }
+        } else if (raw_readv(&iov[done], n, offset + (off_t)done * BLOCK_SIZE) != (ssize_t)n * BLOCK_SIZE) {
+            return -1;
+        }
+        if (CHECKSUMS) {
+            std::copy(checksums.begin() + block_no + done, checksums.begin() + block_no + done + n,
+                      expected.begin() + done);
+        }
+    }
+    for (unsigned i = 0; i < no_blks && CHECKSUMS; ++i) {
+        if (!verify(block_no + i, blks[i], expected[i])) {
+            return -1;
+        }
+    }
     return 0;
 }
+
+// releases blocks on the host by punching a hole in the disk file, or zeros
+// them on a RAM disk. When the host can't punch holes the blocks are left as
+// they are, with their checksums, and 1 is returned: a caller that needs them
+// to read as zeros has to write zeros then.
+int
+Disk::discard(unsigned block_no, unsigned no_blks)
+{
+    LatencyTimer timer(latencies[DISK_DISCARD]);
+    if (DEBUG)
+        std::cout << "Disk::discard(" << block_no << ", " << no_blks << ")\n";
+    if (!usable) {
+        return -1;
+    }
+    if (block_no >= no_blocks || no_blks > no_blocks - block_no) {
+        std::cout << "Disk::discard - ERROR: Invalid block range (" << block_no << ", " << no_blks << ")\n";
+        return -1;
+    }
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    off_t length = (off_t)no_blks * BLOCK_SIZE;
+    if (!CHECKSUMS && !COMPRESSION) {
+        if (raw_punch(offset, length) != 0) {
+            return errno == EOPNOTSUPP || errno == ENOSYS ? 1 : -1;
+        }
+        return 0;
+    }
+    // the punched blocks read as zeros afterwards
+    static const uint32_t zeros = [] {
+        std::vector<uint8_t> blk(BLOCK_SIZE, 0);
+        return crc32c(blk.data(), BLOCK_SIZE);
+    }();
+    for (unsigned done = 0; done < no_blks; done += CHECKSUM_RUN) {
+        unsigned n = std::min(no_blks - done, (unsigned)CHECKSUM_RUN);
+        LockSet lock(checksumLocks);
+        for (unsigned i = 0; i < n; ++i) {
+            lock.exclusive(block_no + done + i);
+        }
+        lock.lock();
+        // what was written to the blocks is gone, and so is its compression,
+        // also where the punch fails and the caller writes zeros instead
+        for (unsigned i = 0; i < n && COMPRESSION; ++i) {
+            compressible[block_no + done + i].store(false, std::memory_order_relaxed);
+        }
+        if (raw_punch(offset + (off_t)done * BLOCK_SIZE, (off_t)n * BLOCK_SIZE) != 0) {
+            return errno == EOPNOTSUPP || errno == ENOSYS ? 1 : -1;
+        }
+        if (CHECKSUMS) {
+            std::fill(checksums.begin() + block_no + done, checksums.begin() + block_no + done + n, zeros);
+            if (store_checksums(block_no + done, n) != 0) {
+                return -1;
+            }
+        }
+        if (!COMPRESSION) {
+            continue;
+        }
+        for (unsigned i = 0; i < n; ++i) {
+            set_slot(block_no + done + i, 0);
+        }
+        if (store_slots(block_no + done, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// makes all completed writes durable
+int
+Disk::sync()
+{
+    LatencyTimer timer(latencies[DISK_SYNC]);
+    if (DEBUG)
+        std::cout << "Disk::sync()\n";
+    if (!usable) {
+        return -1;
+    }
+    if (files.size() <= 1) {
+        return files.empty() || fdatasync(files[0].fd) == 0 ? 0 : -1;
+    }
+    // the files are synced at the same time, by their workers
+    std::atomic<bool> failed(false);
+    TaskGroup group;
+    for (DiskFile& file : files) {
+        file.worker->submit(group, [&file, &failed] {
+            if (fdatasync(file.fd) != 0) {
+                failed = true;
+            }
+        });
+    }
+    files[0].worker->wait(group);
+    return failed ? -1 : 0;
+}
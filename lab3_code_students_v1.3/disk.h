@@ -1,28 +1,168 @@
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "geometry.h"
+#include "locks.h"
+#include "stats.h"
+#include "taskpool.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
-#define BLOCK_SIZE 4096
+#define BLOCK_SIZE FsGeometry::blockSize
 #define DEBUG false
+// Keep a CRC-32C of every block, checked on every read
+#define CHECKSUMS true
+#define CHECKSUM_MAGIC 0x54435243 // "CRCT"
+// Blocks of a run read or written under one set of checksum locks
+#define CHECKSUM_RUN 16
+// Store the blocks marked compressible LZ-compressed, in whole sectors
+#define COMPRESSION true
+#define COMPRESSION_SECTOR 512
+#define SLOT_MAGIC 0x544f4c53 // "SLOT"
+// Consecutive blocks in one file of a striped disk, so that a run of
+// CHECKSUM_RUN blocks spreads over up to four files
+#define STRIPE_BLOCKS 4
+
+// the disk of FS_DISK in the environment, ":memory:" for a RAM disk,
+// FS_DIRECT=1 for direct I/O and FS_STRIPES the number of its files
+#define DISK_ENV "FS_DISK"
+#define DISK_MEMORY ":memory:"
+#define DISK_DIRECT_ENV "FS_DIRECT"
+#define DISK_STRIPES_ENV "FS_STRIPES"
+
+// Where a disk keeps its blocks: in the image file at path, or in memory,
+// where they are gone with the disk, for tests and benchmarks that should
+// not pay for or share a file. With direct the blocks of the file are read
+// and written with O_DIRECT, past the host's page cache, so the block
+// cache is the only cache; where the host can't do that the page cache is
+// used as without it. With several stripes the blocks are spread over as
+// many files, diskfile.0.bin to diskfile.<stripes - 1>.bin for diskfile.bin,
+// e.g. one per SSD, in turns of STRIPE_BLOCKS blocks; a RAM disk has one.
+struct DiskOptions {
+    std::string path = DISKNAME;
+    bool memory = false;
+    bool direct = false;
+    unsigned stripes = 1;
+    // the disk FS_DISK, FS_DIRECT and FS_STRIPES name, the default disk
+    // file without
+    static DiskOptions fromEnvironment();
+    // the file of stripe i, path itself for a disk of one file
+    std::string stripePath(unsigned i) const;
+};
+
+// the operations of the disk, for its latency statistics
+enum DiskOp { DISK_READ, DISK_WRITE, DISK_READV, DISK_WRITEV, DISK_DISCARD, DISK_SYNC };
+
+struct iovec;
 
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
+    // One file of the disk, with a worker of its own when there are
+    // several, so that the files of a run are read and written at once
+    struct DiskFile {
+        std::string path;
+        int fd = -1;
+        // the file opened with O_DIRECT for the blocks, -1 without direct
+        // I/O; the checksum table behind them always goes through fd
+        int direct_fd = -1;
+        std::unique_ptr<TaskPool> worker;
+    };
+    DiskOptions options;
+    std::vector<DiskFile> files; // none for a RAM disk
+    std::vector<uint8_t> memory; // the image of a RAM disk
+    const unsigned no_blocks = FsGeometry::blocks;
     const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    unsigned file_blocks; // blocks in each file
+    // false for an image of another geometry or stripe count, which is
+    // left alone: every I/O on it fails
+    bool usable = true;
     bool disk_file_exists (const std::string& name);
+    // the checksums live in a table behind the blocks in the (first) disk
+    // file, followed by CHECKSUM_MAGIC; a block's stripe lock covers its entry
+    std::vector<uint32_t> checksums;
+    LockTable checksumLocks;
+    off_t checksum_offset() const { return disk_size; }
+    void load_checksums();
+    int store_checksums(unsigned block_no, unsigned no_blks);
+    bool verify(unsigned block_no, const uint8_t *blk, uint32_t expected);
+    // A compressible block is stored compressed in a slot of the sectors at
+    // the start of its block it needs, if that saves a sector, the rest of
+    // the block is punched. The block map behind the checksum table,
+    // followed by SLOT_MAGIC, has the compressed length of every block, 0
+    // for one stored as it is; a block's stripe lock covers its entry.
+    std::unique_ptr<std::atomic<bool>[]> compressible;
+    std::vector<uint16_t> slots;
+    std::atomic<uint64_t> packed_blocks;
+    std::atomic<uint64_t> packed_bytes; // the sectors of their slots
+    off_t slot_offset() const;
+    void load_slots();
+    int store_slots(unsigned block_no, unsigned no_blks);
+    void set_slot(unsigned block_no, uint16_t length);
+    // write and read one block, compressed or not, with its stripe lock held
+    int put_block(unsigned block_no, const uint8_t *blk);
+    int get_block(unsigned block_no, uint8_t *blk);
+    // the I/O on the image, files or memory, at offsets of the image as if
+    // it was one file, returning what pread and friends return
+    ssize_t raw_read(void *buf, size_t length, off_t offset);
+    ssize_t raw_write(const void *buf, size_t length, off_t offset);
+    ssize_t raw_readv(const struct iovec *iov, unsigned count, off_t offset);
+    ssize_t raw_writev(const struct iovec *iov, unsigned count, off_t offset);
+    // zeros a range, -1 with errno EOPNOTSUPP where the host can't
+    int raw_punch(off_t offset, off_t length);
+    // the file holding the image at offset, the offset in it, and how many
+    // bytes from there follow in the same file
+    unsigned locate(off_t offset, off_t& file_offset, off_t& contiguous) const;
+    // a vectored I/O of whole blocks, split into one per file
+    ssize_t transfer(const struct iovec *iov, unsigned count, off_t offset, bool write);
+    // the I/O on one file, at offsets in it
+    ssize_t file_read(DiskFile& file, void *buf, size_t length, off_t offset);
+    ssize_t file_write(DiskFile& file, const void *buf, size_t length, off_t offset);
+    ssize_t file_vector(DiskFile& file, const struct iovec *iov, unsigned count, off_t offset, bool write);
+    // whether an I/O on the blocks goes to direct_fd as it is, rather than
+    // to fd or through a bounce buffer
+    bool direct_io(const DiskFile& file, const void *buf, size_t length, off_t offset) const;
+    void open_direct(DiskFile& file);
+    LatencyStats latencies;
 public:
-    Disk();
+    Disk(const DiskOptions& options = DiskOptions());
     ~Disk();
     unsigned get_no_blocks() { return no_blocks; }
+    // whether the image could be opened as a disk of this geometry
+    bool is_usable() const { return usable; }
     unsigned get_disk_size() { return disk_size; }
+    const DiskOptions& get_options() { return options; }
+    // whether the blocks bypass the host's page cache
+    bool is_direct() const { return !files.empty() && files[0].direct_fd >= 0; }
+    // the number of files the blocks are spread over
+    unsigned get_stripes() const { return files.empty() ? 1 : files.size(); }
+    // blocks stored compressed, and the bytes their slots take
+    uint64_t get_packed_blocks() const { return packed_blocks; }
+    uint64_t get_packed_bytes() const { return packed_bytes; }
+    // whether block_no is stored compressed from its next write on; blocks
+    // are read back either way
+    void set_compressed(unsigned block_no, bool on);
+    LatencyStats& stats() { return latencies; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
+    // writes no_blks consecutive blocks starting at block_no with one call
+    int writev(unsigned block_no, uint8_t* const* blks, unsigned no_blks);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads no_blks consecutive blocks starting at block_no with one call
+    int readv(unsigned block_no, uint8_t* const* blks, unsigned no_blks);
+    // releases no_blks blocks starting at block_no on the host, they read
+    // back as zeros afterwards if 0 is returned, 1 if the host can't punch
+    // holes and they keep their data
+    int discard(unsigned block_no, unsigned no_blks = 1);
+    // makes all completed writes durable
+    int sync();
 };
 
 #endif // __DISK_H__
@@ -2,6 +2,28 @@
 #include <sstream>
 #include <vector>
 #include <string>
+#include <fnmatch.h>
+#include <map>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+template <typename G>
+static bool
+isGeometry(uint32_t blockSize, uint32_t blocks, uint32_t entrySize, uint32_t nameLength)
+{
+    return blockSize == G::blockSize && blocks == G::blocks && entrySize == sizeof(typename G::FATEntry) &&
+           nameLength == G::nameLength;
+}
+
+const char* geometryName(uint32_t blockSize, uint32_t blocks, uint32_t entrySize, uint32_t nameLength)
+{
+    if (isGeometry<Geometry1K>(blockSize, blocks, entrySize, nameLength)) return "Geometry1K";
+    if (isGeometry<Geometry4K>(blockSize, blocks, entrySize, nameLength)) return "Geometry4K";
+    if (isGeometry<Geometry8K>(blockSize, blocks, entrySize, nameLength)) return "Geometry8K";
+    if (isGeometry<Geometry16K>(blockSize, blocks, entrySize, nameLength)) return "Geometry16K";
+    return nullptr;
+}
 
 // Helper function to split path into components
 std::vector<std::string> FS::splitPath(const std::string& path) {
@@ -31,7 +53,7 @@ std::vector<std::string> FS::splitPath(const std::string& path) {
 PathResult FS::resolvePath(const std::string& path) {
     dir_entry destEntry;
     std::vector<std::string> components = splitPath(path);
-    FATEntry currentBlock = (path[0] == '/') ? ROOT_BLOCK : this->currentDir;
+    FATEntry currentBlock = (path[0] == '/') ? ROOT_BLOCK : session().currentDir;
     
     dir_entry* dirEntries = nullptr;
     //if singel level, use current dir
@@ -39,9 +61,12 @@ PathResult FS::resolvePath(const std::string& path) {
         return {currentBlock, true, {}, false};
     }
     for (const std::string& component : components) {
-        uint8_t block[BLOCK_SIZE] = {0};
-        readBlock(currentBlock, block);
-        dirEntries = reinterpret_cast<dir_entry*>(block);
+        BlockBuffer block;
+        readDirBlock(currentBlock, block);
+        dirEntries = reinterpret_cast<dir_entry*>(block.data());
+        if (component == ".") {
+            continue;
+        }
         if (component == "..") {
             // Handle moving up one directory
             if (currentBlock == ROOT_BLOCK) {
@@ -73,12 +98,27 @@ bool FS::hasPermission(const dir_entry& entry, uint8_t requiredRights) const {
 
 // Check if an entry is a file
 bool FS::isFile(const dir_entry& entry) const {
-    return entry.type == TYPE_FILE;
+    return (entry.type & TYPE_MASK) == TYPE_FILE;
 }
 
 // Check if an entry is a directory
 bool FS::isDirectory(const dir_entry& entry) const {
-    return entry.type == TYPE_DIR;
+    return (entry.type & TYPE_MASK) == TYPE_DIR;
+}
+
+// Check if the file data is stored in the directory's inline area
+bool FS::isInline(const dir_entry& entry) const {
+    return isFile(entry) && (entry.type & TYPE_INLINE);
+}
+
+// Check if the partial last block of the file is packed in the inline area
+bool FS::isTailPacked(const dir_entry& entry) const {
+    return isFile(entry) && (entry.type & TYPE_TAIL);
+}
+
+// Check if the data blocks of the file are stored compressed
+bool FS::isCompressed(const dir_entry& entry) const {
+    return COMPRESSION && isFile(entry) && (entry.type & TYPE_COMPRESSED);
 }
 // Check if the entry is valid
 bool FS::isValidEntry(const dir_entry& entry) const {
@@ -95,43 +135,51 @@ std::string FS::accessRightsToString(uint8_t accessRights) const {
     return rights;
 }
 bool FS::createDirEntry(dir_entry* dirEntries, dir_entry*& newEntry, const std::string& fileName) {
-    for (size_t i = 0; i < BLOCK_SIZE / sizeof(dir_entry); ++i) {
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
         if (dirEntries[i].file_name[0] == '\0') {  // Empty entry
             newEntry = &dirEntries[i];
             break;
         }
     }
     if (!newEntry) {
-        std::cerr << "Error: No space in directory to create new file.\n";
+        err() << "Error: No space in directory to create new file.\n";
         return false;
     }
     std::strncpy(newEntry->file_name, fileName.c_str(), sizeof(newEntry->file_name) - 1);
     newEntry->file_name[sizeof(newEntry->file_name) - 1] = '\0'; // Null-terminate
     return true;
 }
-void FS::writePagesToFat(const size_t totalSize, const std::string content, const std::vector<FATEntry> freeEntries) {
+void FS::writePagesToFat(const size_t totalSize, const std::string content, const std::vector<FATEntry> freeEntries, bool compressed) {
     FATEntry requiredBlocks = freeEntries.size();
     size_t offset = 0;
     for (auto i = 0; i < requiredBlocks; ++i) {
-        uint8_t block[BLOCK_SIZE] = { 0 };
+        BlockBuffer block;
         size_t chunkSize = std::min(static_cast<size_t>(BLOCK_SIZE), totalSize - offset);
         std::memcpy(block, content.c_str() + offset, chunkSize);
         offset += chunkSize;
-        writeBlock(freeEntries[i], (uint8_t*)block);
-        //update fatetris
-        if (i < requiredBlocks - 1) {
-            fat[freeEntries[i]] = freeEntries[i + 1];
+        writeDataBlock(freeEntries[i], (uint8_t*)block, compressed);
+    }
+    linkBlocks(freeEntries);
+}
+
+// Link blocks into a chain, in order, and stage the FAT
+void FS::linkBlocks(const std::vector<FATEntry>& blocks) {
+    //update fatetris
+    std::lock_guard<std::mutex> lock(allocMutex);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (i < blocks.size() - 1) {
+            fat[blocks[i]] = blocks[i + 1];
         } else {
-            fat[freeEntries[i]] = FAT_EOF;
+            fat[blocks[i]] = FAT_EOF;
         }
     }
 
     // Update the FAT and the directory on the disk
-    writeBlock(FAT_BLOCK, (uint8_t*)fat);
+    stageFAT();
 }
 int FS::findDirEntry(dir_entry* dirTable, dir_entry& NewEntry, const std::string& name) {
     bool destFound = false;
-    for (size_t i = 0; i < BLOCK_SIZE / sizeof(dir_entry); ++i) {
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
         if (std::strcmp(dirTable[i].file_name, name.c_str()) == 0) {
             NewEntry = dirTable[i];
             return i;
@@ -140,60 +188,795 @@ int FS::findDirEntry(dir_entry* dirTable, dir_entry& NewEntry, const std::string
     return 0;
 }
 bool FS::readBlock(size_t blockNum, void* buffer) {
-    uint8_t blk[BLOCK_SIZE];
-    if (disk.read(blockNum, blk) == 0) {
-        std::memcpy(buffer, blk, BLOCK_SIZE);
+    if (blockTrace.active()) {
+        blockTrace.add(blockNum, BLOCK_READ, origin);
+    }
+    if (journal.read(blockNum, buffer)) {
+        return true;
+    }
+    if (cache.read(blockNum, static_cast<uint8_t*>(buffer)) == 0) {
         return true;
     } else {
-        std::cerr << "Error reading block " << blockNum << std::endl;
+        err() << "Error reading block " << blockNum << std::endl;
         return false;
     }
 }
 
-bool FS::writeBlock(size_t blockNum, const void* buffer) {
-    uint8_t blk[BLOCK_SIZE];
-    std::memcpy(blk, buffer, BLOCK_SIZE);
-    if (disk.write(blockNum, blk) != 0) {
-        std::cerr << "Error writing block " << blockNum << std::endl;
+// Stage a metadata block in the journal, it reaches its home location after
+// the next commit
+bool FS::writeMetaBlock(size_t blockNum, const void* buffer) {
+    if (blockTrace.active()) {
+        blockTrace.add(blockNum, BLOCK_META_WRITE, origin);
+    }
+    journal.write(blockNum, buffer);
+    // the block may have held file data, whose cached copy is stale now
+    cache.invalidate(blockNum);
+    return true;
+}
+
+// Stage the FAT, under allocMutex so the copy is never torn by an update
+void FS::writeFAT() {
+    std::lock_guard<std::mutex> lock(allocMutex);
+    stageFAT();
+}
+
+// Read a directory block under a shared lock, for lookups outside of the
+// locks an operation holds
+bool FS::readDirBlock(FATEntry blockNum, void* buffer) {
+    std::shared_lock<std::shared_mutex> lock(dirLocks.get(LockTable::stripe(blockNum)));
+    return readBlock(blockNum, buffer);
+}
+
+// Data blocks go to the cache, the flusher writes them back later, and
+// compressed if they are blocks of a compressed file
+bool FS::writeBlock(size_t blockNum, const void* buffer, bool compressed) {
+    disk.set_compressed(blockNum, compressed);
+    if (blockTrace.active()) {
+        blockTrace.add(blockNum, BLOCK_WRITE, origin);
+    }
+    if (cache.write(blockNum, static_cast<const uint8_t*>(buffer)) != 0) {
+        err() << "Error writing block " << blockNum << std::endl;
         return false;
     }
     return true;
 }
-//find list of free fat entris acording to the size of the file
-std::vector<FATEntry> FS::freeFATEntries(uint8_t size) { 
+// Write a block of file data. All-zero blocks are left as holes in the disk
+// file, they are written like any other where the host can't punch holes.
+bool FS::writeDataBlock(size_t blockNum, const uint8_t* buffer, bool compressed) {
+    if (std::all_of(buffer, buffer + BLOCK_SIZE, [](uint8_t b) { return b == 0; }) &&
+        cache.discard(blockNum) == 0) {
+        return true;
+    }
+    return writeBlock(blockNum, buffer, compressed);
+}
+//find list of free fat entris acording to the size of the file. The entries
+// come from the calling thread's pool, which is refilled from the global free
+// map in batches, so concurrent writers rarely meet on allocMutex. They are
+// marked FAT_EOF in fat[] while reserved, so nobody else gets the same ones;
+// it is all or nothing, an empty list if there are too few.
+std::vector<FATEntry> FS::freeFATEntries(size_t size) {
     std::vector<FATEntry> freeEntries;
-    for (FATEntry i = 0; i < MAX_BLOCKS; ++i) {
-        if (fat[i] == FAT_FREE) {
-            freeEntries.push_back(i);
-            if (freeEntries.size() == size) {
-                break;
+    if (size == 0) {
+        return freeEntries;
+    }
+    BlockPool& pool = localPool();
+    for (int attempt = 0; ; ++attempt) {
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.used = true;
+            if (pool.blocks.size() >= size) {
+                freeEntries.assign(pool.blocks.begin(), pool.blocks.begin() + size);
+                pool.blocks.erase(pool.blocks.begin(), pool.blocks.begin() + size);
+                return freeEntries;
+            }
+        }
+        if (refillPool(pool, size)) {
+            continue;
+        }
+        // too few left: first take back the blocks other writers hold, then
+        // commit, blocks freed by the pending transaction are usable after it
+        if (attempt == 0 && trimPools(false)) {
+            continue;
+        }
+        if (attempt <= 1 && journal.hasReleased() && journal.commitWithin() == 0) {
+            continue;
+        }
+        return freeEntries;
+    }
+}
+
+// The allocation pool of the calling thread, made on its first allocation
+FS::BlockPool& FS::localPool() {
+    static thread_local const FS* owner = nullptr;
+    static thread_local unsigned long ownerInstance = 0;
+    static thread_local BlockPool* cached = nullptr;
+    if (owner != this || ownerInstance != instance) {
+        std::lock_guard<std::mutex> lock(allocMutex);
+        pools.emplace_back(new BlockPool());
+        owner = this;
+        ownerInstance = instance;
+        cached = pools.back().get();
+    }
+    return *cached;
+}
+
+// Take free blocks from the global free map until pool holds size of them
+// plus a batch of RESERVE_BLOCKS, preferring one contiguous run so the
+// files of a writer stay contiguous. Returns false if there are too few.
+bool FS::refillPool(BlockPool& pool, size_t size) {
+    std::lock_guard<std::mutex> lock(allocMutex);
+    std::lock_guard<std::mutex> poolLock(pool.mutex);
+    if (pool.blocks.size() >= size) {
+        return true;
+    }
+    size_t want = size - pool.blocks.size() + RESERVE_BLOCKS;
+    std::vector<FATEntry> scattered;
+    FATEntry runStart = 0;
+    size_t runLength = 0;
+    for (FATEntry i = FIRST_DATA_BLOCK; i < MAX_BLOCKS; ++i) {
+        if (fat[i] != FAT_FREE || journal.isReleased(i)) {
+            runLength = 0;
+            continue;
+        }
+        if (runLength++ == 0) {
+            runStart = i;
+        }
+        if (scattered.size() < want) {
+            scattered.push_back(i);
+        }
+        if (runLength == want) {
+            break;
+        }
+    }
+    std::vector<FATEntry> taken;
+    if (runLength == want) {
+        for (size_t i = 0; i < want; ++i) {
+            taken.push_back(runStart + i);
+        }
+    } else {
+        taken = scattered;
+    }
+    for (auto& blk : taken) {
+        fat[blk] = FAT_EOF;
+    }
+    pool.blocks.insert(pool.blocks.end(), taken.begin(), taken.end());
+    return pool.blocks.size() >= size;
+}
+
+// Give the unused blocks of the pools back to the global free map, those of
+// all pools or only of pools not used since the last trim. Returns true if
+// any came back.
+bool FS::trimPools(bool idleOnly) {
+    bool returned = false;
+    std::lock_guard<std::mutex> lock(allocMutex);
+    for (auto& pool : pools) {
+        std::lock_guard<std::mutex> poolLock(pool->mutex);
+        if (!idleOnly || !pool->used) {
+            for (auto& blk : pool->blocks) {
+                fat[blk] = FAT_FREE;
+            }
+            returned = returned || !pool->blocks.empty();
+            pool->blocks.clear();
+        }
+        pool->used = false;
+    }
+    return returned;
+}
+
+// Stage the FAT with allocMutex held. Blocks still sitting in a pool are
+// written as free, they only belong to a file once handed out.
+void FS::stageFAT() {
+    BlockBuffer block(false);
+    FATEntry* copy = reinterpret_cast<FATEntry*>(block.data());
+    std::memcpy(copy, fat, sizeof(fat));
+    for (auto& pool : pools) {
+        std::lock_guard<std::mutex> poolLock(pool->mutex);
+        for (auto& blk : pool->blocks) {
+            copy[blk] = FAT_FREE;
+        }
+    }
+    writeMetaBlock(FAT_BLOCK, block);
+}
+
+// Number of bytes entry keeps in the directory's inline area
+size_t FS::fragmentLength(const dir_entry& entry) const {
+    if (isInline(entry)) return entry.size;
+    if (isTailPacked(entry)) return entry.size % BLOCK_SIZE;
+    return 0;
+}
+
+// Store fragment as the inline area data of entry index, repacking the other
+// fragments of the directory. Only the bytes are placed, the caller updates
+// the entry. Returns false if the inline area has no room left.
+bool FS::storeFragment(dir_entry* dirEntries, int index, const std::string& fragment) {
+    BlockBuffer areaBuffer, packedBuffer;
+    inline_area& area = *reinterpret_cast<inline_area*>(areaBuffer.data());
+    inline_area& packed = *reinterpret_cast<inline_area*>(packedBuffer.data());
+    FATEntry areaBlock = dirEntries[0].size;
+    if (areaBlock != 0) {
+        readBlock(areaBlock, areaBuffer);
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        size_t length = fragmentLength(dirEntries[i]);
+        if ((int)i == index || length == 0) continue;
+        std::memcpy(packed.data + used, area.data + area.offset[i], length);
+        packed.offset[i] = used;
+        used += length;
+    }
+    if (used + fragment.size() > sizeof(packed.data)) {
+        return false;
+    }
+    if (areaBlock == 0) {
+        std::vector<FATEntry> freeEntries = freeFATEntries(1);
+        if (freeEntries.empty()) {
+            return false;
+        }
+        areaBlock = freeEntries[0];
+        dirEntries[0].size = areaBlock;
+        writeFAT();
+    }
+    std::memcpy(packed.data + used, fragment.data(), fragment.size());
+    packed.offset[index] = used;
+    writeMetaBlock(areaBlock, packedBuffer);
+    return true;
+}
+
+// Read the inline area data of entry index
+bool FS::readFragment(const dir_entry* dirEntries, int index, std::string& fragment) {
+    BlockBuffer block;
+    fragment.clear();
+    size_t length = fragmentLength(dirEntries[index]);
+    if (length == 0) return true;
+    if (!readBlock(dirEntries[0].size, block)) return false;
+    inline_area* area = reinterpret_cast<inline_area*>(block.data());
+    fragment.assign((char*)area->data + area->offset[index], length);
+    return true;
+}
+
+// Read the whole content of entry index, the full blocks of its FAT chain
+// followed by its fragment in the inline area, if any
+bool FS::readFileData(const dir_entry* dirEntries, int index, std::string& content) {
+    const dir_entry& entry = dirEntries[index];
+    BlockBuffer block;
+    content.clear();
+    if (isInline(entry)) {
+        return readFragment(dirEntries, index, content);
+    }
+    size_t remaining = entry.size - fragmentLength(entry);
+    // the chain ahead of the reader is announced to the cache's read-ahead,
+    // a window that doubles every time the reader gets halfway through it
+    size_t window = READAHEAD_MIN;
+    size_t lead = 0; // blocks announced but not read yet
+    size_t unannounced = (remaining + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    FATEntry ahead = entry.first_blk;
+    for (auto i = entry.first_blk; i != FAT_EOF && i != FAT_FREE && remaining > 0; i = fat[i]) {
+        if (i == ahead) {
+            // the reader is at the head of the chain, nothing to read ahead of
+            ahead = fat[i];
+            --unannounced;
+        } else {
+            --lead;
+        }
+        if (lead <= window / 2 && unannounced > 0) {
+            std::vector<unsigned> blocks;
+            for (; blocks.size() < window && unannounced > 0 && ahead != FAT_EOF && ahead != FAT_FREE; ahead = fat[ahead]) {
+                blocks.push_back(ahead);
+                --unannounced;
+            }
+            cache.prefetch(blocks);
+            lead += blocks.size();
+            window = std::min<size_t>(window * 2, READAHEAD_MAX);
+        }
+        if (!readBlock(i, block)) return false;
+        size_t chunkSize = std::min(static_cast<size_t>(BLOCK_SIZE), remaining);
+        content.append((char*)block.data(), chunkSize);
+        remaining -= chunkSize;
+    }
+    if (isTailPacked(entry)) {
+        std::string tail;
+        if (!readFragment(dirEntries, index, tail)) return false;
+        content += tail;
+    }
+    return true;
+}
+
+// Write content into newly allocated blocks linked after lastBlock (or as a
+// new chain starting at first_blk when lastBlock is FAT_EOF). With tail
+// packing the partial last block goes to the inline area instead.
+int FS::writeBlocks(dir_entry* dirEntries, int index, FATEntry lastBlock, const std::string& content) {
+    dir_entry& entry = dirEntries[index];
+    size_t tailSize = content.size() % BLOCK_SIZE;
+    bool packTail = TAIL_PACKING && tailSize > 0 && tailSize <= INLINE_MAX &&
+                    (lastBlock != FAT_EOF || content.size() > BLOCK_SIZE);
+    size_t blockBytes = content.size();
+    if (packTail && storeFragment(dirEntries, index, content.substr(content.size() - tailSize))) {
+        blockBytes -= tailSize;
+    } else {
+        packTail = false;
+    }
+    // a file outside the inline area always owns at least one block
+    size_t requiredBlocks = (blockBytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (lastBlock == FAT_EOF) {
+        requiredBlocks = std::max<size_t>(1, requiredBlocks);
+    }
+    std::vector<FATEntry> freeEntries = freeFATEntries(requiredBlocks);
+    if (freeEntries.size() < requiredBlocks) {
+        err() << "Error: Not enough free blocks available.\n";
+        return -1;
+    }
+    if (lastBlock == FAT_EOF) {
+        entry.first_blk = freeEntries[0];
+    } else if (requiredBlocks > 0) {
+        // writePagesToFat writes the FAT, so link the chain before it does
+        std::lock_guard<std::mutex> lock(allocMutex);
+        fat[lastBlock] = freeEntries[0];
+    }
+    if (requiredBlocks > 0) {
+        writePagesToFat(blockBytes, content, freeEntries, isCompressed(entry));
+    }
+    if (packTail) {
+        entry.type |= TYPE_TAIL;
+    }
+    return 0;
+}
+
+// Write content as the data of entry index, inline if small enough and there
+// is room in the directory, otherwise in newly allocated blocks
+int FS::writeFileData(dir_entry* dirEntries, int index, const std::string& content) {
+    dir_entry& entry = dirEntries[index];
+    entry.type &= ~(TYPE_INLINE | TYPE_TAIL);
+    entry.size = content.size();
+    if (content.size() <= INLINE_MAX && storeFragment(dirEntries, index, content)) {
+        entry.first_blk = dirEntries[0].size;
+        entry.type |= TYPE_INLINE;
+        return 0;
+    }
+    return writeBlocks(dirEntries, index, FAT_EOF, content);
+}
+
+// Append content to the data of entry index. Inline files are rewritten and
+// promoted to regular blocks once they outgrow the inline area, a packed
+// tail is pulled back out of the area and written together with content.
+int FS::appendFileData(dir_entry* dirEntries, int index, const std::string& content) {
+    dir_entry& entry = dirEntries[index];
+    dir_entry saved = entry;
+    if (isInline(entry)) {
+        std::string combined;
+        if (!readFileData(dirEntries, index, combined)) return -1;
+        if (writeFileData(dirEntries, index, combined + content) != 0) {
+            entry = saved;
+            return -1;
+        }
+        releaseInlineArea(dirEntries);
+        return 0;
+    }
+    std::string tail;
+    if (isTailPacked(entry)) {
+        if (!readFragment(dirEntries, index, tail)) return -1;
+        entry.type &= ~TYPE_TAIL;
+        entry.size -= tail.size();
+    }
+    std::string rest = tail + content;
+    // fill the unused part of the last block before allocating new ones
+    FATEntry lastBlock = entry.first_blk;
+    while (fat[lastBlock] != FAT_EOF) {
+        lastBlock = fat[lastBlock];
+    }
+    size_t used = entry.size % BLOCK_SIZE;
+    size_t fill = (used == 0) ? 0 : std::min(rest.size(), BLOCK_SIZE - used);
+    if (fill > 0) {
+        BlockBuffer block;
+        readBlock(lastBlock, block);
+        std::memcpy(block + used, rest.data(), fill);
+        writeBlock(lastBlock, block, isCompressed(entry));
+    }
+    if (fill < rest.size() && writeBlocks(dirEntries, index, lastBlock, rest.substr(fill)) != 0) {
+        // put the old tail back, its slot may have been overwritten
+        entry = saved;
+        if (!tail.empty()) {
+            storeFragment(dirEntries, index, tail);
+        }
+        return -1;
+    }
+    entry.size += rest.size();
+    releaseInlineArea(dirEntries);
+    return 0;
+}
+
+// Files with more blocks than the pipeline has buffers are copied and
+// appended block by block rather than read into memory as a whole
+bool FS::isLargeFile(const dir_entry& entry) const {
+    return !isInline(entry) && entry.size - fragmentLength(entry) > (size_t)PIPELINE_BUFFERS * BLOCK_SIZE;
+}
+
+// Stream prefix, the first bytes of the chain starting at first, and suffix
+// into the blocks of dest, in order. A reader thread fills a ring of
+// PIPELINE_BUFFERS blocks from the chain while the caller empties it into
+// dest, so reading and writing overlap in a fixed amount of memory. The
+// reader has a thread of its own; a task on the tree pool could end up
+// queued behind the writer waiting for it.
+bool FS::pipeBlocks(const std::string& prefix, FATEntry first, size_t bytes, const std::string& suffix, const std::vector<FATEntry>& dest, bool compressed) {
+    std::vector<FATEntry> chain;
+    for (FATEntry i = first; i != FAT_EOF && i != FAT_FREE && chain.size() * BLOCK_SIZE < bytes; i = fat[i]) {
+        chain.push_back(i);
+    }
+    if (chain.size() * BLOCK_SIZE < bytes) {
+        err() << "Error: File chain is shorter than the file.\n";
+        return false;
+    }
+
+    std::vector<BlockBuffer> ring;
+    for (int k = 0; k < PIPELINE_BUFFERS; ++k) {
+        ring.emplace_back(false);
+    }
+    Semaphore empty(PIPELINE_BUFFERS);
+    Semaphore filled(0);
+    std::atomic<bool> failed(false);
+    std::atomic<bool> cancelled(false);
+    Session& caller = session();
+    BlockOrigin callerOrigin = origin;
+    std::thread reader([&] {
+        SessionScope scope(caller);
+        origin = callerOrigin;
+        for (size_t k = 0; k < chain.size(); ++k) {
+            if (k % READAHEAD_MAX == 0) {
+                size_t end = std::min(chain.size(), k + 1 + READAHEAD_MAX);
+                cache.prefetch(std::vector<unsigned>(chain.begin() + k + 1, chain.begin() + end));
+            }
+            empty.acquire();
+            if (cancelled) break;
+            if (!failed && !readBlock(chain[k], ring[k % PIPELINE_BUFFERS].data())) {
+                failed = true;
             }
+            filled.release();
+        }
+    });
+
+    // the write stage, it fills one destination block at a time
+    BlockBuffer out;
+    size_t fill = 0;
+    size_t next = 0;
+    auto emit = [&](const uint8_t* data, size_t n) {
+        while (n > 0) {
+            size_t take = std::min(BLOCK_SIZE - fill, n);
+            std::memcpy(out + fill, data, take);
+            fill += take;
+            data += take;
+            n -= take;
+            if (fill < BLOCK_SIZE) break;
+            if (next >= dest.size()) return false;
+            if (!writeDataBlock(dest[next], out, compressed)) {
+                return false;
+            }
+            ++next;
+            fill = 0;
+            std::memset(out, 0, BLOCK_SIZE);
+        }
+        return true;
+    };
+    bool ok = emit(reinterpret_cast<const uint8_t*>(prefix.data()), prefix.size());
+    size_t remaining = bytes;
+    for (size_t k = 0; k < chain.size() && ok; ++k) {
+        filled.acquire();
+        size_t chunk = std::min(static_cast<size_t>(BLOCK_SIZE), remaining);
+        ok = !failed && emit(ring[k % PIPELINE_BUFFERS].data(), chunk);
+        remaining -= chunk;
+        empty.release();
+    }
+    if (!ok) {
+        // wake the reader if it waits for a buffer, it stops then
+        cancelled = true;
+        empty.release();
+    }
+    reader.join();
+    ok = ok && emit(reinterpret_cast<const uint8_t*>(suffix.data()), suffix.size());
+    if (ok && fill > 0) {
+        // the partial last block, padded by emitting zeros up to the end
+        std::vector<uint8_t> zeros(BLOCK_SIZE - fill, 0);
+        ok = emit(zeros.data(), zeros.size());
+    }
+    return ok && next == dest.size();
+}
+
+// Copy the data of a large file to a new chain for entry, through the
+// pipeline. The copy keeps no tail in the inline area.
+int FS::copyLargeFile(const dir_entry* srcEntries, int srcIndex, dir_entry& entry) {
+    const dir_entry& src = srcEntries[srcIndex];
+    std::string tail;
+    if (isTailPacked(src) && !readFragment(srcEntries, srcIndex, tail)) {
+        return -1;
+    }
+    std::vector<FATEntry> blocks = freeFATEntries((src.size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (blocks.empty()) {
+        err() << "Error: Not enough free blocks available.\n";
+        return -1;
+    }
+    if (!pipeBlocks("", src.first_blk, src.size - tail.size(), tail, blocks, isCompressed(entry))) {
+        releaseBlocks(blocks);
+        return -1;
+    }
+    linkBlocks(blocks);
+    entry.first_blk = blocks[0];
+    entry.size = src.size;
+    entry.type &= ~(TYPE_INLINE | TYPE_TAIL);
+    return 0;
+}
+
+// Append a large file to the file at index, through the pipeline. The
+// partial last block of the destination, and its tail or inline data, are
+// written again followed by the source.
+int FS::appendLargeFile(const dir_entry* srcEntries, int srcIndex, dir_entry* dirEntries, int index) {
+    const dir_entry& src = srcEntries[srcIndex];
+    dir_entry& entry = dirEntries[index];
+    std::string srcTail;
+    if (isTailPacked(src) && !readFragment(srcEntries, srcIndex, srcTail)) {
+        return -1;
+    }
+    std::string prefix;
+    std::string tail;
+    if ((isInline(entry) || isTailPacked(entry)) && !readFragment(dirEntries, index, tail)) {
+        return -1;
+    }
+    FATEntry lastBlock = FAT_EOF;
+    size_t used = 0;
+    if (!isInline(entry)) {
+        lastBlock = entry.first_blk;
+        while (fat[lastBlock] != FAT_EOF) {
+            lastBlock = fat[lastBlock];
         }
+        used = (entry.size - tail.size()) % BLOCK_SIZE;
+        if (used > 0) {
+            BlockBuffer block;
+            if (!readBlock(lastBlock, block)) return -1;
+            prefix.assign(reinterpret_cast<char*>(block.data()), used);
+        }
+    }
+    prefix += tail;
+
+    size_t total = prefix.size() + src.size;
+    size_t newBlocks = (total + BLOCK_SIZE - 1) / BLOCK_SIZE - (used > 0 ? 1 : 0);
+    std::vector<FATEntry> blocks = freeFATEntries(newBlocks);
+    if (blocks.size() < newBlocks) {
+        err() << "Error: Not enough free blocks available.\n";
+        return -1;
+    }
+    std::vector<FATEntry> dest;
+    if (used > 0) {
+        dest.push_back(lastBlock);
+    }
+    dest.insert(dest.end(), blocks.begin(), blocks.end());
+    if (!pipeBlocks(prefix, src.first_blk, src.size - srcTail.size(), srcTail, dest, isCompressed(entry))) {
+        releaseBlocks(blocks);
+        return -1;
+    }
+    linkBlocks(blocks);
+    if (lastBlock == FAT_EOF) {
+        entry.first_blk = blocks[0];
+    } else if (!blocks.empty()) {
+        std::lock_guard<std::mutex> lock(allocMutex);
+        fat[lastBlock] = blocks[0];
+        stageFAT();
+    }
+    entry.size += src.size;
+    entry.type &= ~(TYPE_INLINE | TYPE_TAIL);
+    releaseInlineArea(dirEntries);
+    return 0;
+}
+
+// Free the inline area of a directory once none of its files use it, empty
+// inline files point at it as well
+void FS::releaseInlineArea(dir_entry* dirEntries) {
+    FATEntry areaBlock = dirEntries[0].size;
+    if (areaBlock == 0) return;
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        if (isInline(dirEntries[i]) || fragmentLength(dirEntries[i]) > 0) return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(allocMutex);
+        fat[areaBlock] = FAT_FREE;
+        journal.release(areaBlock);
+        cache.invalidate(areaBlock);
+        stageFAT();
+    }
+    dirEntries[0].size = 0;
+}
+
+// Free blocks, they are released to the journal before they show up as free
+// so nobody reuses them before the transaction that freed them commits
+void FS::releaseBlocks(const std::vector<FATEntry>& blocks) {
+    if (blocks.empty()) return;
+    std::lock_guard<std::mutex> lock(allocMutex);
+    for (auto& blk : blocks) {
+        journal.release(blk);
+        cache.invalidate(blk);
+        disk.set_compressed(blk, false);
+        fat[blk] = FAT_FREE;
+    }
+    stageFAT();
+}
+
+// Fill block with an empty directory, its "." and ".." entries
+void FS::initDirBlock(uint8_t* block, FATEntry self, FATEntry parent, uint8_t access) {
+    std::memset(block, 0, BLOCK_SIZE);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block);
+
+    // Entry for "."
+    std::strncpy(dirEntries[0].file_name, ".", sizeof(dirEntries[0].file_name) - 1);
+    dirEntries[0].first_blk = self;
+    dirEntries[0].type = TYPE_DIR;
+    dirEntries[0].access_rights = access;
+
+    // Entry for ".."
+    std::strncpy(dirEntries[1].file_name, "..", sizeof(dirEntries[1].file_name) - 1);
+    dirEntries[1].first_blk = parent;
+    dirEntries[1].type = TYPE_DIR;
+    dirEntries[1].access_rights = access;
+}
+
+// Release the data of entry index, the blocks of its chain and its fragment
+// in the inline area. The inline area itself is freed with its last file.
+void FS::freeFileData(dir_entry* dirEntries, int index) {
+    dir_entry& entry = dirEntries[index];
+    if (isInline(entry)) {
+        entry.type &= ~TYPE_INLINE;
+        releaseInlineArea(dirEntries);
+        return;
+    }
+    std::vector<FATEntry> fileEntries;
+    for (auto i = entry.first_blk; i != FAT_EOF && i != FAT_FREE; i = fat[i]) {
+        fileEntries.push_back(i);
+    }
+    releaseBlocks(fileEntries);
+    if (isTailPacked(entry)) {
+        entry.type &= ~TYPE_TAIL;
+        releaseInlineArea(dirEntries);
     }
-    return freeEntries;
 }
 
+// names of the FsStat calls
+static const std::vector<std::string> statNames = {
+    "format", "create", "cat", "ls", "cp", "mv", "rm", "append", "mkdir", "cd", "pwd",
+    "chmod", "du", "find", "fsck", "sync", "metrics", "begin", "commit", "compress"
+};
+
 //System funktions
-FS::FS()
+FS::FS(const CacheOptions& options, const DiskOptions& diskOptions)
+    : disk(diskOptions), cache(disk, options), journal(disk, JOURNAL_START), instance(++instances), ioSlots(MAX_INFLIGHT_IO),
+      latencies(statNames)
 {
-    format();
+    journal.setFlush([this] { return cache.flush(); });
+    int mounted = mount();
+    if (mounted > 0) {
+        format();
+    }
+    refused = mounted < 0;
+    // metadata ages like data: staged blocks are committed once they are as
+    // old as dirty data gets
+    std::chrono::milliseconds expire(options.dirtyExpireMs);
+    cache.start([this, expire] { journal.commitIfOlder(expire); });
 }
 
 FS::~FS()
 {
-    disk.~Disk();
+    if (scheduler) {
+        scheduler->wait(asyncOps);
+    }
+    cache.stop();
+    journal.commit();
+}
+
+thread_local Session* FS::boundSession = nullptr;
+thread_local BlockOrigin FS::origin;
+std::atomic<unsigned long> Session::ids(0);
+std::mutex Session::registryMutex;
+std::set<const Session*> Session::registry;
+
+Session::Session()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.insert(this);
+}
+
+Session::Session(const Session& other)
+    : currentDir(other.currentDir), currentPath(other.currentPath), in(other.in), out(other.out), err(other.err),
+      id(other.id)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.insert(this);
+}
+
+Session::~Session()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.erase(this);
+}
+std::atomic<unsigned long> FS::instances(0);
+
+// the session bound to the calling thread, or the default one
+Session& FS::session()
+{
+    return boundSession ? *boundSession : defaultSession;
+}
+
+// streams of the calling thread's session, for file data and messages
+std::istream& FS::in()
+{
+    return *session().in;
+}
+
+std::ostream& FS::out()
+{
+    return *session().out;
+}
+
+std::ostream& FS::err()
+{
+    return *session().err;
+}
+
+FS::SessionScope::SessionScope(Session& session) : previous(boundSession)
+{
+    boundSession = &session;
+}
+
+FS::SessionScope::~SessionScope()
+{
+    boundSession = previous;
+}
+
+// mounts the file system found on the disk, replaying the journal. Returns
+// 0 when mounted, 1 if the disk holds no file system and -1 if it holds one
+// this build can't mount, or is not a disk of its geometry.
+int FS::mount()
+{
+    BlockBuffer block;
+    super_block* super = reinterpret_cast<super_block*>(block.data());
+    if (!disk.is_usable()) {
+        return -1;
+    }
+    if (disk.read(SUPER_BLOCK, block) != 0 || super->magic != FS_MAGIC ||
+        (super->version != 1 && super->version != FS_VERSION)) {
+        return 1;
+    }
+    if (super->version == 1) {
+        super->fat_entry_size = sizeof(Geometry4K::FATEntry);
+        super->name_length = Geometry4K::nameLength;
+    }
+    // a file system of another geometry is refused rather than formatted
+    // over
+    const char* found = geometryName(super->block_size, super->no_blocks, super->fat_entry_size,
+                                     super->name_length);
+    const char* built = geometryName(BLOCK_SIZE, MAX_BLOCKS, sizeof(FATEntry), FsGeometry::nameLength);
+    if (found && std::strcmp(found, built) != 0) {
+        std::cerr << "ERROR: The disk holds a " << found << " file system, this build mounts " << built
+                  << ", not using it" << std::endl;
+        return -1;
+    }
+    if (!found || super->journal_start != JOURNAL_START || super->journal_blocks != journal.size()) {
+        return 1;
+    }
+    if (journal.replay() != 0 || disk.read(FAT_BLOCK, (uint8_t*)fat) != 0) {
+        err() << "Error: Could not mount the file system.\n";
+        return 1;
+    }
+    session().currentDir = ROOT_BLOCK;
+    session().currentPath.clear();
+    return 0;
 }
 // formats the disk, i.e., creates an empty file system
 int
-FS::format()
+FS::formatOp()
 {
-    uint8_t initBlock[BLOCK_SIZE] = { 0 };
-    for (auto i = 0; i < disk.get_no_blocks(); i++) {
-        writeBlock(i, (uint8_t*)initBlock);
-    }
+    // no operation may run while the disk is wiped
+    std::unique_lock<std::shared_mutex> exclusive(journal.operations());
+    // everything but the root directory, the FAT and the journal becomes a hole
+    cache.reset();
+    journal.reset();
+    disk.discard(FIRST_DATA_BLOCK, disk.get_no_blocks() - FIRST_DATA_BLOCK);
 
-    uint8_t block[BLOCK_SIZE] = { 0 };
-    dir_entry* root = (dir_entry*)block;
+    BlockBuffer block;
+    dir_entry* root = (dir_entry*)block.data();
 
     std::string name(".");
     root[0].access_rights = READ | WRITE | EXECUTE;
@@ -212,31 +995,47 @@ FS::format()
     root[1].size = 0; 
     root[1].type = TYPE_DIR; 
     
-    std::fill(std::begin(fat) + 2, std::end(fat), FAT_FREE);
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK] = FAT_EOF;
+    // the blocks in front of the data area are never allocated
+    std::fill(std::begin(fat), std::begin(fat) + FIRST_DATA_BLOCK, FAT_EOF);
+    std::fill(std::begin(fat) + FIRST_DATA_BLOCK, std::end(fat), FAT_FREE);
+    trimPools(false);
 
     disk.write(ROOT_BLOCK, (uint8_t*)block);
     disk.write(FAT_BLOCK, (uint8_t*)fat);
-    this->currentDir = ROOT_BLOCK;
+
+    BlockBuffer superBlock;
+    super_block* super = reinterpret_cast<super_block*>(superBlock.data());
+    super->magic = FS_MAGIC;
+    super->version = FS_VERSION;
+    super->block_size = BLOCK_SIZE;
+    super->no_blocks = MAX_BLOCKS;
+    super->journal_start = JOURNAL_START;
+    super->journal_blocks = journal.size();
+    super->fat_entry_size = sizeof(FATEntry);
+    super->name_length = FsGeometry::nameLength;
+    disk.write(SUPER_BLOCK, superBlock);
+    disk.sync();
+    for (Session* s : { &defaultSession, &session() }) {
+        s->currentDir = ROOT_BLOCK;
+        s->currentPath.clear();
+    }
 
     return 0;
 }
 // create <filepath> creates a new file on the disk, the data content is
-int FS::create(std::string filepath) {
+int FS::createOp(std::string filepath) {
+    JournalOperation operation(journal);
     // Find the current directory block
     std::string content = "";
     std::string line = "";
     size_t totalSize = 0;
-    size_t requiredBlocks = 0;
-    std::vector<FATEntry> freeEntries = {};
     dir_entry* newEntry = nullptr;
-    uint8_t block[BLOCK_SIZE] = { 0 };
+    BlockBuffer block;
     dir_entry* dirEntries = nullptr;
     std::string fileName;
     PathResult blk = resolvePath(filepath);
     if(blk.found) {
-        std::cerr << "Error: file alredy exist.\n";
+        err() << "Error: file alredy exist.\n";
         return -1;
     }
     if(!blk.isDirectory) { // file name at end of path
@@ -245,26 +1044,25 @@ int FS::create(std::string filepath) {
     } else {
         fileName = filepath;
     }
-    readBlock(blk.block, block);
-    dirEntries = reinterpret_cast<dir_entry*>(block);
-    if (fileName.size() > 55) {
-        std::cerr << "Error: Invalid file name.\n";
+    if (fileName.size() > FsGeometry::nameLength - 1) {
+        err() << "Error: Invalid file name.\n";
         return -1;
     }
 
     // Capture the file content from user input
     while (true) {
-        std::getline(std::cin, line);
+        std::getline(in(), line);
         if (line.empty()) break;
         content += line + "\n";
         totalSize += line.length() + 1; // +1 for the newline character
     }
-    // Calculate the number of blocks needed
-    requiredBlocks = (totalSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    // Find free FAT entries for the file
-    freeEntries = freeFATEntries(requiredBlocks);
-    if (freeEntries.size() < requiredBlocks) {
-        std::cerr << "Error: Not enough free blocks available.\n";
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(blk.block).lock();
+    readBlock(blk.block, block);
+    dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    dir_entry existing;
+    if (findDirEntry(dirEntries, existing, fileName)) {
+        err() << "Error: file alredy exist.\n";
         return -1;
     }
     // Create a new directory entry
@@ -274,74 +1072,87 @@ int FS::create(std::string filepath) {
     // Fill in the new file entry
     std::strncpy(newEntry->file_name, fileName.c_str(), sizeof(newEntry->file_name) - 1);
     newEntry->file_name[sizeof(newEntry->file_name) - 1] = '\0'; // Null-terminate
-    newEntry->first_blk = freeEntries[0];
-    newEntry->size = totalSize;
-    newEntry->type = TYPE_FILE;
+    newEntry->type = TYPE_FILE | (dirEntries[0].type & TYPE_COMPRESSED);
     newEntry->access_rights = READ | WRITE;
 
-    writePagesToFat(totalSize, content, freeEntries);
-    writeBlock(blk.block, (uint8_t*)dirEntries);
+    if (writeFileData(dirEntries, newEntry - dirEntries, content) != 0) {
+        return -1;
+    }
+    writeMetaBlock(blk.block, (uint8_t*)dirEntries);
     return 0;
 }
 // cat <filepath> reads the content of a file and prints it on the screen
-int FS::cat(std::string filepath) {
+int FS::catOp(std::string filepath) {
     dir_entry fileEntry;
     // Parse directory and file name from the given filepath
     size_t pos = filepath.find_last_of("/");
     std::string dirPath = filepath.substr(0, pos);  // Directory path
     std::string fileName = filepath.substr(pos + 1);  // File name
-    uint8_t block[BLOCK_SIZE] = { 0 };
+    BlockBuffer block;
     dir_entry* dirEntries = nullptr;
     PathResult blk = (pos == 0) ? resolvePath(filepath) : resolvePath(dirPath);
+    LockSet dirLock(dirLocks);
+    dirLock.shared(blk.block).lock();
     readBlock(blk.block, block);
-    dirEntries = reinterpret_cast<dir_entry*>(block);
+    dirEntries = reinterpret_cast<dir_entry*>(block.data());
 
     int index = findDirEntry(dirEntries, fileEntry, fileName);
     if (index == 0 || !isFile(fileEntry) || !hasPermission(fileEntry, READ)) {
-        std::cerr << "Error: File not found or no read permission.\n";
+        err() << "Error: File not found or no read permission.\n";
+        return -1;
+    }
+    LockSet fileLock(fileLocks);
+    fileLock.shared(fileEntry.first_blk).lock();
+    // the directory is only needed further for data in its inline area
+    if (fragmentLength(fileEntry) == 0) {
+        dirLock.unlock();
+    }
+    std::string content;
+    if (!readFileData(dirEntries, index, content)) {
         return -1;
     }
-	for (auto i = fileEntry.first_blk; i != EOF && i != FAT_EOF; i = fat[i])
-	{
-		disk.read(i, block);
-		for (auto i = 0; i < BLOCK_SIZE; i++)
-			std::cout << block[i];
-	}
+    out() << content;
 
     return 0;
 }
 
 // ls lists the content in the currect directory (files and sub-directories)
-int FS::ls() {    
-    uint8_t block[BLOCK_SIZE] = { 0 };
-    readBlock(this->currentDir, (uint8_t*)block);
-    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block);
-    std::cout << "Name\tType\taccessrights\tSize\n";
+int FS::lsOp() {    
+    BlockBuffer block;
+    readDirBlock(session().currentDir, (uint8_t*)block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    out() << "Name\tType\taccessrights\tSize\n";
     
-    for (size_t i = 0; i < BLOCK_SIZE / sizeof(dir_entry); ++i) {
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
         const dir_entry& entry = dirEntries[i];
         // exluded
         if (!isValidEntry(entry)) continue;
-        std::string type = (entry.type == TYPE_DIR) ? "dir" : "file";
+        std::string type = isDirectory(entry) ? "dir" : "file";
         std::string access = accessRightsToString(entry.access_rights);
         std::string bit = (type == "dir") ? "-" : std::to_string(entry.size) + " bytes";
         //print the shi
-        std::cout << entry.file_name << "\t" << type << "\t\t" << access << "\t" << bit << "\n";
+        out() << entry.file_name << "\t" << type << "\t\t" << access << "\t" << bit << "\n";
     }
     return 0;
 }
 // cp <sourcepath> <destpath> makes an exact copy of the file
 // <sourcepath> to a new file <destpath>
 int
-FS::cp(std::string sourcepath, std::string destpath) //currently only working in one directory (working dirrectory)
+FS::cpOp(std::string sourcepath, std::string destpath, bool recursive) //currently only working in one directory (working dirrectory)
 {
+    JournalOperation operation(journal);
     if (sourcepath == destpath){
-        std::cerr << "Error: Source and destination are the same.\n";
+        err() << "Error: Source and destination are the same.\n";
         return -1;
     }
-    uint8_t block[BLOCK_SIZE] = { 0 };
-    uint8_t srcBlk[BLOCK_SIZE] = { 0 };
-    uint8_t tmpBlk[BLOCK_SIZE] = { 0 };
+    if (recursive) {
+        PathResult source = resolvePath(sourcepath);
+        if (source.isDirectory) {
+            return copyTree(sourcepath, source.block, destpath);
+        }
+    }
+    BlockBuffer block;
+    BlockBuffer srcBlk;
     // entris
     dir_entry* dirEntries = nullptr;
     dir_entry* destDirEntries = nullptr;
@@ -350,12 +1161,14 @@ FS::cp(std::string sourcepath, std::string destpath) //currently only working in
     // find direpath and src/dest name from the path
     PathResult blk = resolvePath(sourcepath);
     PathResult dsblk = resolvePath(destpath);
-    readBlock(blk.block, (dir_entry*)srcBlk);
-    dirEntries = reinterpret_cast<dir_entry*>(srcBlk);
-    readBlock(dsblk.block, (dir_entry*)block);
-    destDirEntries = reinterpret_cast<dir_entry*>(block);
+    LockSet dirLock(dirLocks);
+    dirLock.shared(blk.block).exclusive(dsblk.block).lock();
+    readBlock(blk.block, (dir_entry*)srcBlk.data());
+    dirEntries = reinterpret_cast<dir_entry*>(srcBlk.data());
+    readBlock(dsblk.block, (dir_entry*)block.data());
+    destDirEntries = reinterpret_cast<dir_entry*>(block.data());
     if(blk.found == false) {
-        std::cerr << "Error: Source or destination not found.\n";
+        err() << "Error: Source or destination not found.\n";
         return -1;
     }
     //checking how we shuld handle dst in regards to dir or file
@@ -370,62 +1183,68 @@ FS::cp(std::string sourcepath, std::string destpath) //currently only working in
         dstName = destpath.substr(pos + 1);
     }
     else {
-        std::cerr << "Error: Destination is not a directory or file.\n";
+        err() << "Error: Destination is not a directory or file.\n";
         return -1;
     }
-
-    for (auto i = blk.entry.first_blk; i != EOF && i != FAT_EOF; i = fat[i])
-    {
-        readBlock(i, tmpBlk);
-        char* tmp = reinterpret_cast<char*>(tmpBlk);
-        file1Content += tmp;
-    }
-    // Find free FAT entries for the file
-    if (file1Content.length() == 0) {
-        std::cerr << "Error: Source file is empty.\n";
+    dir_entry existing;
+    if (findDirEntry(destDirEntries, existing, dstName)) {
+        err() << "Error: Destination is not a directory or file.\n";
         return -1;
     }
-    std::vector<FATEntry> freeEntries = freeFATEntries(((file1Content.length() + BLOCK_SIZE - 1) / BLOCK_SIZE));
-    if (freeEntries.size() < ((file1Content.length() + BLOCK_SIZE - 1) / BLOCK_SIZE)) {
-        std::cerr << "Error: Not enough free blocks available.\n";
+
+    size_t pos = sourcepath.find_last_of("/");
+    dir_entry srcEntry;
+    int srcIndex = findDirEntry(dirEntries, srcEntry, sourcepath.substr(pos + 1));
+    LockSet fileLock(fileLocks);
+    fileLock.shared(srcEntry.first_blk).lock();
+    // a large file is read while it is written, so it stays locked until then
+    bool large = srcIndex && isLargeFile(srcEntry);
+    if (!srcIndex || (!large && !readFileData(dirEntries, srcIndex, file1Content))) {
+        err() << "Error: Could not read source file.\n";
         return -1;
     }
+    if (!large) {
+        fileLock.unlock();
+    }
     // Create a new directory entry
     dir_entry* newEntry = nullptr;
     if (!createDirEntry(destDirEntries, newEntry, dstName)) {
-        std::cerr << "Error: Could not create new file entry.\n";
+        err() << "Error: Could not create new file entry.\n";
         return -1;
     }
     //rw permision form src file check
     if (!hasPermission(blk.entry, READ)) {
-        std::cerr << "Error: No read/write permission.\n";
+        err() << "Error: No read/write permission.\n";
         return -1;
     }
     // Fill in the new file entry
-    std::strncpy(newEntry->file_name, dstName.c_str(), sizeof(dstName) - 1);
+    std::strncpy(newEntry->file_name, dstName.c_str(), sizeof(newEntry->file_name) - 1);
     newEntry->file_name[sizeof(newEntry->file_name) - 1] = '\0'; // Null-terminate
-    newEntry->first_blk = freeEntries[0];
-    newEntry->size = blk.entry.size;
-    newEntry->type = TYPE_FILE;
-    newEntry->access_rights = blk.entry.access_rights;   
-    writePagesToFat(blk.entry.size, file1Content, freeEntries);
-    writeBlock(destDirEntries[0].first_blk, (uint8_t*)destDirEntries);
+    newEntry->type = TYPE_FILE | (destDirEntries[0].type & TYPE_COMPRESSED);
+    newEntry->access_rights = blk.entry.access_rights;
+    int written = large ? copyLargeFile(dirEntries, srcIndex, *newEntry)
+                        : writeFileData(destDirEntries, newEntry - destDirEntries, file1Content);
+    if (written != 0) {
+        std::memset(newEntry, 0, sizeof(dir_entry));
+        return -1;
+    }
+    writeMetaBlock(destDirEntries[0].first_blk, (uint8_t*)destDirEntries);
     return 0;
 }
 
 // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
 // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
 int
-FS::mv(std::string sourcepath, std::string destpath) // the .. dont realy work as they shuld
+FS::mvOp(std::string sourcepath, std::string destpath) // the .. dont realy work as they shuld
 {
+    JournalOperation operation(journal);
     if (sourcepath == destpath){
-        std::cerr << "Error: Source and destination are the same.\n";
+        err() << "Error: Source and destination are the same.\n";
         return -1;
     }
     // Find the current dirrectory table'
-    uint8_t block[BLOCK_SIZE] = { 0 };
-    uint8_t srcBlk[BLOCK_SIZE] = { 0 };
-    uint8_t tmpBlk[BLOCK_SIZE] = { 0 };
+    BlockBuffer block;
+    BlockBuffer srcBlk;
     // entris
     dir_entry* dirEntries = nullptr;
     dir_entry* destDirEntries = nullptr;
@@ -434,12 +1253,14 @@ FS::mv(std::string sourcepath, std::string destpath) // the .. dont realy work a
     // find direpath and src/dest name from the path
     PathResult blk = resolvePath(sourcepath);
     PathResult dsblk = resolvePath(destpath);
-    readBlock(blk.block, (dir_entry*)srcBlk);
-    dirEntries = reinterpret_cast<dir_entry*>(srcBlk);
-    readBlock(dsblk.block, (dir_entry*)block);
-    destDirEntries = reinterpret_cast<dir_entry*>(block);
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(blk.block).exclusive(dsblk.block).lock();
+    readBlock(blk.block, (dir_entry*)srcBlk.data());
+    dirEntries = reinterpret_cast<dir_entry*>(srcBlk.data());
+    readBlock(dsblk.block, (dir_entry*)block.data());
+    destDirEntries = reinterpret_cast<dir_entry*>(block.data());
     if(blk.found == false) {
-        std::cerr << "Error: Source or destination not found.\n";
+        err() << "Error: Source or destination not found.\n";
         return -1;
     }
     dir_entry sourceEntry;
@@ -455,39 +1276,67 @@ FS::mv(std::string sourcepath, std::string destpath) // the .. dont realy work a
         dstName = destpath.substr(pos + 1);
     }
     else {
-        std::cerr << "Error: Destination is not a directory or file.\n";
+        err() << "Error: Destination is not a directory or file.\n";
         return -1;
     }
     dir_entry* newEntry = nullptr;
     if (!createDirEntry(destDirEntries, newEntry, dstName)) {
-        std::cerr << "Error: Could not create new file entry.\n";
+        err() << "Error: Could not create new file entry.\n";
         return -1;
     }
     if (!hasPermission(sourceEntry, READ)) {
-        std::cerr << "Error: No read/write permission.\n";
+        err() << "Error: No read/write permission.\n";
         return -1;
     }
     if (blk.block == dsblk.block) {
         // same dir
         std::strncpy(dirEntries[srcIndex].file_name, dstName.c_str(), sizeof(dirEntries[srcIndex].file_name) - 1);
         dirEntries[srcIndex].file_name[sizeof(dirEntries[srcIndex].file_name) - 1] = '\0'; // Null-terminate
-        writeBlock(blk.block, (uint8_t*)dirEntries);
+        writeMetaBlock(blk.block, (uint8_t*)dirEntries);
         return 0;
     }
     // basicly just change the name and dir position if src and dst hapend to be in diffrent dirs (persumend)
     std::memcpy(newEntry, &dirEntries[srcIndex], sizeof(dir_entry));
     std::strncpy(newEntry->file_name, dstName.c_str(), sizeof(newEntry->file_name) - 1);
     newEntry->file_name[sizeof(newEntry->file_name) - 1] = '\0'; // Null-terminate
-    writeBlock(dsblk.block, (uint8_t*)destDirEntries);
+    if (isInline(dirEntries[srcIndex]) || fragmentLength(dirEntries[srcIndex]) > 0) {
+        // the fragment lives in the source directory's area, move it along,
+        // an empty inline file needs the destination's area all the same
+        std::string fragment;
+        std::string content;
+        int destIndex = newEntry - destDirEntries;
+        if (readFragment(dirEntries, srcIndex, fragment) &&
+            storeFragment(destDirEntries, destIndex, fragment)) {
+            if (isInline(*newEntry)) {
+                newEntry->first_blk = destDirEntries[0].size;
+            }
+            dirEntries[srcIndex].type &= ~(TYPE_INLINE | TYPE_TAIL);
+            releaseInlineArea(dirEntries);
+        } else if (readFileData(dirEntries, srcIndex, content) &&
+                   writeFileData(destDirEntries, destIndex, content) == 0) {
+            freeFileData(dirEntries, srcIndex);
+        } else {
+            std::memset(newEntry, 0, sizeof(dir_entry));
+            return -1;
+        }
+    }
+    writeMetaBlock(dsblk.block, (uint8_t*)destDirEntries);
     std::memset(&dirEntries[srcIndex], 0, sizeof(dir_entry));
-    writeBlock(blk.block, (uint8_t*)dirEntries);
+    writeMetaBlock(blk.block, (uint8_t*)dirEntries);
     return 0;
 }
 
 // rm <filepath> removes / deletes the file <filepath>
 int
-FS::rm(std::string filepath)
+FS::rmOp(std::string filepath, bool recursive)
 {
+    JournalOperation operation(journal);
+    if (recursive) {
+        PathResult target = resolvePath(filepath);
+        if (target.isDirectory) {
+            return removeTree(filepath, target.block);
+        }
+    }
     // Extracts directory both path and file name from filepath
     size_t pos = filepath.find_last_of('/');
     std::string dirPath = (pos == std::string::npos) ? "" : filepath.substr(0, pos);
@@ -495,44 +1344,40 @@ FS::rm(std::string filepath)
 
     PathResult parentDirBlock = resolvePath(filepath);
     if (parentDirBlock.block == FAT_EOF) {
-        std::cerr << "Error: Directory not found.\n";
+        err() << "Error: Directory not found.\n";
         return -1;
     }
 
-    uint8_t block[BLOCK_SIZE] = { 0 };
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(parentDirBlock.block).lock();
+    BlockBuffer block;
     readBlock(parentDirBlock.block, block);
-    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
 
     // Finds the file entry in the directory
     dir_entry sourceEntry;
     uint8_t fileEntry = findDirEntry(dirEntries, sourceEntry, fileName);
     if (fileEntry == -1) {
-        std::cerr << "Error: Source file not found.\n";
+        err() << "Error: Source file not found.\n";
         return -1;
     }
     if (!isFile(sourceEntry) || !hasPermission(sourceEntry, READ | WRITE)) {
-        std::cerr << "Error: Not a file or insufficient permissions.\n";
+        err() << "Error: Not a file or insufficient permissions.\n";
         return -1;
     }
-    std::vector<FATEntry> fileEntries;
-    for (auto i = dirEntries[fileEntry].first_blk; i != FAT_EOF && i != FAT_FREE; i = fat[i]) {
-        fileEntries.push_back(i);
-    }
-
-    for (auto& blk : fileEntries) {
-        uint8_t emptyBlock[BLOCK_SIZE] = { 0 };
-        writeBlock(blk, emptyBlock);
-        fat[blk] = FAT_FREE;
-    }
+    // wait for readers of the file before its blocks are released
+    LockSet fileLock(fileLocks);
+    fileLock.exclusive(sourceEntry.first_blk).lock();
+    freeFileData(dirEntries, fileEntry);
     std::memset(&dirEntries[fileEntry], 0, sizeof(dir_entry));
-    writeBlock(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat));
-    writeBlock(parentDirBlock.block, block);
+    writeMetaBlock(parentDirBlock.block, block);
     return 0;
 }
 
 // append <filepath1> <filepath2> appends the contents of file <filepath1> to
 // the end of file <filepath2>. The file <filepath1> is unchanged.
-int FS::append(std::string filepath1, std::string filepath2) {
+int FS::appendOp(std::string filepath1, std::string filepath2) {
+    JournalOperation operation(journal);
 
     size_t pos1 = filepath1.find_last_of("/");
     std::string name1 = filepath1.substr(pos1 + 1);
@@ -542,94 +1387,83 @@ int FS::append(std::string filepath1, std::string filepath2) {
     PathResult blk1 =  resolvePath(filepath1);
     PathResult blk2 = resolvePath(filepath2);
     if ((blk1.block == FAT_EOF) || (blk2.block == FAT_EOF)) {
-        std::cerr << "Error: Directory not found.\n";
+        err() << "Error: Directory not found.\n";
         return -1;
     }
 
     // Read the parent directory block
-    uint8_t block1[BLOCK_SIZE] = { 0 };
-    uint8_t block2[BLOCK_SIZE] = { 0 };
+    LockSet dirLock(dirLocks);
+    dirLock.shared(blk1.block).exclusive(blk2.block).lock();
+    BlockBuffer block1;
+    BlockBuffer block2;
     readBlock(blk1.block, block1);
     readBlock(blk2.block, block2);
-    dir_entry* dirEntries1 = reinterpret_cast<dir_entry*>(block1);
-    dir_entry* dirEntries2 = reinterpret_cast<dir_entry*>(block2);
+    dir_entry* dirEntries1 = reinterpret_cast<dir_entry*>(block1.data());
+    dir_entry* dirEntries2 = reinterpret_cast<dir_entry*>(block2.data());
     if ((dirEntries1 == nullptr) || (dirEntries2 == nullptr)) {
-        std::cerr << "Error: Could not read directory entries.\n";
+        err() << "Error: Could not read directory entries.\n";
         return -1;
     }
 
     // Find the source file
     dir_entry sourceEntry;
     if (!findDirEntry(dirEntries1, sourceEntry, name1)) {
-        std::cerr << "Error: Source file not found.\n";
+        err() << "Error: Source file not found.\n";
         return -1;
     }
     // Read the source file content
     std::string content = "";
-    uint8_t srcBlock[BLOCK_SIZE] = { 0 };
-    size_t totalSize = 0;
-    for (auto i = sourceEntry.first_blk; i != EOF && i != FAT_EOF; i = fat[i]) {
-        readBlock(i, srcBlock);
-        std::string line = reinterpret_cast<char*>(srcBlock);
-        content += line;
-        totalSize += line.length() + 1; // +1 for the newline character
-    }
-    totalSize -= 1; // Remove the last newline character
-    // Find free FAT entries for the file
-    std::vector<FATEntry> freeEntries = freeFATEntries(((content.length() + BLOCK_SIZE - 1) / BLOCK_SIZE));
-    if (freeEntries.size() < ((content.length() + BLOCK_SIZE - 1) / BLOCK_SIZE)) {
-        std::cerr << "Error: Not enough free blocks available.\n";
-        return -1;
-    }
+    int srcIndex = findDirEntry(dirEntries1, sourceEntry, name1);
     // find destination file, with id as well fore better write to memory
     dir_entry destEntry;
     uint16_t destIndex = findDirEntry(dirEntries2, destEntry, name2);
+    LockSet fileLock(fileLocks);
+    fileLock.shared(sourceEntry.first_blk);
+    if (destIndex != 0) fileLock.exclusive(destEntry.first_blk);
+    fileLock.lock();
+    bool large = isLargeFile(sourceEntry);
+    if (!large && !readFileData(dirEntries1, srcIndex, content)) {
+        err() << "Error: Could not read source file.\n";
+        return -1;
+    }
     if (destIndex == 0) {
         // Destination file not found
         //create new dest file in current working dir, only have name and type
         dir_entry* newEntry = nullptr;
         if (!createDirEntry(dirEntries2, newEntry, name2)) {
-            std::cerr << "Error: Could not create new file entry.\n";
+            err() << "Error: Could not create new file entry.\n";
             return -1;
         }
-        newEntry->first_blk = freeEntries[0];
-        newEntry->size = totalSize++;
-        newEntry->type = TYPE_FILE;
+        newEntry->type = TYPE_FILE | (dirEntries2[0].type & TYPE_COMPRESSED);
         newEntry->access_rights = sourceEntry.access_rights;
         std::strncpy(newEntry->file_name, name2.c_str(), sizeof(newEntry->file_name) - 1);
         newEntry->file_name[sizeof(newEntry->file_name) - 1] = '\0'; // Null-terminate
-
-        // Write the updated current directory block to disk
-        writeBlock(dirEntries2[0].first_blk, (uint8_t*)block2);
-        // update the dicEntry list in memory
-        readBlock(dirEntries2[0].first_blk, block2);
-        dirEntries2 = reinterpret_cast<dir_entry*>(block2);
-        destIndex = findDirEntry(dirEntries2, destEntry, name2);
-        writePagesToFat(content.length(), content, freeEntries);
-        writeBlock(dirEntries2[0].first_blk, (uint8_t*)dirEntries2);
-        writeBlock(FAT_BLOCK, (uint8_t*)fat);
+        int written = large ? copyLargeFile(dirEntries1, srcIndex, *newEntry)
+                            : writeFileData(dirEntries2, newEntry - dirEntries2, content);
+        if (written != 0) {
+            return -1;
+        }
+        // Write the updated current directory block to disk
+        writeMetaBlock(blk2.block, (uint8_t*)dirEntries2);
         return 0;
     }
     if(!isFile(sourceEntry) || !hasPermission(sourceEntry, READ) || !hasPermission(destEntry, WRITE)) {
-        std::cerr << "Error: type/permision.\n";
+        err() << "Error: type/permision.\n";
         return -1;
     }
-    dirEntries2[destIndex].size += totalSize;
-    writePagesToFat(content.length(), content, freeEntries);
-    uint16_t lastBlock = dirEntries2[destIndex].first_blk;
-    while (fat[lastBlock] != FAT_EOF) {
-        lastBlock = fat[lastBlock];
+    int appended = large ? appendLargeFile(dirEntries1, srcIndex, dirEntries2, destIndex)
+                         : appendFileData(dirEntries2, destIndex, content);
+    if (appended != 0) {
+        return -1;
     }
-    // connect the last block to the new blocks
-    fat[lastBlock] = freeEntries[0];
-    writeBlock(dirEntries2[0].first_blk, (uint8_t*)dirEntries2);
-    writeBlock(FAT_BLOCK, (uint8_t*)fat);
+    writeMetaBlock(blk2.block, (uint8_t*)dirEntries2);
     return 0;
 }
 
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
 // in the current directory 
-int FS::mkdir(std::string dirpath) {
+int FS::mkdirOp(std::string dirpath) {
+    JournalOperation operation(journal);
     // Parse directory and file name from the given filepath
     size_t pos = dirpath.find_last_of("/");
     std::string dirName = dirpath.substr(pos + 1);
@@ -638,21 +1472,23 @@ int FS::mkdir(std::string dirpath) {
     // Resolve the path to the parent directory
     PathResult parentDirBlock = resolvePath(dirpath);
     if (parentDirBlock.block == FAT_EOF) {
-        std::cerr << "Error: Directory not found.\n";
+        err() << "Error: Directory not found.\n";
         return -1;
     }
 
     // Read the parent directory block
-    uint8_t block[BLOCK_SIZE] = { 0 };
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(parentDirBlock.block).lock();
+    BlockBuffer block;
     readBlock(parentDirBlock.block, block);
-    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
     if (dirEntries == nullptr) {
-        std::cerr << "Error: Could not read directory entries.\n";
+        err() << "Error: Could not read directory entries.\n";
         return -1;
     }
     dir_entry targetEntry;
     if (findDirEntry(dirEntries, targetEntry, dirName)) {
-        std::cerr << "Error: Directory already exists.\n";
+        err() << "Error: Directory already exists.\n";
         return -1;
     }
     dir_entry* newDir = nullptr;
@@ -661,7 +1497,7 @@ int FS::mkdir(std::string dirpath) {
     }
     std::vector<FATEntry> freeEntries = freeFATEntries(1);
     if (freeEntries.empty()) {
-        std::cerr << "Error: Not enough free blocks available.\n";
+        err() << "Error: Not enough free blocks available.\n";
         return -1;
     }
     uint16_t access = dirEntries[0].access_rights;
@@ -671,73 +1507,61 @@ int FS::mkdir(std::string dirpath) {
     newDir->first_blk = freeEntries[0];
     newDir->size = 0; 
     newDir->type = TYPE_DIR;
-    uint8_t newBlock[BLOCK_SIZE] = { 0 };
-    dir_entry* newDirEntries = reinterpret_cast<dir_entry*>(newBlock);
-
-    // Entry for "."
-    std::strncpy(newDirEntries[0].file_name, ".", sizeof(newDirEntries[0].file_name) - 1);
-    newDirEntries[0].file_name[sizeof(newDirEntries[0].file_name) - 1] = '\0';
-    newDirEntries[0].first_blk = freeEntries[0];
-    newDirEntries[0].size = 0;
-    newDirEntries[0].type = TYPE_DIR;
-    newDirEntries[0].access_rights = access;
-
-    // Entry for ".."
-    std::strncpy(newDirEntries[1].file_name, "..", sizeof(newDirEntries[1].file_name) - 1);
-    newDirEntries[1].file_name[sizeof(newDirEntries[1].file_name) - 1] = '\0';
-    newDirEntries[1].first_blk = parentDirBlock.block;
-    newDirEntries[1].size = 0;
-    newDirEntries[1].type = TYPE_DIR;
-    newDirEntries[1].access_rights = access;
+    BlockBuffer newBlock;
+    initDirBlock(newBlock, freeEntries[0], parentDirBlock.block, access);
+    // a new directory takes over whether its files are compressed
+    reinterpret_cast<dir_entry*>(newBlock.data())[0].type |= dirEntries[0].type & TYPE_COMPRESSED;
 
     // Write the new directory block to disk
-    writeBlock(freeEntries[0], newBlock);
-    fat[freeEntries[0]] = FAT_EOF;
-    writeBlock(FAT_BLOCK, (uint8_t*)fat);
-    writeBlock(parentDirBlock.block, (uint8_t*)dirEntries);
+    writeMetaBlock(freeEntries[0], newBlock);
+    writeFAT();
+    writeMetaBlock(parentDirBlock.block, (uint8_t*)dirEntries);
     return 0;
 }
 
 // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
 int
-FS::cd(std::string dirpath)
+FS::cdOp(std::string dirpath)
 {
     // Read the current directory block
-    uint8_t currblk[BLOCK_SIZE] = { 0 };
-    uint8_t dirblk[BLOCK_SIZE] = { 0 };
+    BlockBuffer currblk;
+    BlockBuffer dirblk;
     PathResult blk = resolvePath(dirpath);
-    readBlock(blk.block, currblk);
-    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(currblk);
-    readBlock(dirEntries[0].first_blk, dirblk);
-    dirEntries = reinterpret_cast<dir_entry*>(dirblk);
+    readDirBlock(blk.block, currblk);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(currblk.data());
+    readDirBlock(dirEntries[0].first_blk, dirblk);
+    dirEntries = reinterpret_cast<dir_entry*>(dirblk.data());
     if(dirEntries == nullptr) {
-        std::cerr << "Error: Could not read directory entries.\n";
+        err() << "Error: Could not read directory entries.\n";
         return -1;
     }
-    if(this->currentDir == dirEntries[0].first_blk) {
-        std::cerr << "Error: Invalid directory path.\n";
+    if(session().currentDir == dirEntries[0].first_blk) {
+        err() << "Error: Invalid directory path.\n";
         return -1;
     }
 
     std::vector<std::string> path = splitPath(dirpath);
     if (!hasPermission(dirEntries[0], READ | EXECUTE)) {
-        std::cerr << "Error: No read permission.\n";
+        err() << "Error: No read permission.\n";
         return -1;
     }
     if(path.size() == 0) {
-        std::cerr << "Error: Invalid directory path.\n";
+        err() << "Error: Invalid directory path.\n";
         return -1;
     }
-    this->currentDir = dirEntries[0].first_blk;
+    {
+        std::lock_guard<std::mutex> lock(Session::registryMutex);
+        session().currentDir = dirEntries[0].first_blk;
+    }
     if (dirpath[0] == '/') { //absolut path redirect
-        this->currentPath.clear();
+        session().currentPath.clear();
     }
     for (auto &&i : path)
     {
         if (dirpath == "..") {
-            this->currentPath.pop_back();
+            session().currentPath.pop_back();
         } else {
-            this->currentPath.push_back(i);
+            session().currentPath.push_back(i);
         }
     }
     return 0;
@@ -746,23 +1570,24 @@ FS::cd(std::string dirpath)
 // pwd prints the full path, i.e., from the root directory, to the current
 // directory, including the currect directory name
 int
-FS::pwd()
+FS::pwdOp()
 {
     std::string path = "/";
-    for (auto &&i : this->currentPath)
+    for (auto &&i : session().currentPath)
     {
         path += i + "/";
     }
     path.pop_back();
-    std::cout << path << std::endl;
+    out() << path << std::endl;
     return 0;
 }
 
 // chmod <accessrights> <filepath> changes the access rights for the
 // file <filepath> to <accessrights>.
 int
-FS::chmod(std::string accessrights, std::string filepath)
+FS::chmodOp(std::string accessrights, std::string filepath)
 {
+    JournalOperation operation(journal);
     // resolved filepath
     std::string fileName;
     PathResult blk = resolvePath(filepath);
@@ -775,37 +1600,1129 @@ FS::chmod(std::string accessrights, std::string filepath)
         fileName = filepath;
     }
     // Read the current directory block
-    uint8_t block[BLOCK_SIZE] = { 0 };
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(blk.block).lock();
+    BlockBuffer block;
     readBlock(blk.block, block);
-    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
 
     // Find the source file
     dir_entry sourceEntry;
     uint16_t fileIndex = findDirEntry(dirEntries, sourceEntry, fileName);
     if (!fileIndex) {
-        std::cerr << "Error: Source file not found.\n";
+        err() << "Error: Source file not found.\n";
         return -1;
     }
-    if (sourceEntry.type != TYPE_FILE) {
-        std::cerr << "Error: Not a file.\n";
+    if (!isFile(sourceEntry)) {
+        err() << "Error: Not a file.\n";
         return -1;
     }
     uint8_t mask = 0;
     if(std::all_of(accessrights.begin(), accessrights.end(), ::isdigit)) {
         uint8_t num = std::stoi(accessrights);
         if (num < 0 || num > 7) {
-            std::cerr << "Error: Invalid access rights.\n";
+            err() << "Error: Invalid access rights.\n";
             return -1;
         }
         if (num & READ) mask |= READ;
         if (num & WRITE) mask |= WRITE;
         if (num & EXECUTE) mask |= EXECUTE;
         dirEntries[fileIndex].access_rights = mask;      
-        writeBlock(blk.block, (uint8_t*)dirEntries);
+        writeMetaBlock(blk.block, (uint8_t*)dirEntries);
     }
     else {
-        std::cerr << "Error: Invalid access rights.\n";
+        err() << "Error: Invalid access rights.\n";
+        return -1;
+    }
+    return 0;
+}
+
+// compress on|off <path> turns compression of the file <path> on or off,
+// or of the files created in the directory <path> from now on
+int
+FS::compressOp(std::string mode, std::string path)
+{
+    JournalOperation operation(journal);
+    if (mode != "on" && mode != "off") {
+        err() << "Error: Invalid mode, on or off.\n";
+        return -1;
+    }
+    bool on = mode == "on";
+    PathResult blk = resolvePath(path);
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(blk.block).lock();
+    BlockBuffer block;
+    readBlock(blk.block, block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    if (blk.isDirectory) {
+        dirEntries[0].type = on ? dirEntries[0].type | TYPE_COMPRESSED : dirEntries[0].type & ~TYPE_COMPRESSED;
+        writeMetaBlock(blk.block, (uint8_t*)dirEntries);
+        return 0;
+    }
+    dir_entry entry;
+    int index = blk.found ? findDirEntry(dirEntries, entry, path.substr(path.find_last_of("/") + 1)) : 0;
+    if (!index || !isFile(entry)) {
+        err() << "Error: File not found.\n";
+        return -1;
+    }
+    LockSet fileLock(fileLocks);
+    fileLock.exclusive(entry.first_blk).lock();
+    dir_entry& file = dirEntries[index];
+    file.type = on ? file.type | TYPE_COMPRESSED : file.type & ~TYPE_COMPRESSED;
+    // the blocks it has are written again the new way; its fragment in the
+    // inline area is never compressed
+    if (!isInline(file)) {
+        BlockBuffer data(false);
+        for (FATEntry i = file.first_blk; i != FAT_EOF && i != FAT_FREE; i = fat[i]) {
+            if (!readBlock(i, data) || !writeBlock(i, data, on)) {
+                return -1;
+            }
+        }
+    }
+    writeMetaBlock(blk.block, (uint8_t*)dirEntries);
+    return 0;
+}
+
+// sync commits the pending group of operations to the disk
+int
+FS::syncOp()
+{
+    // a good moment to hand back what idle writers reserved
+    trimPools(true);
+    // the commit writes dirty data back first, but syncs only if it logs
+    // metadata; data written in place still needs one
+    if (journal.commit() != 0) {
+        return -1;
+    }
+    return disk.sync();
+}
+
+// metrics prints the state of the block cache and its flusher
+int
+FS::metricsOp()
+{
+    CacheMetrics m = cache.metrics();
+    out() << "flusher.queue_depth: " << m.queueDepth << "\n";
+    out() << "flusher.lag_ms: " << m.lagMs << "\n";
+    out() << "flusher.flushed_blocks: " << m.flushedBlocks << "\n";
+    out() << "flusher.writes: " << m.flushWrites << "\n";
+    out() << "cache.hits: " << m.hits << "\n";
+    out() << "cache.misses: " << m.misses << "\n";
+    out() << "cache.read_ahead: " << m.readAhead << "\n";
+    out() << "disk.direct: " << disk.is_direct() << "\n";
+    out() << "disk.stripes: " << disk.get_stripes() << "\n";
+    out() << "disk.compressed_blocks: " << disk.get_packed_blocks() << "\n";
+    out() << "disk.compressed_bytes: " << disk.get_packed_bytes() << "\n";
+    return 0;
+}
+
+// begin starts a batch of operations, batches may be nested
+int
+FS::beginOp()
+{
+    journal.beginBatch();
+    return 0;
+}
+
+// commit ends a batch, the outermost one commits all of its operations
+int
+FS::commitOp()
+{
+    return journal.endBatch();
+}
+
+// du <path> prints the total size of the files below <path>
+int
+FS::duOp(std::string path)
+{
+    PathResult target = resolvePath(path);
+    if (!target.isDirectory) {
+        if (!target.found || !isFile(target.entry)) {
+            err() << "Error: Path not found.\n";
+            return -1;
+        }
+        out() << target.entry.size << "\t" << path << "\n";
+        return 0;
+    }
+    TreeWalk walk;
+    spawn(walk, [this, &walk, target] { scanDirectory(walk, target.block, "", ""); });
+    tasks().wait(walk.group);
+    if (!walk.error.empty()) {
+        err() << walk.error;
+        return -1;
+    }
+    out() << walk.bytes << "\t" << path << "\n";
+    return 0;
+}
+
+// find <path> <name> prints the paths below <path> whose name matches the
+// pattern <name>, sorted since the directories are searched in parallel
+int
+FS::findOp(std::string path, std::string name)
+{
+    PathResult target = resolvePath(path);
+    if (!target.isDirectory) {
+        err() << "Error: Directory not found.\n";
+        return -1;
+    }
+    std::string prefix = path;
+    while (prefix.size() > 1 && prefix.back() == '/') {
+        prefix.pop_back();
+    }
+    TreeWalk walk;
+    spawn(walk, [this, &walk, target, prefix, name] { scanDirectory(walk, target.block, prefix, name); });
+    tasks().wait(walk.group);
+    std::sort(walk.found.begin(), walk.found.end());
+    for (auto& found : walk.found) {
+        out() << found << "\n";
+    }
+    if (!walk.error.empty()) {
+        err() << walk.error;
+        return -1;
+    }
+    return 0;
+}
+
+// Everything the parallel walk of fsck found, checked afterwards in one
+// pass in path order so the report does not depend on the walk's order
+struct FS::FsckScan {
+    struct Dir {
+        std::string path;
+        FATEntry block;
+        FATEntry parent;
+        FATEntry area;   // inline area, 0 if none
+        FATEntry self;   // what "." points to
+        FATEntry dotdot; // what ".." points to
+    };
+    struct File {
+        std::string path;
+        FATEntry dirBlock;
+        int index;
+        dir_entry entry;
+    };
+    std::mutex mutex;
+    std::vector<bool> visited; // directory blocks reached so far
+    std::vector<Dir> dirs;
+    std::vector<File> files;   // files, and directories that can't be walked
+};
+
+void FS::checkDirectory(TreeWalk& walk, FsckScan& scan, FATEntry dirBlock, FATEntry parent, const std::string& path)
+{
+    BlockBuffer block;
+    if (!readDirBlock(dirBlock, block)) return;
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    FsckScan::Dir dir = { path, dirBlock, parent, (FATEntry)dirEntries[0].size,
+                          dirEntries[0].first_blk, dirEntries[1].first_blk };
+    std::vector<FsckScan::File> files;
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        const dir_entry& entry = dirEntries[i];
+        if (!isValidEntry(entry)) continue;
+        std::string child = (path == "/" ? path : path + "/") + entry.file_name;
+        FATEntry first = entry.first_blk;
+        bool walkable = isDirectory(entry) && first >= FIRST_DATA_BLOCK && first < MAX_BLOCKS;
+        if (walkable) {
+            std::lock_guard<std::mutex> lock(scan.mutex);
+            walkable = !scan.visited[first];
+            scan.visited[first] = true;
+        }
+        if (walkable) {
+            spawn(walk, [this, &walk, &scan, first, dirBlock, child] {
+                checkDirectory(walk, scan, first, dirBlock, child);
+            });
+        } else {
+            files.push_back({ child, dirBlock, (int)i, entry });
+        }
+    }
+    std::lock_guard<std::mutex> lock(scan.mutex);
+    scan.dirs.push_back(dir);
+    scan.files.insert(scan.files.end(), files.begin(), files.end());
+}
+
+// Marks the blocks whose FAT entry is not FAT_FREE in used, 16 entries at a
+// time with SSE2 where there is SSE2
+static void usedBlocks(const FATEntry* fat, std::vector<bool>& used)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; sizeof(FATEntry) == 2 && i + 16 <= MAX_BLOCKS; i += 16) {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fat + i));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fat + i + 8));
+        // one byte per entry, 0xFF where the entry is free
+        __m128i free = _mm_packs_epi16(_mm_cmpeq_epi16(low, zero), _mm_cmpeq_epi16(high, zero));
+        unsigned mask = ~_mm_movemask_epi8(free) & 0xFFFF;
+        for (; mask != 0; mask &= mask - 1) {
+            used[i + __builtin_ctz(mask)] = true;
+        }
+    }
+#endif
+    for (; i < MAX_BLOCKS; ++i) {
+        used[i] = fat[i] != FAT_FREE;
+    }
+}
+
+// fsck: the directories are read in parallel on the tree pool, the FAT is
+// then checked against what they hold with no operation running
+int
+FS::fsckOp(bool repair)
+{
+    std::unique_lock<std::shared_mutex> exclusive(journal.operations());
+    // reserved blocks look used in fat[], hand them back first
+    trimPools(false);
+
+    FsckScan scan;
+    scan.visited.assign(MAX_BLOCKS, false);
+    scan.visited[ROOT_BLOCK] = true;
+    TreeWalk walk;
+    spawn(walk, [this, &walk, &scan] { checkDirectory(walk, scan, ROOT_BLOCK, ROOT_BLOCK, "/"); });
+    tasks().wait(walk.group);
+    if (!walk.error.empty()) {
+        err() << walk.error;
+        return -1;
+    }
+    auto byPath = [](const auto& a, const auto& b) { return a.path < b.path; };
+    std::sort(scan.dirs.begin(), scan.dirs.end(), byPath);
+    std::sort(scan.files.begin(), scan.files.end(), byPath);
+
+    size_t problems = 0;
+    size_t repaired = 0;
+    auto report = [&](const std::string& path, const std::string& problem, bool fixed) {
+        out() << "fsck: " << path << ": " << problem << (fixed ? " (repaired)" : "") << "\n";
+        ++problems;
+        repaired += fixed;
+    };
+    // directory blocks changed by repairs, written back at the end
+    std::map<FATEntry, std::vector<uint8_t>> edits;
+    auto editDir = [&](FATEntry blockNum) {
+        std::vector<uint8_t>& block = edits[blockNum];
+        if (block.empty()) {
+            block.resize(BLOCK_SIZE);
+            readBlock(blockNum, block.data());
+        }
+        return reinterpret_cast<dir_entry*>(block.data());
+    };
+    std::vector<FATEntry> endChain;  // blocks to become FAT_EOF
+    std::vector<FATEntry> toFree;
+    std::vector<std::string> owners; // path owning each claimed block
+    std::vector<int> owner(MAX_BLOCKS, -1);
+    auto claim = [&](FATEntry blk, int who) {
+        if (owner[blk] != -1) return false;
+        owner[blk] = who;
+        return true;
+    };
+
+    std::vector<bool> used(MAX_BLOCKS, false);
+    usedBlocks(fat, used);
+    std::map<FATEntry, FATEntry> areas; // directory block -> its inline area
+    // the inline area of a directory, in a free block if it has none, 0
+    // when no block is free
+    auto areaOf = [&](FATEntry dirBlock, int who) -> FATEntry {
+        auto area = areas.find(dirBlock);
+        if (area != areas.end()) return area->second;
+        for (FATEntry b = FIRST_DATA_BLOCK; b < MAX_BLOCKS; ++b) {
+            if (used[b] || !claim(b, who)) continue;
+            endChain.push_back(b);
+            edits[b].assign(BLOCK_SIZE, 0);
+            editDir(dirBlock)[0].size = b;
+            areas[dirBlock] = b;
+            return b;
+        }
+        return 0;
+    };
+    for (auto& dir : scan.dirs) {
+        int who = owners.size();
+        owners.push_back(dir.path);
+        claim(dir.block, who);
+        if (dir.block != ROOT_BLOCK && fat[dir.block] == FAT_FREE) {
+            report(dir.path, "directory block " + std::to_string(dir.block) + " is marked free", repair);
+            endChain.push_back(dir.block);
+        }
+        if (dir.self != dir.block) {
+            report(dir.path, "\".\" points to block " + std::to_string(dir.self), repair);
+            if (repair) editDir(dir.block)[0].first_blk = dir.block;
+        }
+        if (dir.dotdot != dir.parent) {
+            report(dir.path, "\"..\" points to block " + std::to_string(dir.dotdot), repair);
+            if (repair) editDir(dir.block)[1].first_blk = dir.parent;
+        }
+        if (dir.area == 0) continue;
+        if (dir.area < FIRST_DATA_BLOCK || dir.area >= MAX_BLOCKS || !claim(dir.area, who)) {
+            report(dir.path, "inline area block " + std::to_string(dir.area) + " is not its own", false);
+            continue;
+        }
+        areas[dir.block] = dir.area;
+        if (fat[dir.area] == FAT_FREE) {
+            report(dir.path, "inline area block " + std::to_string(dir.area) + " is marked free", repair);
+            endChain.push_back(dir.area);
+        }
+    }
+
+    size_t fileCount = 0;
+    for (auto& file : scan.files) {
+        const dir_entry& entry = file.entry;
+        int who = owners.size();
+        owners.push_back(file.path);
+        bool drop = false;
+        if (isDirectory(entry)) {
+            // directories the walk could not enter
+            bool bad = entry.first_blk < FIRST_DATA_BLOCK || entry.first_blk >= MAX_BLOCKS;
+            report(file.path, bad ? "bad directory block " + std::to_string(entry.first_blk)
+                                  : "directory is linked more than once", repair);
+            drop = true;
+        } else if (isInline(entry)) {
+            ++fileCount;
+            auto area = areas.find(file.dirBlock);
+            if ((area == areas.end() || area->second != entry.first_blk) && entry.size == 0) {
+                // nothing of it is in an area, it only has to point at its own
+                FATEntry own = repair ? areaOf(file.dirBlock, who) : 0;
+                report(file.path, "empty inline file points outside the directory's inline area", repair);
+                if (own != 0) {
+                    editDir(file.dirBlock)[file.index].first_blk = own;
+                }
+                drop = repair && own == 0;
+            } else if (area == areas.end() || area->second != entry.first_blk) {
+                report(file.path, "inline data is outside the directory's inline area", repair);
+                drop = true;
+            }
+        } else {
+            ++fileCount;
+            size_t bytes = entry.size - fragmentLength(entry);
+            size_t expected = std::max<size_t>(1, (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            // follow the chain for the blocks the file needs, until it ends or
+            // goes wrong. Blocks linked past them are not the file's, another
+            // file may hold them, so they are not claimed.
+            std::vector<FATEntry> chain;
+            std::string broken;
+            for (FATEntry b = entry.first_blk; b != FAT_EOF && chain.size() < expected; b = fat[b]) {
+                if (b < FIRST_DATA_BLOCK || b >= MAX_BLOCKS) {
+                    broken = "bad block number " + std::to_string(b) + " in its chain";
+                } else if (owner[b] == who) {
+                    broken = "chain has a cycle at block " + std::to_string(b);
+                } else if (!claim(b, who)) {
+                    broken = "shares block " + std::to_string(b) + " with " + owners[owner[b]];
+                }
+                if (!broken.empty()) break;
+                chain.push_back(b);
+                if (fat[b] == FAT_FREE) {
+                    report(file.path, "block " + std::to_string(b) + " is in use but marked free", repair);
+                    break;
+                }
+            }
+            FATEntry next = chain.empty() ? FAT_EOF : fat[chain.back()];
+            if (!broken.empty()) {
+                report(file.path, broken, repair);
+            } else if (chain.size() < expected) {
+                report(file.path, "chain has " + std::to_string(chain.size()) + " blocks, the file needs " +
+                       std::to_string(expected), repair);
+            } else if (next != FAT_EOF && next != FAT_FREE) {
+                // cut off, what follows is freed below if nothing owns it
+                report(file.path, "chain goes on past the " + std::to_string(expected) + " blocks the file needs",
+                       repair);
+            }
+            if (chain.empty()) {
+                drop = true;
+            } else if (repair) {
+                endChain.push_back(chain.back());
+                if (chain.size() < expected) {
+                    // truncated to the blocks that are left and the fragment
+                    editDir(file.dirBlock)[file.index].size = chain.size() * BLOCK_SIZE + fragmentLength(entry);
+                }
+            }
+        }
+        if (drop && repair) {
+            std::memset(&editDir(file.dirBlock)[file.index], 0, sizeof(dir_entry));
+        }
+    }
+
+    std::vector<FATEntry> leaked;
+    size_t inUse = 0;
+    for (FATEntry b = FIRST_DATA_BLOCK; b < MAX_BLOCKS; ++b) {
+        inUse += used[b];
+        if (used[b] && owner[b] == -1) {
+            leaked.push_back(b);
+        }
+    }
+    if (!leaked.empty()) {
+        report("/", std::to_string(leaked.size()) + " blocks are in use by nothing", repair);
+        toFree.insert(toFree.end(), leaked.begin(), leaked.end());
+    }
+
+    if (repair) {
+        {
+            std::lock_guard<std::mutex> lock(allocMutex);
+            for (FATEntry b : endChain) {
+                fat[b] = FAT_EOF;
+            }
+            stageFAT();
+        }
+        releaseBlocks(toFree);
+        for (auto& edit : edits) {
+            writeMetaBlock(edit.first, edit.second.data());
+        }
+        journal.commitPending();
+    }
+    out() << "fsck: " << scan.dirs.size() << " directories, " << fileCount << " files, "
+          << inUse << " blocks in use, " << problems << " problems, " << repaired << " repaired\n";
+    return problems == repaired ? 0 : -1;
+}
+
+// The pool for tree operations, created by the first one
+TaskPool& FS::tasks()
+{
+    std::call_once(poolStarted, [this] { pool.reset(new TaskPool()); });
+    return *pool;
+}
+
+void FS::TreeWalk::fail(const std::string& message)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (error.empty()) {
+        error = message;
+    }
+}
+
+// Run task on the pool as part of walk. Tasks have no session of their own,
+// what they print becomes the walk's error.
+void FS::spawn(TreeWalk& walk, std::function<void()> task)
+{
+    BlockOrigin caller = origin;
+    JournalOperation* operation = JournalOperation::current;
+    tasks().submit(walk.group, [&walk, task, caller, operation] {
+        origin = caller;
+        JournalOperation::current = operation;
+        Session session;
+        std::ostringstream messages;
+        session.out = &messages;
+        session.err = &messages;
+        SessionScope scope(session);
+        task();
+        JournalOperation::current = nullptr;
+        if (messages.tellp() > 0) {
+            walk.fail(messages.str());
+        }
+    });
+}
+
+// Task of du and find, one per directory. Adds up the sizes of the files and
+// collects the entries matching pattern, if one is given.
+void FS::scanDirectory(TreeWalk& walk, FATEntry dirBlock, const std::string& prefix, const std::string& pattern)
+{
+    BlockBuffer block;
+    readDirBlock(dirBlock, block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        const dir_entry& entry = dirEntries[i];
+        if (!isValidEntry(entry)) continue;
+        std::string path = prefix.empty() ? std::string(entry.file_name) :
+                           prefix.back() == '/' ? prefix + entry.file_name :
+                           prefix + "/" + entry.file_name;
+        if (!pattern.empty() && fnmatch(pattern.c_str(), entry.file_name, 0) == 0) {
+            std::lock_guard<std::mutex> lock(walk.mutex);
+            walk.found.push_back(path);
+        }
+        if (isFile(entry)) {
+            walk.bytes += entry.size;
+        } else if (isDirectory(entry) && hasPermission(entry, READ | EXECUTE)) {
+            FATEntry child = entry.first_blk;
+            spawn(walk, [this, &walk, child, path, pattern] {
+                scanDirectory(walk, child, path, pattern);
+            });
+        }
+    }
+}
+
+// rm -r: the directory is unlinked from its parent first, so nothing new
+// can reach the tree, then one task per directory frees its files
+int FS::removeTree(const std::string& dirpath, FATEntry dirBlock)
+{
+    std::vector<std::string> components = splitPath(dirpath);
+    if (components.empty() || components.back() == "." || components.back() == ".." ||
+        dirBlock == ROOT_BLOCK) {
+        err() << "Error: Cannot remove this directory.\n";
+        return -1;
+    }
+    BlockBuffer block;
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    // no session's working directory may be in the tree
+    std::set<FATEntry> workingDirs;
+    {
+        std::lock_guard<std::mutex> lock(Session::registryMutex);
+        for (const Session* s : Session::registry) {
+            workingDirs.insert(s->currentDir);
+        }
+    }
+    for (FATEntry workingDir : workingDirs) {
+        for (FATEntry walker = workingDir; walker != ROOT_BLOCK; walker = dirEntries[1].first_blk) {
+            if (walker == dirBlock) {
+                err() << "Error: Cannot remove the working directory of a session.\n";
+                return -1;
+            }
+            readDirBlock(walker, block);
+        }
+    }
+    // and everything in it must be removable, before any of it is
+    TreeWalk check;
+    spawn(check, [this, &check, dirBlock, dirpath] { checkRemovable(check, dirBlock, dirpath); });
+    tasks().wait(check.group);
+    if (!check.error.empty()) {
+        err() << check.error;
+        return -1;
+    }
+    readDirBlock(dirBlock, block);
+    FATEntry parent = dirEntries[1].first_blk;
+    {
+        LockSet dirLock(dirLocks);
+        dirLock.exclusive(parent).lock();
+        readBlock(parent, block);
+        dir_entry entry;
+        int index = findDirEntry(dirEntries, entry, components.back());
+        if (!index || !isDirectory(entry) || entry.first_blk != dirBlock) {
+            err() << "Error: Directory not found.\n";
+            return -1;
+        }
+        if (!hasPermission(entry, WRITE)) {
+            err() << "Error: No write permission.\n";
+            return -1;
+        }
+        std::memset(&dirEntries[index], 0, sizeof(dir_entry));
+        writeMetaBlock(parent, block);
+    }
+    TreeWalk walk;
+    spawn(walk, [this, &walk, dirBlock] { removeDirectory(walk, dirBlock); });
+    tasks().wait(walk.group);
+    releaseBlocks(walk.dirs);
+    if (!walk.error.empty()) {
+        err() << walk.error;
+        return -1;
+    }
+    return 0;
+}
+
+// Task of the check of rm -r, one per directory. Its files need the rights
+// rm asks for and its subdirectories write permission, as the top one.
+void FS::checkRemovable(TreeWalk& walk, FATEntry dirBlock, const std::string& path)
+{
+    BlockBuffer block;
+    readDirBlock(dirBlock, block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        const dir_entry& entry = dirEntries[i];
+        if (!isValidEntry(entry)) continue;
+        std::string entryPath = path.back() == '/' ? path + entry.file_name : path + "/" + entry.file_name;
+        if (isFile(entry) && !hasPermission(entry, READ | WRITE)) {
+            err() << "Error: Insufficient permissions for " << entryPath << ".\n";
+        } else if (isDirectory(entry) && !hasPermission(entry, WRITE)) {
+            err() << "Error: No write permission for " << entryPath << ".\n";
+        } else if (isDirectory(entry)) {
+            FATEntry child = entry.first_blk;
+            spawn(walk, [this, &walk, child, entryPath] { checkRemovable(walk, child, entryPath); });
+        }
+    }
+}
+
+// Task of rm -r, frees the files of one directory and fans out its
+// subdirectories. The directory block itself is freed by removeTree.
+void FS::removeDirectory(TreeWalk& walk, FATEntry dirBlock)
+{
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(dirBlock).lock();
+    BlockBuffer block;
+    readBlock(dirBlock, block);
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        const dir_entry& entry = dirEntries[i];
+        if (!isValidEntry(entry)) continue;
+        if (isDirectory(entry)) {
+            FATEntry child = entry.first_blk;
+            spawn(walk, [this, &walk, child] { removeDirectory(walk, child); });
+        } else {
+            // wait for readers of the file before its blocks are released
+            LockSet fileLock(fileLocks);
+            fileLock.exclusive(entry.first_blk).lock();
+            freeFileData(dirEntries, i);
+        }
+    }
+    releaseInlineArea(dirEntries);
+    std::lock_guard<std::mutex> lock(walk.mutex);
+    walk.dirs.push_back(dirBlock);
+}
+
+// A directory of cp -r being built. Its block is written by the last of its
+// file copies to finish.
+struct FS::DirCopy {
+    BlockBuffer source{false};
+    BlockBuffer block{false};
+    FATEntry blockNum;
+    std::mutex mutex;   // guards block while file copies fill it in
+    std::atomic<int> pending;
+};
+
+// cp -r: the copy is built unreachable, one task per directory and one per
+// file, and linked into the destination once it is complete
+int FS::copyTree(const std::string& sourcepath, FATEntry srcBlock, const std::string& destpath)
+{
+    PathResult dest = resolvePath(destpath);
+    std::vector<std::string> components = splitPath(dest.isDirectory ? sourcepath : destpath);
+    if (dest.found || components.empty()) {
+        err() << "Error: Destination is not a directory.\n";
+        return -1;
+    }
+    std::string name = components.back();
+    if (name == "." || name == ".." || name.size() > FsGeometry::nameLength - 1) {
+        err() << "Error: Invalid directory name.\n";
+        return -1;
+    }
+    BlockBuffer block;
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(block.data());
+    readDirBlock(srcBlock, block);
+    uint8_t access = dirEntries[0].access_rights;
+    if (!hasPermission(dirEntries[0], READ)) {
+        err() << "Error: No read permission.\n";
+        return -1;
+    }
+    std::vector<FATEntry> root = freeFATEntries(1);
+    if (root.empty()) {
+        err() << "Error: Not enough free blocks available.\n";
+        return -1;
+    }
+    FATEntry newRoot = root[0];
+    FATEntry parent = dest.block;
+    TreeWalk walk;
+    spawn(walk, [this, &walk, srcBlock, newRoot, parent] { copyDirectory(walk, srcBlock, newRoot, parent); });
+    tasks().wait(walk.group);
+    writeFAT();
+    // nothing links to the copy, take it down again
+    auto takeDown = [this, newRoot] {
+        TreeWalk undo;
+        spawn(undo, [this, &undo, newRoot] { removeDirectory(undo, newRoot); });
+        tasks().wait(undo.group);
+        releaseBlocks(undo.dirs);
+    };
+    if (!walk.error.empty()) {
+        // a partial copy is no copy
+        err() << walk.error;
+        takeDown();
+        return -1;
+    }
+
+    LockSet dirLock(dirLocks);
+    dirLock.exclusive(parent).lock();
+    readBlock(parent, block);
+    dir_entry existing;
+    dir_entry* newEntry = nullptr;
+    bool exists = findDirEntry(dirEntries, existing, name);
+    if (exists) {
+        err() << "Error: Destination already exists.\n";
+    }
+    if (exists || !createDirEntry(dirEntries, newEntry, name)) {
+        takeDown();
+        return -1;
+    }
+    newEntry->type = TYPE_DIR;
+    newEntry->access_rights = access;
+    newEntry->first_blk = newRoot;
+    newEntry->size = 0;
+    writeMetaBlock(parent, block);
+    return 0;
+}
+
+// Task of cp -r for one directory. Entries are made for all of its files and
+// subdirectories up front, then the file copies and subdirectories are handed
+// to the pool.
+void FS::copyDirectory(TreeWalk& walk, FATEntry srcBlock, FATEntry newBlock, FATEntry newParent)
+{
+    std::shared_ptr<DirCopy> copy(new DirCopy());
+    copy->blockNum = newBlock;
+    copy->pending = 1;
+    readDirBlock(srcBlock, copy->source);
+    dir_entry* srcEntries = reinterpret_cast<dir_entry*>(copy->source.data());
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(copy->block.data());
+    initDirBlock(copy->block, newBlock, newParent, srcEntries[0].access_rights);
+    dirEntries[0].type |= srcEntries[0].type & TYPE_COMPRESSED;
+
+    std::vector<std::pair<int, int>> files;              // new index, source index
+    std::vector<std::pair<FATEntry, FATEntry>> subdirs;  // source block, new block
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        const dir_entry& entry = srcEntries[i];
+        if (!isValidEntry(entry)) continue;
+        if (isFile(entry) && !hasPermission(entry, READ)) {
+            err() << "Error: No read permission for " << entry.file_name << ".\n";
+            continue;
+        }
+        dir_entry* newEntry = nullptr;
+        createDirEntry(dirEntries, newEntry, entry.file_name);
+        newEntry->type = entry.type & (TYPE_MASK | TYPE_COMPRESSED);
+        newEntry->access_rights = entry.access_rights;
+        newEntry->size = 0;
+        if (isDirectory(entry)) {
+            std::vector<FATEntry> child = freeFATEntries(1);
+            if (child.empty()) {
+                err() << "Error: Not enough free blocks available.\n";
+                std::memset(newEntry, 0, sizeof(dir_entry));
+                continue;
+            }
+            newEntry->first_blk = child[0];
+            subdirs.push_back(std::make_pair(entry.first_blk, child[0]));
+        } else {
+            files.push_back(std::make_pair(newEntry - dirEntries, i));
+        }
+    }
+    for (auto& subdir : subdirs) {
+        spawn(walk, [this, &walk, subdir, newBlock] { copyDirectory(walk, subdir.first, subdir.second, newBlock); });
+    }
+    copy->pending += files.size();
+    for (auto& file : files) {
+        spawn(walk, [this, copy, file] { copyFile(copy, file.first, file.second); });
+    }
+    finishCopy(*copy);
+}
+
+// Task of cp -r for one file, at most MAX_INFLIGHT_IO of them do I/O at once
+void FS::copyFile(std::shared_ptr<DirCopy> copy, int index, int srcIndex)
+{
+    const dir_entry* srcEntries = reinterpret_cast<const dir_entry*>(copy->source.data());
+    dir_entry* dirEntries = reinterpret_cast<dir_entry*>(copy->block.data());
+    std::string content;
+    ioSlots.acquire();
+    if (isLargeFile(srcEntries[srcIndex])) {
+        // copied outside of copy->mutex, only the entry is filled in under it
+        dir_entry entry;
+        int copied;
+        {
+            std::lock_guard<std::mutex> lock(copy->mutex);
+            entry = dirEntries[index];
+        }
+        {
+            LockSet fileLock(fileLocks);
+            fileLock.shared(srcEntries[srcIndex].first_blk).lock();
+            copied = copyLargeFile(srcEntries, srcIndex, entry);
+        }
+        {
+            std::lock_guard<std::mutex> lock(copy->mutex);
+            if (copied == 0) {
+                dirEntries[index] = entry;
+            } else {
+                std::memset(&dirEntries[index], 0, sizeof(dir_entry));
+            }
+        }
+        ioSlots.release();
+        finishCopy(*copy);
+        return;
+    }
+    bool read;
+    {
+        LockSet fileLock(fileLocks);
+        fileLock.shared(srcEntries[srcIndex].first_blk).lock();
+        read = readFileData(srcEntries, srcIndex, content);
+    }
+    if (!read) {
+        err() << "Error: Could not read " << srcEntries[srcIndex].file_name << ".\n";
+    }
+    {
+        std::lock_guard<std::mutex> lock(copy->mutex);
+        if (!read || writeFileData(dirEntries, index, content) != 0) {
+            std::memset(&dirEntries[index], 0, sizeof(dir_entry));
+        }
+    }
+    ioSlots.release();
+    finishCopy(*copy);
+}
+
+void FS::finishCopy(DirCopy& copy)
+{
+    if (--copy.pending == 0) {
+        writeMetaBlock(copy.blockNum, copy.block);
+    }
+}
+
+// Runs op, a call of the public API, timing it under stat and adding it to
+// the trace when one is being recorded. command gives the call as a shell
+// command line, it is only made then. For create the data it reads is
+// recorded as well.
+int FS::traced(FsStat stat, const std::function<std::string()>& command, const std::function<int()>& op, bool input)
+{
+    if (refused) {
+        err() << "Error: No file system is mounted.\n";
+        return -1;
+    }
+    LatencyTimer timer(latencies[stat]);
+    BlockOrigin outer = origin;
+    if (blockTrace.active()) {
+        std::string call = command();
+        size_t space = call.find(' ');
+        origin.op = stat;
+        origin.file = blockTrace.name(space == std::string::npos ? "" : call.substr(space + 1));
+    }
+    if (!recorder.active()) {
+        int status = op();
+        origin = outer;
+        return status;
+    }
+    TraceRecord record;
+    record.session = session().id;
+    record.command = command();
+    std::istream* source = session().in;
+    TeeBuffer tee(source->rdbuf());
+    std::istream teed(&tee);
+    if (input) {
+        session().in = &teed;
+    }
+    record.start = recorder.now();
+    record.status = op();
+    record.duration = recorder.now() - record.start;
+    if (input) {
+        session().in = source;
+        // the data without the empty line that ended it
+        record.content = tee.taken();
+        if (record.content == "\n" || (record.content.size() > 1 && record.content.compare(record.content.size() - 2, 2, "\n\n") == 0)) {
+            record.content.pop_back();
+        }
+    }
+    recorder.write(record);
+    origin = outer;
+    return record.status;
+}
+
+int FS::record(const std::string& path)
+{
+    if (path.empty()) {
+        recorder.close();
+        return 0;
+    }
+    if (recorder.open(path) != 0) {
+        err() << "Error: Could not open " << path << "\n";
         return -1;
     }
     return 0;
 }
+
+int FS::format()
+{
+    return traced(STAT_FORMAT, [] { return std::string("format"); }, [this] { return formatOp(); });
+}
+
+int FS::create(std::string filepath)
+{
+    return traced(STAT_CREATE, [&] { return "create " + filepath; }, [&] { return createOp(filepath); }, true);
+}
+
+int FS::cat(std::string filepath)
+{
+    return traced(STAT_CAT, [&] { return "cat " + filepath; }, [&] { return catOp(filepath); });
+}
+
+int FS::ls()
+{
+    return traced(STAT_LS, [] { return std::string("ls"); }, [this] { return lsOp(); });
+}
+
+int FS::cp(std::string sourcepath, std::string destpath, bool recursive)
+{
+    return traced(STAT_CP, [&] { return std::string(recursive ? "cp -r " : "cp ") + sourcepath + " " + destpath; },
+                  [&] { return cpOp(sourcepath, destpath, recursive); });
+}
+
+int FS::mv(std::string sourcepath, std::string destpath)
+{
+    return traced(STAT_MV, [&] { return "mv " + sourcepath + " " + destpath; }, [&] { return mvOp(sourcepath, destpath); });
+}
+
+int FS::rm(std::string filepath, bool recursive)
+{
+    return traced(STAT_RM, [&] { return std::string(recursive ? "rm -r " : "rm ") + filepath; },
+                  [&] { return rmOp(filepath, recursive); });
+}
+
+int FS::append(std::string filepath1, std::string filepath2)
+{
+    return traced(STAT_APPEND, [&] { return "append " + filepath1 + " " + filepath2; }, [&] { return appendOp(filepath1, filepath2); });
+}
+
+int FS::mkdir(std::string dirpath)
+{
+    return traced(STAT_MKDIR, [&] { return "mkdir " + dirpath; }, [&] { return mkdirOp(dirpath); });
+}
+
+int FS::cd(std::string dirpath)
+{
+    return traced(STAT_CD, [&] { return "cd " + dirpath; }, [&] { return cdOp(dirpath); });
+}
+
+int FS::pwd()
+{
+    return traced(STAT_PWD, [] { return std::string("pwd"); }, [this] { return pwdOp(); });
+}
+
+int FS::chmod(std::string accessrights, std::string filepath)
+{
+    return traced(STAT_CHMOD, [&] { return "chmod " + accessrights + " " + filepath; }, [&] { return chmodOp(accessrights, filepath); });
+}
+
+int FS::compress(std::string mode, std::string path)
+{
+    return traced(STAT_COMPRESS, [&] { return "compress " + mode + " " + path; }, [&] { return compressOp(mode, path); });
+}
+
+int FS::du(std::string path)
+{
+    return traced(STAT_DU, [&] { return "du " + path; }, [&] { return duOp(path); });
+}
+
+int FS::find(std::string path, std::string name)
+{
+    return traced(STAT_FIND, [&] { return "find " + path + " " + name; }, [&] { return findOp(path, name); });
+}
+
+int FS::fsck(bool repair)
+{
+    return traced(STAT_FSCK, [&] { return std::string(repair ? "fsck -r" : "fsck"); }, [&] { return fsckOp(repair); });
+}
+
+int FS::sync()
+{
+    return traced(STAT_SYNC, [] { return std::string("sync"); }, [this] { return syncOp(); });
+}
+
+int FS::metrics()
+{
+    return traced(STAT_METRICS, [] { return std::string("metrics"); }, [this] { return metricsOp(); });
+}
+
+// a batch is recorded the way the shell takes it
+int FS::begin()
+{
+    return traced(STAT_BEGIN, [] { return std::string("batch {"); }, [this] { return beginOp(); });
+}
+
+int FS::commit()
+{
+    return traced(STAT_COMMIT, [] { return std::string("}"); }, [this] { return commitOp(); });
+}
+
+// stats prints the latencies of the calls of the file system and the disk
+int FS::stats(bool json)
+{
+    if (!STATS) {
+        err() << "Error: Statistics are compiled out.\n";
+        return -1;
+    }
+    std::vector<LatencySummary> summaries;
+    latencies.summarize("fs.", summaries);
+    disk.stats().summarize("disk.", summaries);
+    printLatencies(out(), summaries, json);
+    return 0;
+}
+
+int FS::resetStats()
+{
+    latencies.reset();
+    disk.stats().reset();
+    return 0;
+}
+
+int FS::traceBlocks(const std::string& path)
+{
+    if (!path.empty()) {
+        return blockTrace.start(path);
+    }
+    if (blockTrace.stop(statNames) != 0) {
+        err() << "Error: Could not write the block trace.\n";
+        return -1;
+    }
+    return 0;
+}
+
+// Run op on the async scheduler in a copy of the calling session, reading
+// input as its data; the future gets its status and what it printed
+std::future<AsyncResult> FS::submit(std::function<int()> op, const std::string& input)
+{
+    std::call_once(schedulerStarted, [this] { scheduler.reset(new TaskPool(ASYNC_WORKERS)); });
+    auto promise = std::make_shared<std::promise<AsyncResult>>();
+    std::future<AsyncResult> result = promise->get_future();
+    Session caller;
+    caller.id = session().id;
+    caller.currentDir = session().currentDir;
+    caller.currentPath = session().currentPath;
+    scheduler->submit(asyncOps, [this, promise, caller, op, input]() mutable {
+        std::istringstream data(input);
+        std::ostringstream output;
+        caller.in = &data;
+        caller.out = &output;
+        caller.err = &output;
+        try {
+            SessionScope scope(caller);
+            int status = op();
+            promise->set_value({ status, output.str() });
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return result;
+}
+
+// content is the data create would read, lines ended by an empty line or
+// the end of content
+std::future<AsyncResult> FS::async_create(std::string filepath, std::string content)
+{
+    return submit([this, filepath] { return create(filepath); }, content);
+}
+
+std::future<AsyncResult> FS::async_cat(std::string filepath)
+{
+    return submit([this, filepath] { return cat(filepath); });
+}
+
+std::future<AsyncResult> FS::async_ls()
+{
+    return submit([this] { return ls(); });
+}
+
+std::future<AsyncResult> FS::async_cp(std::string sourcepath, std::string destpath, bool recursive)
+{
+    return submit([this, sourcepath, destpath, recursive] { return cp(sourcepath, destpath, recursive); });
+}
+
+std::future<AsyncResult> FS::async_mv(std::string sourcepath, std::string destpath)
+{
+    return submit([this, sourcepath, destpath] { return mv(sourcepath, destpath); });
+}
+
+std::future<AsyncResult> FS::async_rm(std::string filepath, bool recursive)
+{
+    return submit([this, filepath, recursive] { return rm(filepath, recursive); });
+}
+
+std::future<AsyncResult> FS::async_append(std::string filepath1, std::string filepath2)
+{
+    return submit([this, filepath1, filepath2] { return append(filepath1, filepath2); });
+}
+
+std::future<AsyncResult> FS::async_mkdir(std::string dirpath)
+{
+    return submit([this, dirpath] { return mkdir(dirpath); });
+}
+
+std::future<AsyncResult> FS::async_chmod(std::string accessrights, std::string filepath)
+{
+    return submit([this, accessrights, filepath] { return chmod(accessrights, filepath); });
+}
+
+std::future<AsyncResult> FS::async_compress(std::string mode, std::string path)
+{
+    return submit([this, mode, path] { return compress(mode, path); });
+}
+
+std::future<AsyncResult> FS::async_du(std::string path)
+{
+    return submit([this, path] { return du(path); });
+}
+
+std::future<AsyncResult> FS::async_find(std::string path, std::string name)
+{
+    return submit([this, path, name] { return find(path, name); });
+}
+
+std::future<AsyncResult> FS::async_sync()
+{
+    return submit([this] { return sync(); });
+}
@@ -1,42 +1,135 @@
 #include <cstdint>
+#include "cache.h"
 #include "disk.h"
+#include "geometry.h"
+#include "journal.h"
+#include "locks.h"
+#include "taskpool.h"
+#include "blocktrace.h"
+#include "stats.h"
+#include "trace.h"
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <cstring>
 #include <fstream>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <cctype>
+#include <iostream>
 
 #ifndef __FS_H__
 #define __FS_H__
 
 #define ROOT_BLOCK 0
 #define FAT_BLOCK 1
+#define SUPER_BLOCK 2
+#define JOURNAL_START 3
+#define FIRST_DATA_BLOCK (JOURNAL_START + JOURNAL_BLOCKS)
+#define FS_MAGIC 0x33424c46 // "FLB3"
+// version 1 superblocks predate the FAT entry size and name length, and
+// are all Geometry4K
+#define FS_VERSION 2
 #define FAT_FREE 0
-#define FAT_EOF 0xFFFF // 0xFFFF, end of file marker in FAT table (Since uint16_t cannot represent -1)
+#define FAT_EOF ((FATEntry)~0) // all ones, end of file marker in FAT table (FATEntry cannot represent -1)
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
+#define TYPE_MASK 0x0F   // low bits of dir_entry::type hold the file type
+#define TYPE_INLINE 0x10 // file data lives in the directory's inline area
+#define TYPE_TAIL 0x20   // partial last block lives in the directory's inline area
+#define TYPE_COMPRESSED 0x40 // data blocks are stored compressed; on "." the default of new files
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
 
-// Define constants
-#define BLOCK_SIZE 4096  // 4 KB blocks
-#define MAX_BLOCKS 2048  // Maximum number of blocks
+// Define constants, BLOCK_SIZE comes with the disk
+#define MAX_BLOCKS FsGeometry::blocks  // Maximum number of blocks
+
+// Most bytes a file keeps in the directory's inline area: all of a small
+// file, or with TAIL_PACKING the partial last block of a larger one
+#define INLINE_MAX (BLOCK_SIZE / 4)
+#define TAIL_PACKING true
 
 // Define FAT entry type
-using FATEntry = uint16_t;
+using FATEntry = FsGeometry::FATEntry;
+
+using dir_entry = FsGeometry::dir_entry;
+
+#define DIR_ENTRIES FsGeometry::dirEntries
+
+// Side block of a directory holding the data of its inline files and the
+// packed tails of its other files. The block number is kept in the size field
+// of the directory's "." entry (0 = none), and the fragment of entry i starts
+// at data[offset[i]]. Its length follows from the entry's size.
+struct inline_area {
+    uint16_t offset[DIR_ENTRIES];
+    uint8_t data[BLOCK_SIZE - DIR_ENTRIES * sizeof(uint16_t)];
+};
 
+// Describes the file system found on a disk, checked when mounting
+struct super_block {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t no_blocks;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t fat_entry_size;
+    uint32_t name_length;
+};
+
+// Per-session state, every client of the file system has its own working
+// directory and its own streams for file data and messages
+struct Session {
+    FATEntry currentDir = ROOT_BLOCK;
+    std::vector<std::string> currentPath;
+    std::istream* in = &std::cin;
+    std::ostream* out = &std::cout;
+    std::ostream* err = &std::cerr;
+    // tells the sessions in a trace apart, the copies of the async API keep it
+    unsigned long id = ++ids;
+    static std::atomic<unsigned long> ids;
+    // every session there is, so rm -r can check their working directories.
+    // registryMutex also guards currentDir when it changes.
+    static std::mutex registryMutex;
+    static std::set<const Session*> registry;
+    Session();
+    Session(const Session& other);
+    Session& operator=(const Session& other) = default;
+    ~Session();
+};
 
-struct dir_entry {
-    char file_name[56]; // name of the file / sub-directory
-    uint32_t size; // size of the file in bytes
-    FATEntry first_blk; // index in the FAT for the first block of the file
-    uint8_t type; // directory (1) or file (0)
-    uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+// Outcome of an operation of the async API: what the call returned and what
+// it printed, e.g. the content of a file for async_cat
+struct AsyncResult {
+    int status;
+    std::string output;
 };
 
+// Blocks of a file read ahead of a reader, at first and at most
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 64
+// Buffers between the read and the write stage of a pipelined copy, so a
+// copy of any size needs this much memory
+#define PIPELINE_BUFFERS 8
+// Operations of the async API running at the same time, they mostly wait
+// for the disk so there are more of them than cores
+#define ASYNC_WORKERS 8
+// Free blocks a writer takes from the global free map at a time
+#define RESERVE_BLOCKS 32
+// File copies of cp -r reading or writing at the same time
+#define MAX_INFLIGHT_IO 8
+
+// the calls of the public API, for their latency statistics
+enum FsStat {
+    STAT_FORMAT, STAT_CREATE, STAT_CAT, STAT_LS, STAT_CP, STAT_MV, STAT_RM, STAT_APPEND, STAT_MKDIR, STAT_CD,
+    STAT_PWD, STAT_CHMOD, STAT_DU, STAT_FIND, STAT_FSCK, STAT_SYNC, STAT_METRICS, STAT_BEGIN, STAT_COMMIT,
+    STAT_COMPRESS
+};
 
 struct PathResult {
     FATEntry block;          // The block where the directory or file is located
@@ -48,30 +141,154 @@ struct PathResult {
 class FS {
 private:
     Disk disk;
+    // file data is written back in the background by the cache's flusher
+    BlockCache cache;
+    // metadata (FAT, directories, inline areas) is written through the journal
+    Journal journal;
     // size of a FAT entry is 2 bytes
-    FATEntry fat[MAX_BLOCKS]; // FAT table
-    //working directory
-    FATEntry currentDir;
-    // path
-    std::vector<std::string> currentPath;
+    alignas(BUFFER_ALIGN) FATEntry fat[MAX_BLOCKS]; // FAT table, read and written as a block
+    // guards changes to fat[] and the allocation of free blocks
+    std::mutex allocMutex;
+    // free blocks reserved by one thread, handed out to it without
+    // allocMutex. They are FAT_EOF in fat[] but written to disk as free.
+    struct BlockPool {
+        std::mutex mutex;             // only contended by writeFAT and trims
+        std::vector<FATEntry> blocks;
+        bool used = false;            // allocated from since the last trim
+    };
+    std::vector<std::unique_ptr<BlockPool>> pools;
+    // tells FS objects apart for the thread-local pool cache
+    static std::atomic<unsigned long> instances;
+    const unsigned long instance;
+    // the disk holds a file system this build can't mount, or is not a disk
+    // of its geometry; every call fails rather than touch it
+    bool refused = false;
+    // directory blocks and files (by first block) locked by an operation
+    LockTable dirLocks;
+    LockTable fileLocks;
+    // runs the directory tasks of tree operations, started on first use
+    std::unique_ptr<TaskPool> pool;
+    std::once_flag poolStarted;
+    Semaphore ioSlots;
+    // runs the operations of the async API, started on first use
+    std::unique_ptr<TaskPool> scheduler;
+    std::once_flag schedulerStarted;
+    TaskGroup asyncOps;
+    // state shared by the tasks of one tree operation
+    struct TreeWalk {
+        TaskGroup group;
+        std::mutex mutex;
+        std::string error;              // first error, printed by the caller
+        std::vector<FATEntry> dirs;     // rm -r: directory blocks to release
+        std::vector<std::string> found; // find: matching paths
+        std::atomic<uint64_t> bytes{0}; // du: size of the files
+        void fail(const std::string& message);
+    };
+    struct DirCopy;
+    struct FsckScan;
+    TraceRecorder recorder;
+    LatencyStats latencies;
+    // block accesses, each with the call of the thread that made it
+    BlockTrace blockTrace;
+    static thread_local BlockOrigin origin;
+    // session of callers that never bound one, e.g. the shell
+    Session defaultSession;
+    static thread_local Session* boundSession;
+    Session& session();
+    std::istream& in();
+    std::ostream& out();
+    std::ostream& err();
     //Helpers
     bool readBlock(size_t blockNum, void* buffer);
-    bool writeBlock(size_t blockNum, const void* buffer);
-    std::vector<FATEntry> freeFATEntries(uint8_t size);
+    bool writeBlock(size_t blockNum, const void* buffer, bool compressed = false);
+    bool writeDataBlock(size_t blockNum, const uint8_t* buffer, bool compressed);
+    bool writeMetaBlock(size_t blockNum, const void* buffer);
+    void writeFAT();
+    void stageFAT();
+    BlockPool& localPool();
+    bool refillPool(BlockPool& pool, size_t size);
+    bool trimPools(bool idleOnly);
+    bool readDirBlock(FATEntry blockNum, void* buffer);
+    int mount();
+    std::vector<FATEntry> freeFATEntries(size_t size);
     int findDirEntry(dir_entry* dirTable, dir_entry& destEntry, const std::string& dirpath);
-    void writePagesToFat(const size_t totalSize, const std::string content, const std::vector<FATEntry> freeEntries);
+    void writePagesToFat(const size_t totalSize, const std::string content, const std::vector<FATEntry> freeEntries, bool compressed);
     bool createDirEntry(dir_entry* dirEntries, dir_entry*& newEntry, const std::string& fileName);
     bool isValidEntry(const dir_entry& entry) const;
     std::string accessRightsToString(uint8_t accessRights) const;
     bool hasPermission(const dir_entry& entry, uint8_t requiredRights) const;
     bool isDirectory(const dir_entry& entry) const;
     bool isFile(const dir_entry& entry) const;
+    bool isInline(const dir_entry& entry) const;
+    bool isTailPacked(const dir_entry& entry) const;
+    bool isCompressed(const dir_entry& entry) const;
+    size_t fragmentLength(const dir_entry& entry) const;
+    bool storeFragment(dir_entry* dirEntries, int index, const std::string& fragment);
+    bool readFragment(const dir_entry* dirEntries, int index, std::string& fragment);
+    bool readFileData(const dir_entry* dirEntries, int index, std::string& content);
+    int writeBlocks(dir_entry* dirEntries, int index, FATEntry lastBlock, const std::string& content);
+    int writeFileData(dir_entry* dirEntries, int index, const std::string& content);
+    int appendFileData(dir_entry* dirEntries, int index, const std::string& content);
+    void freeFileData(dir_entry* dirEntries, int index);
+    void linkBlocks(const std::vector<FATEntry>& blocks);
+    bool isLargeFile(const dir_entry& entry) const;
+    bool pipeBlocks(const std::string& prefix, FATEntry first, size_t bytes, const std::string& suffix, const std::vector<FATEntry>& dest, bool compressed);
+    int copyLargeFile(const dir_entry* srcEntries, int srcIndex, dir_entry& entry);
+    int appendLargeFile(const dir_entry* srcEntries, int srcIndex, dir_entry* dirEntries, int index);
+    void releaseInlineArea(dir_entry* dirEntries);
     PathResult resolvePath(const std::string& path);
+    TaskPool& tasks();
+    void spawn(TreeWalk& walk, std::function<void()> task);
+    std::future<AsyncResult> submit(std::function<int()> op, const std::string& input = "");
+    void initDirBlock(uint8_t* block, FATEntry self, FATEntry parent, uint8_t access);
+    void releaseBlocks(const std::vector<FATEntry>& blocks);
+    void checkRemovable(TreeWalk& walk, FATEntry dirBlock, const std::string& path);
+    void removeDirectory(TreeWalk& walk, FATEntry dirBlock);
+    void copyDirectory(TreeWalk& walk, FATEntry srcBlock, FATEntry newBlock, FATEntry newParent);
+    void copyFile(std::shared_ptr<DirCopy> copy, int index, int srcIndex);
+    void finishCopy(DirCopy& copy);
+    void scanDirectory(TreeWalk& walk, FATEntry dirBlock, const std::string& prefix, const std::string& pattern);
+    void checkDirectory(TreeWalk& walk, FsckScan& scan, FATEntry dirBlock, FATEntry parent, const std::string& path);
+    int removeTree(const std::string& dirpath, FATEntry dirBlock);
+    int copyTree(const std::string& sourcepath, FATEntry srcBlock, const std::string& destpath);
     std::vector<std::string> splitPath(const std::string& path);
+    int traced(FsStat stat, const std::function<std::string()>& command, const std::function<int()>& op, bool input = false);
+    // the calls of the public API below, traced() around them
+    int formatOp();
+    int createOp(std::string filepath);
+    int catOp(std::string filepath);
+    int lsOp();
+    int cpOp(std::string sourcepath, std::string destpath, bool recursive);
+    int mvOp(std::string sourcepath, std::string destpath);
+    int rmOp(std::string filepath, bool recursive);
+    int appendOp(std::string filepath1, std::string filepath2);
+    int mkdirOp(std::string dirpath);
+    int cdOp(std::string dirpath);
+    int pwdOp();
+    int chmodOp(std::string accessrights, std::string filepath);
+    int compressOp(std::string mode, std::string path);
+    int duOp(std::string path);
+    int findOp(std::string path, std::string name);
+    int fsckOp(bool repair);
+    int syncOp();
+    int metricsOp();
+    int beginOp();
+    int commitOp();
 
 public:
+    // Binds a session to the calling thread for as long as it is in scope,
+    // FS calls from that thread then use its working directory
+    class SessionScope {
+    private:
+        Session* previous;
+    public:
+        SessionScope(Session& session);
+        ~SessionScope();
+    };
+
     //assigment funks
-    FS();
+    // the disk is the one FS_DISK names unless given
+    FS(const CacheOptions& options = CacheOptions(), const DiskOptions& diskOptions = DiskOptions::fromEnvironment());
     ~FS();
     // formats the disk, i.e., creates an empty file system
     int format();
@@ -84,13 +301,15 @@ public:
     int ls();
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
-    // <sourcepath> to a new file <destpath>
-    int cp(std::string sourcepath, std::string destpath);
+    // <sourcepath> to a new file <destpath>. With recursive set a directory
+    // is copied with everything below it.
+    int cp(std::string sourcepath, std::string destpath, bool recursive = false);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
     int mv(std::string sourcepath, std::string destpath);
-    // rm <filepath> removes / deletes the file <filepath>
-    int rm(std::string filepath);
+    // rm <filepath> removes / deletes the file <filepath>. With recursive set
+    // a directory is removed with everything below it.
+    int rm(std::string filepath, bool recursive = false);
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
     int append(std::string filepath1, std::string filepath2);
@@ -107,6 +326,63 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+    // compress on|off <path> stores the data of the file <path> compressed
+    // on the disk, or not, from now on, rewriting what it has. For a
+    // directory it sets what files created in it start with.
+    int compress(std::string mode, std::string path);
+
+    // du <path> prints the total size of the files below <path>
+    int du(std::string path);
+    // find <path> <name> prints the paths below <path> whose name matches
+    // the pattern <name> (with * and ?)
+    int find(std::string path, std::string name);
+
+    // fsck checks that the directories and the FAT agree: every FAT chain
+    // ends, belongs to one file and fits its size, no block is in use
+    // without an owner, and "." and ".." point where they should. With
+    // repair set the problems found are fixed, truncating or dropping
+    // files whose chains are broken.
+    int fsck(bool repair = false);
+
+    // sync commits the pending group of operations to the disk
+    int sync();
+    // metrics prints the state of the block cache and its flusher
+    int metrics();
+    // begin starts a batch of operations and commit applies them with a
+    // single write per touched metadata block and a single sync
+    int begin();
+    int commit();
+    // stats prints the count and latency percentiles of every call of the
+    // file system and the disk, as a table or as JSON; resetStats starts over
+    int stats(bool json = false);
+    int resetStats();
+    // blocktrace <file> records every block read and written from now on,
+    // blocktrace without a file stops and writes the accesses to the file
+    // for blockstat
+    int traceBlocks(const std::string& path);
+    // record <file> writes every call made from now on to a trace file,
+    // to be replayed with fsreplay; an empty path stops the recording
+    int record(const std::string& path);
+
+    // Async counterparts of the calls above. They return at once, the call
+    // runs on a pool of ASYNC_WORKERS threads, so one thread can have many
+    // operations outstanding. Relative paths are resolved against the
+    // working directory of the calling session when the call is issued.
+    // Operations issued together may run in any order; wait for one before
+    // issuing another that depends on it.
+    std::future<AsyncResult> async_create(std::string filepath, std::string content);
+    std::future<AsyncResult> async_cat(std::string filepath);
+    std::future<AsyncResult> async_ls();
+    std::future<AsyncResult> async_cp(std::string sourcepath, std::string destpath, bool recursive = false);
+    std::future<AsyncResult> async_mv(std::string sourcepath, std::string destpath);
+    std::future<AsyncResult> async_rm(std::string filepath, bool recursive = false);
+    std::future<AsyncResult> async_append(std::string filepath1, std::string filepath2);
+    std::future<AsyncResult> async_mkdir(std::string dirpath);
+    std::future<AsyncResult> async_chmod(std::string accessrights, std::string filepath);
+    std::future<AsyncResult> async_compress(std::string mode, std::string path);
+    std::future<AsyncResult> async_du(std::string path);
+    std::future<AsyncResult> async_find(std::string path, std::string name);
+    std::future<AsyncResult> async_sync();
 };
 
 #endif // __FS_H__
@@ -0,0 +1,269 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "fs.h"
+
+// fsbench [-f json|csv] [-o file] [-d ram|file|direct|both|all] [-r reps]
+//
+// Microbenchmarks of the file system operations, run in-process against a
+// RAM disk, which leaves the cost of the file system itself, against a
+// disk file in the working directory, and with all (against the same file
+// read and written with O_DIRECT, where the block cache is the only cache):
+//   size    create, cat, cp, append and rm of files of growing size
+//   fanout  mkdir, create, mv, rm and a lookup in directories of growing width
+//   depth   cd and a lookup along paths of growing depth
+//   format  format of the whole disk
+// Every row gives the time per operation, so releases can be compared row by
+// row. Results go to the output file, progress to stdout.
+
+struct Result {
+    std::string disk;
+    std::string group;   // size, fanout, depth or format
+    std::string op;
+    unsigned long value; // file size in bytes, directory width or path depth
+    unsigned ops;
+    double nsPerOp;
+    double mbPerS;       // for operations moving file data, else 0
+};
+
+class Bench {
+private:
+    FS& fs;
+    std::string disk;
+    unsigned reps;
+    Session session;
+    std::istringstream in;
+    std::ostringstream err;
+    std::ostream null;
+    std::vector<Result>& results;
+public:
+    Bench(FS& fs, const std::string& disk, unsigned reps, std::vector<Result>& results)
+        : fs(fs), disk(disk), reps(reps), null(nullptr), results(results)
+    {
+        session.in = &in;
+        session.out = &null;
+        session.err = &err;
+    }
+
+    // runs op(i) for i in [0, ops) and records the time each took on average
+    void time(const std::string& group, const std::string& op, unsigned long value, unsigned ops,
+              size_t bytes, std::function<int(unsigned)> call)
+    {
+        FS::SessionScope scope(session);
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < ops; ++i) {
+            if (call(i) != 0) {
+                std::cerr << "fsbench: " << op << " failed (" << group << " " << value << "): " << err.str();
+                exit(1);
+            }
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        double mb = bytes ? (double)bytes * ops / (1 << 20) / (ns / 1e9) : 0;
+        results.push_back({ disk, group, op, value, ops, ns / ops, mb });
+    }
+
+    // runs op once without timing it, for the setup of a case
+    void run(std::function<int()> call)
+    {
+        FS::SessionScope scope(session);
+        if (call() != 0) {
+            std::cerr << "fsbench: setup failed: " << err.str();
+            exit(1);
+        }
+    }
+
+    int create(const std::string& path, const std::string& content)
+    {
+        in.clear();
+        in.str(content + "\n");
+        return fs.create(path);
+    }
+
+    void sizes()
+    {
+        for (size_t size : { 64, 4096, 65536, 524288 }) {
+            // at most about 1 MiB per operation, so the copies fit on the disk
+            unsigned ops = std::max<size_t>(1, std::min<size_t>(reps, (1 << 20) / size));
+            std::string content;
+            while (content.size() < size) {
+                content += std::string(63, 'x') + "\n";
+            }
+            content.resize(size - 1);
+            content += "\n";
+            auto name = [](const char* dir, unsigned i) { return std::string(dir) + "/f" + std::to_string(i); };
+            run([&] { return fs.format(); });
+            run([&] { return fs.mkdir("/s"); });
+            run([&] { return fs.mkdir("/c"); });
+            run([&] { return fs.mkdir("/a"); });
+            time("size", "create", size, ops, size, [&](unsigned i) { return create(name("/s", i), content); });
+            time("size", "cat", size, ops, size, [&](unsigned i) { return fs.cat(name("/s", i)); });
+            time("size", "cp", size, ops, size, [&](unsigned i) { return fs.cp(name("/s", i), name("/c", i)); });
+            for (unsigned i = 0; i < ops; ++i) {
+                run([&] { return create(name("/a", i), "a"); });
+            }
+            time("size", "append", size, ops, size, [&](unsigned i) { return fs.append(name("/s", i), name("/a", i)); });
+            time("size", "rm", size, ops, 0, [&](unsigned i) { return fs.rm(name("/c", i)); });
+        }
+    }
+
+    void fanouts()
+    {
+        // a directory holds 64 entries, a directory and a file per step
+        for (unsigned width : { 4, 16, 30 }) {
+            auto name = [](char kind, unsigned i) { return std::string("/d/") + kind + std::to_string(i); };
+            run([&] { return fs.format(); });
+            run([&] { return fs.mkdir("/d"); });
+            time("fanout", "mkdir", width, width, 0, [&](unsigned i) { return fs.mkdir(name('e', i)); });
+            time("fanout", "create", width, width, 0, [&](unsigned i) { return create(name('f', i), "f"); });
+            std::string last = name('f', width - 1);
+            time("fanout", "resolve", width, reps, 0, [&](unsigned) { return fs.cat(last); });
+            // mv takes the source by name in the working directory
+            run([&] { return fs.cd("/d"); });
+            time("fanout", "mv", width, width, 0, [&](unsigned i) { return fs.mv(name('f', i).substr(3), name('g', i)); });
+            run([&] { return fs.cd(".."); });
+            time("fanout", "rm", width, width, 0, [&](unsigned i) { return fs.rm(name('g', i)); });
+        }
+    }
+
+    void depths()
+    {
+        for (unsigned depth : { 1, 8, 32 }) {
+            run([&] { return fs.format(); });
+            std::string path;
+            for (unsigned d = 0; d < depth; ++d) {
+                path += "/p";
+                run([&] { return fs.mkdir(path); });
+            }
+            run([&] { return create(path + "/f", "f"); });
+            // there and back, cd to the directory it is in is refused
+            run([&] { return fs.mkdir("/q"); });
+            time("depth", "cd", depth, reps, 0, [&](unsigned) { return fs.cd(path) || fs.cd("/q"); });
+            run([&] { return fs.cd(".."); });
+            time("depth", "resolve", depth, reps, 0, [&](unsigned) { return fs.cat(path + "/f"); });
+        }
+    }
+
+    void formats()
+    {
+        time("format", "format", 0, std::max(1u, reps / 8), 0, [&](unsigned) { return fs.format(); });
+    }
+};
+
+// runs every case against a fresh RAM disk, or a fresh disk file in dir,
+// direct or through the page cache
+static bool
+benchDisk(const std::string& disk, const std::string& dir, unsigned reps, std::vector<Result>& results)
+{
+    DiskOptions options;
+    options.memory = disk == "ram";
+    options.direct = disk == "direct";
+    if (!options.memory) {
+        std::string scratch = dir + "/fsbench.XXXXXX";
+        std::vector<char> path(scratch.begin(), scratch.end());
+        path.push_back('\0');
+        int fd = mkstemp(path.data());
+        if (fd < 0) {
+            std::cerr << "fsbench: can't make a disk file in " << dir << "\n";
+            return false;
+        }
+        close(fd);
+        options.path = path.data();
+        std::cout << "fsbench: " << disk << " disk in " << options.path << std::endl;
+    } else {
+        std::cout << "fsbench: " << disk << " disk" << std::endl;
+    }
+    {
+        FS fs(CacheOptions(), options);
+        Bench bench(fs, disk, reps, results);
+        bench.formats();
+        bench.sizes();
+        bench.fanouts();
+        bench.depths();
+    }
+    if (!options.memory) {
+        unlink(options.path.c_str());
+    }
+    return true;
+}
+
+static void
+writeJson(std::ostream& out, const std::vector<Result>& results)
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "  {\"disk\": \"" << r.disk << "\", \"group\": \"" << r.group << "\", \"op\": \"" << r.op
+            << "\", \"value\": " << r.value << ", \"ops\": " << r.ops
+            << ", \"ns_per_op\": " << r.nsPerOp << ", \"mb_per_s\": " << r.mbPerS << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+static void
+writeCsv(std::ostream& out, const std::vector<Result>& results)
+{
+    out << "disk,group,op,value,ops,ns_per_op,mb_per_s\n";
+    for (const Result& r : results) {
+        out << r.disk << "," << r.group << "," << r.op << "," << r.value << "," << r.ops << ","
+            << r.nsPerOp << "," << r.mbPerS << "\n";
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string format = "json";
+    std::string output;
+    std::string disks = "both";
+    unsigned reps = 32;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:d:r:")) != -1) {
+        switch (opt) {
+        case 'f': format = optarg; break;
+        case 'o': output = optarg; break;
+        case 'd': disks = optarg; break;
+        case 'r': reps = std::max(1, std::atoi(optarg)); break;
+        default:
+            format = "";
+        }
+    }
+    if ((format != "json" && format != "csv") ||
+        (disks != "ram" && disks != "file" && disks != "direct" && disks != "both" && disks != "all")) {
+        std::cerr << "Usage: fsbench [-f json|csv] [-o file] [-d ram|file|direct|both|all] [-r reps]\n";
+        return 1;
+    }
+    if (output.empty()) {
+        output = "bench." + format;
+    }
+
+    std::vector<Result> results;
+    bool ram = disks == "ram" || disks == "both" || disks == "all";
+    bool file = disks == "file" || disks == "both" || disks == "all";
+    bool direct = disks == "direct" || disks == "all";
+    if ((ram && !benchDisk("ram", "", reps, results)) || (file && !benchDisk("file", ".", reps, results)) ||
+        (direct && !benchDisk("direct", ".", reps, results))) {
+        return 1;
+    }
+
+    std::ofstream out(output);
+    out << std::fixed << std::setprecision(1);
+    if (format == "json") {
+        writeJson(out, results);
+    } else {
+        writeCsv(out, results);
+    }
+    if (!out) {
+        std::cerr << "fsbench: can't write " << output << "\n";
+        return 1;
+    }
+    std::cout << "fsbench: " << results.size() << " results written to " << output << std::endl;
+    return 0;
+}
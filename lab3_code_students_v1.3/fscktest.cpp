@@ -0,0 +1,131 @@
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fstest.h"
+
+// fscktest
+//
+// Checks fsck -r on damaged images. The damage is done on the disk itself,
+// with the journal cleared so mount has nothing to replay over it. fsck has
+// to find it, the repair has to leave the intact files as they were, and
+// fsck has to find nothing afterwards.
+
+// the blocks of the chain starting at first
+static std::vector<FATEntry>
+chain(const FATEntry* fat, FATEntry first)
+{
+    std::vector<FATEntry> blocks;
+    for (FATEntry b = first; b != FAT_EOF && blocks.size() < MAX_BLOCKS; b = fat[b]) {
+        blocks.push_back(b);
+    }
+    return blocks;
+}
+
+static dir_entry*
+find(dir_entry* entries, const char* name)
+{
+    for (size_t i = 0; i < DIR_ENTRIES; ++i) {
+        if (std::strcmp(entries[i].file_name, name) == 0) {
+            return &entries[i];
+        }
+    }
+    return nullptr;
+}
+
+// The FAT and the block of directory /d of an image, written back with the
+// journal cleared by save
+struct Image {
+    Disk& disk;
+    BlockBuffer fatBlock, dirBlock;
+    FATEntry dirNum = 0;
+    FATEntry* fat = reinterpret_cast<FATEntry*>(fatBlock.data());
+    dir_entry* dir = reinterpret_cast<dir_entry*>(dirBlock.data());
+
+    Image(Disk& disk) : disk(disk)
+    {
+        BlockBuffer root;
+        disk.read(ROOT_BLOCK, root);
+        disk.read(FAT_BLOCK, fatBlock);
+        dir_entry* d = find(reinterpret_cast<dir_entry*>(root.data()), "d");
+        if (d && disk.read(d->first_blk, dirBlock) == 0) {
+            dirNum = d->first_blk;
+        }
+    }
+    bool save()
+    {
+        BlockBuffer empty;
+        return dirNum != 0 && disk.write(FAT_BLOCK, fatBlock) == 0 && disk.write(dirNum, dirBlock) == 0 &&
+               disk.write(JOURNAL_START, empty) == 0 && disk.write(JOURNAL_START + JOURNAL_HALF, empty) == 0;
+    }
+};
+
+// Writes files to directory /d of a new image, damages the image with damage
+// and checks what fsck -r makes of it
+static void
+scenario(const std::string& what, const std::vector<std::pair<std::string, std::string>>& files,
+         const std::function<bool(Image&)>& damage)
+{
+    std::cout << "Testing fsck -r on " << what << "..." << std::endl;
+    ScratchDisk scratch("fscktest");
+    std::vector<std::string> contents;
+    bool ok = true;
+    {
+        FS fs(CacheOptions(), scratch.options);
+        fs.format();
+        ok = fs.mkdir("/d") == 0;
+        for (auto& file : files) {
+            ok = ok && fs.async_create("/d/" + file.first, file.second).get().status == 0;
+            contents.push_back(output(fs.async_cat("/d/" + file.first)));
+        }
+    }
+    {
+        Disk disk(scratch.options);
+        Image image(disk);
+        ok = check(ok && damage(image) && image.save(), "damage the image") && ok;
+    }
+    if (!ok) return;
+    FS fs(CacheOptions(), scratch.options);
+    check(fsckQuiet(fs) != 0, "fsck finds the damage");
+    check(fs.fsck(true) == 0, "fsck -r repairs it");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing after the repair");
+    for (size_t i = 0; i < files.size(); ++i) {
+        AsyncResult read = fs.async_cat("/d/" + files[i].first).get();
+        check(read.status == 0 && read.output == contents[i], "/d/" + files[i].first + " is as it was");
+    }
+}
+
+int
+main()
+{
+    // the last block of f1 linked to a block in the middle of f4, the chain
+    // of f1 is cut back to its length and f4 keeps the block
+    scenario("a file linked into another one",
+             { { "f1", text(3 * BLOCK_SIZE, 'a') }, { "f4", text(5 * BLOCK_SIZE + INLINE_MAX / 2, 'b') } },
+             [](Image& image) {
+                 dir_entry* f1 = find(image.dir, "f1");
+                 dir_entry* f4 = find(image.dir, "f4");
+                 if (!f1 || !f4 || chain(image.fat, f4->first_blk).size() < 2) return false;
+                 image.fat[chain(image.fat, f1->first_blk).back()] = chain(image.fat, f4->first_blk)[1];
+                 return true;
+             });
+    // an empty inline file pointing at some other block, it is pointed back
+    // at the directory's inline area
+    scenario("an empty file outside the inline area", { { "e", "" }, { "g", "hej heja hejare\n" } },
+             [](Image& image) {
+                 dir_entry* e = find(image.dir, "e");
+                 if (!e) return false;
+                 e->first_blk = image.dirNum;
+                 return true;
+             });
+    // the inline area freed under an empty file, the directory gets a new one
+    scenario("an empty file in a freed inline area", { { "e", "" } }, [](Image& image) {
+        FATEntry area = image.dir[0].size;
+        if (area == 0) return false;
+        image.fat[area] = FAT_FREE;
+        image.dir[0].size = 0;
+        return true;
+    });
+    return testFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+#include <thread>
+#include "fs.h"
+#include "server.h"
+
+// fsd [socket] [workers] [tracefile] serves the file system in diskfile.bin,
+// or on the disk FS_DISK names, until it gets SIGINT or SIGTERM, recording
+// the calls to tracefile if given
+int
+main(int argc, char **argv)
+{
+    std::string path = argc > 1 ? argv[1] : DEFAULT_SOCKET;
+    unsigned workers = argc > 2 ? std::atoi(argv[2]) : DEFAULT_WORKERS;
+
+    // the signals are taken by sigwait below, so block them in every thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    FS filesystem;
+    if (argc > 3 && filesystem.record(argv[3]) != 0) {
+        return 1;
+    }
+    Server server(filesystem);
+    if (server.listen(path) != 0) {
+        return 1;
+    }
+    std::thread waiter([&] {
+        int signal;
+        sigwait(&signals, &signal);
+        server.stop();
+    });
+    std::cout << "Serving on " << path << " with " << workers << " workers\n";
+    server.run(workers);
+    waiter.join();
+    std::cout << "Exiting server...\n";
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "client.h"
+
+// fsload [-s socket] [-c clients] [-n rounds] [-b bytes]
+//
+// Measures the throughput of a running server. Every client connects, makes
+// its own directory and then repeats a round of create, cat, ls, append, cat
+// and rm on files of the given size. Prints requests per second.
+int
+main(int argc, char **argv)
+{
+    std::string path = DEFAULT_SOCKET;
+    unsigned clients = 4;
+    unsigned rounds = 200;
+    size_t bytes = 512;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:n:b:")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'c': clients = std::atoi(optarg); break;
+        case 'n': rounds = std::atoi(optarg); break;
+        case 'b': bytes = std::atol(optarg); break;
+        default:
+            std::cerr << "Usage: fsload [-s socket] [-c clients] [-n rounds] [-b bytes]\n";
+            return 1;
+        }
+    }
+
+    // one line per 64 bytes, like text typed into create
+    std::string content;
+    while (content.size() < bytes) {
+        content += std::string(63, 'x') + "\n";
+    }
+    content.resize(bytes);
+    if (!content.empty()) {
+        content.back() = '\n';
+    }
+
+    std::atomic<unsigned long> requests(0);
+    std::atomic<unsigned long> failures(0);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c] {
+            Client client;
+            if (client.connect(path) != 0) {
+                std::cerr << "Error: could not connect to " << path << "\n";
+                ++failures;
+                return;
+            }
+            std::string dir = "load" + std::to_string(getpid()) + "_" + std::to_string(c);
+            unsigned long done = 0, failed = 0;
+            auto check = [&](int status) {
+                ++done;
+                if (status != 0) ++failed;
+            };
+            check(client.mkdir(dir));
+            check(client.cd(dir));
+            for (unsigned r = 0; r < rounds; ++r) {
+                std::string name = "f" + std::to_string(r);
+                check(client.create(name, content));
+                check(client.cat(name));
+                check(client.ls());
+                check(client.append(name, name));
+                check(client.cat(name));
+                check(client.rm(name));
+            }
+            requests += done;
+            failures += failed;
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "clients " << clients << ", requests " << requests << ", failed " << failures
+              << ", " << seconds << " s, " << (requests / seconds) << " requests/s\n";
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "fs.h"
+
+// fsreplay [-t] [-v] [-m | -d dir] <tracefile>
+//
+// Replays a trace recorded with the shell's record command or by fsd on a
+// freshly formatted file system, on a RAM disk with -m, otherwise in a
+// scratch disk file in dir (default the working directory). A plain command list like test_commands.txt works
+// as well. Every session of the trace runs on its own thread, making its
+// calls in the recorded order: at full speed, or with -t each at the time it
+// was made. -v prints what the calls print. Prints the time per command,
+// next to the recorded time, and every call whose status differs.
+int
+main(int argc, char **argv)
+{
+    bool timing = false;
+    bool verbose = false;
+    std::string dir = ".";
+    DiskOptions options;
+    int opt;
+    while ((opt = getopt(argc, argv, "tvmd:")) != -1) {
+        switch (opt) {
+        case 't': timing = true; break;
+        case 'v': verbose = true; break;
+        case 'm': options.memory = true; break;
+        case 'd': dir = optarg; break;
+        default:
+            optind = argc;
+        }
+    }
+    if (optind != argc - 1) {
+        std::cerr << "Usage: fsreplay [-t] [-v] [-m | -d dir] <tracefile>\n";
+        return 1;
+    }
+    std::ifstream file(argv[optind]);
+    if (!file) {
+        std::cerr << "fsreplay: can't read " << argv[optind] << "\n";
+        return 1;
+    }
+    std::vector<TraceRecord> records = readTrace(file);
+    std::map<unsigned long, std::vector<size_t>> sessions;
+    for (size_t i = 0; i < records.size(); ++i) {
+        sessions[records[i].session].push_back(i);
+    }
+
+    if (!options.memory) {
+        std::string scratch = dir + "/fsreplay.XXXXXX";
+        std::vector<char> path(scratch.begin(), scratch.end());
+        path.push_back('\0');
+        int fd = mkstemp(path.data());
+        if (fd < 0) {
+            std::cerr << "fsreplay: can't make a disk file in " << dir << "\n";
+            return 1;
+        }
+        close(fd);
+        options.path = path.data();
+    }
+
+    std::vector<int> status(records.size(), 0);
+    std::vector<uint64_t> duration(records.size(), 0);
+    std::vector<char> known(records.size(), false);
+    std::chrono::duration<double> elapsed;
+    {
+        FS fs(CacheOptions(), options);
+        fs.format();
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (auto& s : sessions) {
+            threads.emplace_back([&, calls = s.second] {
+                Session session;
+                std::ostringstream quiet;
+                if (!verbose) {
+                    session.out = &quiet;
+                    session.err = &quiet;
+                }
+                for (size_t i : calls) {
+                    if (timing && records[i].timed) {
+                        std::this_thread::sleep_until(start + std::chrono::microseconds(records[i].start));
+                    }
+                    auto begun = std::chrono::steady_clock::now();
+                    known[i] = replay(fs, session, records[i], status[i]);
+                    auto took = std::chrono::steady_clock::now() - begun;
+                    duration[i] = std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    if (!options.memory) {
+        unlink(options.path.c_str());
+    }
+
+    struct Totals {
+        unsigned calls = 0;
+        uint64_t replayed = 0;
+        uint64_t recorded = 0;
+    };
+    std::map<std::string, Totals> commands;
+    unsigned calls = 0, skipped = 0, differ = 0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (!known[i]) {
+            ++skipped;
+            continue;
+        }
+        ++calls;
+        Totals& t = commands[records[i].command.substr(0, records[i].command.find(' '))];
+        ++t.calls;
+        t.replayed += duration[i];
+        t.recorded += records[i].duration;
+        if (records[i].timed && status[i] != records[i].status) {
+            ++differ;
+            std::cout << "status " << status[i] << ", recorded " << records[i].status << ": " << records[i].command << "\n";
+        }
+    }
+    std::cout << std::fixed << std::setprecision(1)
+              << "replayed " << calls << " calls of " << sessions.size() << " sessions in " << elapsed.count() * 1000
+              << " ms, " << skipped << " lines skipped, " << differ << " statuses differ\n"
+              << "command\tcalls\tmean us\trecorded mean us\n";
+    for (auto& c : commands) {
+        std::cout << c.first << "\t" << c.second.calls << "\t" << (double)c.second.replayed / c.second.calls << "\t"
+                  << (double)c.second.recorded / c.second.calls << "\n";
+    }
+    return differ ? 2 : 0;
+}
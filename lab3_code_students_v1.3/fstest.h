@@ -0,0 +1,86 @@
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include "fs.h"
+
+#ifndef __FSTEST_H__
+#define __FSTEST_H__
+
+// What the test programs (fscktest, inlinetest, ...) share. A test works on
+// a disk file of its own in /tmp, so the real one is not touched, prints a
+// line for every check and exits with 1 if any of them failed.
+
+inline int testFailures = 0;
+
+inline bool
+check(bool ok, const std::string& what)
+{
+    std::cout << (ok ? "ok: " : "FAILED: ") << what << std::endl;
+    testFailures += !ok;
+    return ok;
+}
+
+// bytes of text in lines of up to 64 bytes, none of them empty as that
+// would end what create reads
+inline std::string
+text(size_t bytes, char c)
+{
+    std::string content;
+    while (content.size() + 64 < bytes) {
+        content += std::string(63, c) + "\n";
+    }
+    size_t rest = bytes - content.size();
+    if (rest == 1 && !content.empty()) {
+        content.erase(content.size() - 2, 1);
+        ++rest;
+    }
+    if (rest > 0) {
+        content += std::string(rest - 1, c) + "\n";
+    }
+    return content;
+}
+
+// A disk file in /tmp for one test, removed when it goes out of scope
+struct ScratchDisk {
+    DiskOptions options;
+    ScratchDisk(const std::string& name)
+    {
+        std::string path = "/tmp/" + name + ".XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0) {
+            std::cerr << name << ": can't make a disk file in /tmp\n";
+            std::exit(1);
+        }
+        close(fd);
+        options.path = path;
+    }
+    ~ScratchDisk() { unlink(options.path.c_str()); }
+};
+
+// what an operation of the async API printed, "" if it failed
+inline std::string
+output(std::future<AsyncResult> op)
+{
+    AsyncResult result = op.get();
+    return result.status == 0 ? result.output : "";
+}
+
+// what fsck finds, quietly: 0 if the file system is consistent
+inline int
+fsckQuiet(FS& fs, bool repair = false)
+{
+    Session session;
+    std::ostringstream report;
+    session.out = &report;
+    session.err = &report;
+    FS::SessionScope scope(session);
+    int status = fs.fsck(repair);
+    if (status != 0) {
+        std::cout << report.str();
+    }
+    return status;
+}
+
+#endif // __FSTEST_H__
@@ -0,0 +1,51 @@
+#include <cstdint>
+#include <limits>
+
+#ifndef __GEOMETRY_H__
+#define __GEOMETRY_H__
+
+// The shape of a file system on disk: block size, number of blocks, FAT
+// entry type and file name length. Every bound the engine loops over
+// (entries of a directory block, entries of the FAT) is a compile-time
+// constant of the geometry it is built for.
+template <unsigned BlockSize, unsigned Blocks, typename Entry, unsigned NameLength>
+struct Geometry {
+    static constexpr unsigned blockSize = BlockSize;
+    static constexpr unsigned blocks = Blocks;
+    static constexpr unsigned nameLength = NameLength;
+    using FATEntry = Entry;
+
+    struct dir_entry {
+        char file_name[NameLength]; // name of the file / sub-directory
+        uint32_t size; // size of the file in bytes
+        Entry first_blk; // index in the FAT for the first block of the file
+        uint8_t type; // directory (1) or file (0)
+        uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+    };
+    static constexpr unsigned dirEntries = BlockSize / sizeof(dir_entry);
+
+    // the FAT is one block and its all-ones entry marks the end of a file
+    static_assert(Blocks * sizeof(Entry) == BlockSize, "the FAT must be one block");
+    static_assert(Blocks <= std::numeric_limits<Entry>::max(), "every block needs a FAT entry below FAT_EOF");
+    static_assert(BlockSize % sizeof(dir_entry) == 0, "directory entries must tile a block");
+    // the inline area of a directory addresses its data with 16-bit offsets
+    static_assert(BlockSize <= 65536, "blocks are at most 64 KB");
+};
+
+// The geometries a build can be made for, as the superblock records them
+typedef Geometry<1024, 512, uint16_t, 56> Geometry1K;
+typedef Geometry<4096, 2048, uint16_t, 56> Geometry4K;
+typedef Geometry<8192, 4096, uint16_t, 56> Geometry8K;
+typedef Geometry<16384, 4096, uint32_t, 52> Geometry16K;
+
+// The geometry this build formats and mounts, another one of the above is
+// picked with -DFS_GEOMETRY=<name>, e.g. make GEOMETRY=Geometry16K
+#ifndef FS_GEOMETRY
+#define FS_GEOMETRY Geometry4K
+#endif
+typedef FS_GEOMETRY FsGeometry;
+
+// names the geometry of a superblock, nullptr if it is none of the above
+const char* geometryName(uint32_t blockSize, uint32_t blocks, uint32_t entrySize, uint32_t nameLength);
+
+#endif // __GEOMETRY_H__
@@ -0,0 +1,158 @@
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "fstest.h"
+
+// inlinetest
+//
+// Scenarios around the directory inline area: small files kept in it, the
+// packed tails of larger ones, and files moved, copied, appended and removed
+// next to them, also in a compressed directory. fsck has to find nothing
+// after each step and every file has to read back as it was written.
+
+// an empty file is inline as well, with no bytes in the area
+static void
+emptyFiles(FS& fs)
+{
+    std::cout << "Testing an empty file next to a small one..." << std::endl;
+    fs.mkdir("/empty");
+    check(fs.async_create("/empty/e", "").get().status == 0, "create an empty file");
+    check(fs.async_create("/empty/g", "hej heja hejare\n").get().status == 0, "create a small file");
+    check(fs.rm("/empty/g") == 0, "rm the small file");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+    check(fs.async_cat("/empty/e").get().status == 0, "the empty file is still there");
+
+    std::cout << "Testing mv of an empty file to another directory..." << std::endl;
+    fs.mkdir("/empty/sub");
+    fs.cd("/empty");
+    check(fs.mv("e", "sub") == 0, "mv the empty file");
+    fs.cd("..");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+    check(fsckQuiet(fs, true) == 0 && fs.async_cat("/empty/sub/e").get().status == 0,
+          "fsck -r keeps the empty file");
+    check(fs.rm("/empty/sub/e") == 0 && fsckQuiet(fs) == 0, "rm the empty file");
+}
+
+// name and content of files on either side of what the inline area takes
+static const std::vector<std::pair<std::string, std::string>>&
+files()
+{
+    static const std::vector<std::pair<std::string, std::string>> sizes = {
+        { "small", "hej heja hejare\n" },
+        { "fits", text(INLINE_MAX, 'i') },
+        { "over", text(INLINE_MAX + 1, 'o') },
+        { "tail", text(2 * BLOCK_SIZE + INLINE_MAX / 2, 't') },
+        { "long", text(2 * BLOCK_SIZE + INLINE_MAX + 1, 'l') },
+        { "whole", text(2 * BLOCK_SIZE, 'w') },
+    };
+    return sizes;
+}
+
+static const std::string&
+contentOf(const std::string& name)
+{
+    for (auto& file : files()) {
+        if (file.first == name) return file.second;
+    }
+    static const std::string none;
+    return none;
+}
+
+// every file reads back in dir as it was written
+static bool
+sameFiles(FS& fs, const std::string& dir)
+{
+    bool same = true;
+    for (auto& file : files()) {
+        same = same && output(fs.async_cat(dir + "/" + file.first)) == file.second;
+    }
+    return same;
+}
+
+static bool
+makeFiles(FS& fs, const std::string& dir)
+{
+    bool made = fs.mkdir(dir) == 0;
+    for (auto& file : files()) {
+        made = made && fs.async_create(dir + "/" + file.first, file.second).get().status == 0;
+    }
+    return made;
+}
+
+static void
+tailFiles(FS& fs)
+{
+    std::cout << "Testing small files and packed tails..." << std::endl;
+    check(makeFiles(fs, "/a"), "create the files");
+    check(sameFiles(fs, "/a"), "they read back");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+
+    std::cout << "Testing cp of them to another directory..." << std::endl;
+    bool copied = fs.mkdir("/b") == 0;
+    for (auto& file : files()) {
+        copied = copied && fs.async_cp("/a/" + file.first, "/b/" + file.first).get().status == 0;
+    }
+    check(copied, "cp the files");
+    check(sameFiles(fs, "/a") && sameFiles(fs, "/b"), "the files and their copies read back");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+
+    std::cout << "Testing mv of them to another directory..." << std::endl;
+    bool moved = fs.mkdir("/c") == 0 && fs.cd("/b") == 0;
+    for (auto& file : files()) {
+        moved = moved && fs.mv(file.first, "/c") == 0;
+    }
+    fs.cd("..");
+    check(moved, "mv the files");
+    check(sameFiles(fs, "/c") && fs.async_cat("/b/tail").get().status != 0, "they read back where they went");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+
+    std::cout << "Testing append of packed tails..." << std::endl;
+    check(fs.append("/c/tail", "/a/tail") == 0 && fs.append("/c/small", "/a/fits") == 0, "append to the files");
+    check(output(fs.async_cat("/a/tail")) == contentOf("tail") + contentOf("tail") &&
+          output(fs.async_cat("/a/fits")) == contentOf("fits") + contentOf("small"), "they read back longer");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+
+    std::cout << "Testing rm next to packed tails..." << std::endl;
+    bool removed = true;
+    for (auto& file : files()) {
+        removed = removed && fs.rm("/c/" + file.first) == 0;
+    }
+    check(removed, "rm the moved files");
+    check(output(fs.async_cat("/a/small")) == contentOf("small") && output(fs.async_cat("/a/long")) == contentOf("long"),
+          "the others read back");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+}
+
+static void
+compressed(FS& fs)
+{
+    std::cout << "Testing small files and packed tails in a compressed directory..." << std::endl;
+    check(fs.mkdir("/z") == 0 && fs.compress("on", "/z") == 0, "compress a directory");
+    bool made = true;
+    for (auto& file : files()) {
+        made = made && fs.async_create("/z/" + file.first, file.second).get().status == 0;
+    }
+    check(made && fs.sync() == 0, "create the files");
+    check(sameFiles(fs, "/z"), "they read back");
+    bool copied = fs.mkdir("/y") == 0;
+    for (auto& file : files()) {
+        copied = copied && fs.async_cp("/z/" + file.first, "/y/" + file.first).get().status == 0;
+    }
+    check(copied && sameFiles(fs, "/y"), "their copies outside read back");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+}
+
+int
+main()
+{
+    ScratchDisk scratch("inlinetest");
+    {
+        FS fs(CacheOptions(), scratch.options);
+        fs.format();
+        emptyFiles(fs);
+        tailFiles(fs);
+        compressed(fs);
+    }
+    return testFailures > 0 ? 1 : 0;
+}
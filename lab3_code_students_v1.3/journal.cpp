@@ -0,0 +1,334 @@
+#include <cstring>
+#include <algorithm>
+#include "journal.h"
+
+Journal::Journal(Disk& disk, unsigned start)
+    : disk(disk), start(start), seq(0), ops(0), batches(0), unsettled(0)
+{
+}
+
+thread_local JournalOperation* JournalOperation::current = nullptr;
+
+// FNV-1a over the header and the block images of a transaction
+uint32_t
+Journal::checksum(const journal_header& header, const std::vector<const uint8_t*>& images) const
+{
+    journal_header copy = header;
+    copy.checksum = 0;
+    uint32_t hash = 2166136261u;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&copy);
+    for (size_t i = 0; i < sizeof(copy); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    for (const uint8_t* image : images) {
+        for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+            hash = (hash ^ image[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// reads the transaction stored in one half, returns false if it is missing
+// or was only partially written
+bool
+Journal::readTransaction(unsigned half, journal_header& header, std::vector<BlockBuffer>& images)
+{
+    BlockBuffer block;
+    unsigned first = start + half * JOURNAL_HALF;
+    if (disk.read(first, block) != 0) return false;
+    std::memcpy(&header, block, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC || header.count > JOURNAL_HALF - 1) return false;
+    images.clear();
+    std::vector<const uint8_t*> bytes;
+    for (unsigned i = 0; i < header.count; ++i) {
+        images.emplace_back(false);
+        if (disk.read(first + 1 + i, images.back()) != 0) return false;
+        bytes.push_back(images.back().data());
+    }
+    return checksum(header, bytes) == header.checksum;
+}
+
+void
+Journal::reset()
+{
+    BlockBuffer empty;
+    std::lock_guard<std::mutex> commitLock(commitMutex);
+    std::lock_guard<std::mutex> lock(mutex);
+    staged.clear();
+    released.clear();
+    ops = 0;
+    batches = 0;
+    // clear the headers explicitly, the host may not support punching holes
+    disk.discard(start, JOURNAL_BLOCKS);
+    disk.write(start, empty);
+    disk.write(start + JOURNAL_HALF, empty);
+}
+
+// Only the newest transaction is replayed. Once it was synced the home
+// writes of the one before it were synced too, and its blocks may have
+// been reused since.
+int
+Journal::replay()
+{
+    journal_header header, newest = {};
+    std::vector<BlockBuffer> images, newestImages;
+    for (unsigned half = 0; half < 2; ++half) {
+        if (readTransaction(half, header, images) && header.seq >= newest.seq) {
+            newest = header;
+            newestImages.swap(images);
+        }
+    }
+    seq = newest.seq;
+    for (unsigned i = 0; i < newestImages.size(); ++i) {
+        if (disk.write(newest.blocks[i], newestImages[i].data()) != 0) return -1;
+    }
+    return disk.sync();
+}
+
+void
+Journal::write(unsigned block_no, const void* blk)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(blk);
+    std::lock_guard<std::mutex> lock(mutex);
+    staging();
+    std::memcpy(staged.try_emplace(block_no, false).first->second.data(), bytes, BLOCK_SIZE);
+}
+
+bool
+Journal::read(unsigned block_no, void* blk) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = staged.find(block_no);
+    if (it == staged.end()) {
+        it = committing.find(block_no);
+        if (it == committing.end()) return false;
+    }
+    std::memcpy(blk, it->second.data(), BLOCK_SIZE);
+    return true;
+}
+
+// A freed block must not be overwritten before the transaction freeing it
+// is committed, so it is held back from allocation and discarded afterwards.
+void
+Journal::release(unsigned block_no)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    staging();
+    staged.erase(block_no);
+    released.insert(block_no);
+}
+
+bool
+Journal::isReleased(unsigned block_no) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return released.count(block_no) > 0 || committingReleased.count(block_no) > 0;
+}
+
+bool
+Journal::hasReleased() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return !released.empty() || !committingReleased.empty();
+}
+
+// with mutex held, before a block is staged or released
+void
+Journal::staging()
+{
+    if (staged.empty() && released.empty()) {
+        firstStaged = std::chrono::steady_clock::now();
+    }
+    JournalOperation* op = JournalOperation::current;
+    if (op && &op->journal == this && !op->dirty) {
+        op->dirty = true;
+        unsettled += op->waiting == 0;
+    }
+}
+
+// with mutex held, a thread of op starts or stops waiting in commitWithin
+void
+Journal::setWaiting(JournalOperation* op, bool waiting)
+{
+    if (!op || &op->journal != this) return;
+    if (waiting && op->waiting++ == 0 && op->dirty) {
+        --unsettled;
+        operationsChanged.notify_all();
+    } else if (!waiting && --op->waiting == 0 && op->dirty) {
+        ++unsettled;
+    }
+}
+
+void
+Journal::endOperation(JournalOperation& op)
+{
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (op.dirty) {
+            --unsettled;
+            operationsChanged.notify_all();
+        }
+        ++ops;
+        full = (batches == 0 && ops >= GROUP_COMMIT_OPS) ||
+               staged.size() + MAX_OP_BLOCKS > JOURNAL_HALF - 1;
+    }
+    if (full) {
+        commit();
+    }
+}
+
+void
+Journal::beginBatch()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ++batches;
+}
+
+int
+Journal::endBatch()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (batches == 0) {
+            return -1;
+        }
+        if (--batches > 0) {
+            return 0;
+        }
+    }
+    return commit();
+}
+
+// punches the blocks freed by the committed transaction, one hole per run
+void
+Journal::discardReleased()
+{
+    std::vector<unsigned> blocks(committingReleased.begin(), committingReleased.end());
+    size_t first = 0;
+    for (size_t i = 1; i <= blocks.size(); ++i) {
+        if (i == blocks.size() || blocks[i] != blocks[i - 1] + 1) {
+            disk.discard(blocks[first], i - first);
+            first = i;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    committingReleased.clear();
+}
+
+int
+Journal::commit()
+{
+    std::unique_lock<std::shared_mutex> operationsDone(operationLock);
+    return commitStaged();
+}
+
+int
+Journal::commitPending()
+{
+    return commitStaged();
+}
+
+// An operation that has staged nothing yet, e.g. one waiting for a
+// directory the caller holds, is no reason to wait. Whether none is
+// unsettled is checked again when the staged blocks are taken, after the
+// data is flushed, as one may have staged meanwhile.
+int
+Journal::commitWithin()
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(COMMIT_WAIT_MS);
+    auto settled = [this] { return unsettled == 0; };
+    int status = 1;
+    std::unique_lock<std::mutex> lock(mutex);
+    setWaiting(JournalOperation::current, true);
+    while (status > 0 && operationsChanged.wait_until(lock, deadline, settled)) {
+        lock.unlock();
+        status = commitStaged(settled);
+        lock.lock();
+    }
+    setWaiting(JournalOperation::current, false);
+    return status == 0 ? 0 : -1;
+}
+
+int
+Journal::commitIfOlder(std::chrono::milliseconds age)
+{
+    std::unique_lock<std::shared_mutex> operationsDone(operationLock, std::try_to_lock);
+    if (!operationsDone.owns_lock()) {
+        return 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (batches > 0 || (staged.empty() && released.empty()) ||
+            std::chrono::steady_clock::now() - firstStaged < age) {
+            return 0;
+        }
+    }
+    return commitStaged();
+}
+
+// The staged blocks move to committing, where readers still find them while
+// they are logged and written home. New operations stage into a fresh set.
+// Returns 1 without committing if settled, checked with mutex held, is
+// false by then.
+int
+Journal::commitStaged(const std::function<bool()>& settled)
+{
+    std::lock_guard<std::mutex> commitLock(commitMutex);
+    if (flushData && flushData() != 0) {
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (settled && !settled()) {
+            return 1;
+        }
+        ops = 0;
+        committing.swap(staged);
+        committingReleased.swap(released);
+    }
+    // a batch larger than a journal half goes out as several transactions
+    while (!committing.empty()) {
+        journal_header header = {};
+        // committing only changes here, so the images are logged in place
+        std::vector<const uint8_t*> images;
+        header.magic = JOURNAL_MAGIC;
+        header.seq = seq + 1;
+        for (auto it = committing.begin(); it != committing.end() && header.count < JOURNAL_HALF - 1; ++it) {
+            header.blocks[header.count++] = it->first;
+            images.push_back(it->second.data());
+        }
+        header.checksum = checksum(header, images);
+
+        unsigned first = start + (header.seq % 2) * JOURNAL_HALF;
+        BlockBuffer block;
+        std::memcpy(block, &header, sizeof(header));
+        bool failed = false;
+        for (unsigned i = 0; i < header.count && !failed; ++i) {
+            failed = disk.write(first + 1 + i, const_cast<uint8_t*>(images[i])) != 0;
+        }
+        // the one sync of the batch, it also makes the previous home writes durable
+        if (failed || disk.write(first, block) != 0 || disk.sync() != 0) {
+            // hand the blocks back unless they were staged again meanwhile
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& image : committing) {
+                staged.try_emplace(image.first, std::move(image.second));
+            }
+            committing.clear();
+            released.insert(committingReleased.begin(), committingReleased.end());
+            committingReleased.clear();
+            return -1;
+        }
+        seq = header.seq;
+
+        for (unsigned i = 0; i < header.count; ++i) {
+            disk.write(header.blocks[i], const_cast<uint8_t*>(images[i]));
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned i = 0; i < header.count; ++i) {
+            committing.erase(header.blocks[i]);
+        }
+    }
+    discardReleased();
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <vector>
+#include "buffers.h"
+#include "disk.h"
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+class JournalOperation;
+
+// The journal is made of two halves used alternately, so a transaction that
+// is being written never overwrites the previous, still needed, one. Each
+// half is a header block followed by the logged block images.
+#define JOURNAL_HALF 17
+#define JOURNAL_BLOCKS (2 * JOURNAL_HALF)
+#define JOURNAL_MAGIC 0x4a524e4c // "JRNL"
+// Commit after this many operations, or earlier when the journal fills up
+#define GROUP_COMMIT_OPS 16
+// Most metadata blocks a single operation stages (FAT, two directories and
+// their inline areas)
+#define MAX_OP_BLOCKS 5
+// How long an operation short of blocks waits for the other operations in
+// flight to finish before it gives up on the blocks freed so far
+#define COMMIT_WAIT_MS 100
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t count;    // number of logged blocks
+    uint64_t seq;      // transaction sequence number
+    uint32_t checksum; // over the header (with checksum 0) and the logged blocks
+    uint16_t blocks[JOURNAL_HALF - 1]; // home locations of the logged blocks
+};
+
+static_assert(FsGeometry::blocks - 1 <= UINT16_MAX, "journal_header::blocks can't hold every block number");
+
+class Journal {
+private:
+    Disk& disk;
+    unsigned start;
+    uint64_t seq;
+    unsigned ops;
+    // nesting depth of open batches, no group commits while > 0
+    unsigned batches;
+    // operations in flight that staged or released blocks and have no
+    // thread waiting in commitWithin
+    unsigned unsettled;
+    // staged metadata blocks, written home after the next commit
+    std::map<unsigned, BlockBuffer> staged;
+    // blocks of the transaction being committed, still served to readers
+    std::map<unsigned, BlockBuffer> committing;
+    // blocks freed since the last commit, discarded and reusable after it
+    std::set<unsigned> released;
+    std::set<unsigned> committingReleased;
+    // when the oldest staged block was staged
+    std::chrono::steady_clock::time_point firstStaged;
+    // writes data back before metadata referring to it is committed
+    std::function<int()> flushData;
+    // guards the members above, commitMutex serializes commits
+    mutable std::mutex mutex;
+    std::mutex commitMutex;
+    // signalled when unsettled goes down
+    std::condition_variable operationsChanged;
+    // held shared by every operation, exclusively to commit between them
+    std::shared_mutex operationLock;
+    uint32_t checksum(const journal_header& header, const std::vector<const uint8_t*>& images) const;
+    bool readTransaction(unsigned half, journal_header& header, std::vector<BlockBuffer>& images);
+    void discardReleased();
+    void staging();
+    void setWaiting(JournalOperation* op, bool waiting);
+    int commitStaged(const std::function<bool()>& settled = nullptr);
+public:
+    Journal(Disk& disk, unsigned start);
+    // number of disk blocks used by the journal, starting at start
+    unsigned size() const { return JOURNAL_BLOCKS; }
+    // drops everything staged and invalidates the journal on disk (format)
+    void reset();
+    // writes the newest complete transaction home again (mount)
+    int replay();
+    // stages a metadata block for the current transaction
+    void write(unsigned block_no, const void* blk);
+    // reads the staged copy of a block, returns false if there is none
+    bool read(unsigned block_no, void* blk) const;
+    // marks a block as freed by the current transaction
+    void release(unsigned block_no);
+    bool isReleased(unsigned block_no) const;
+    bool hasReleased() const;
+    // called when an operation is complete, commits a group of operations
+    void endOperation(JournalOperation& op);
+    // opens a batch, its operations are committed together when the
+    // outermost batch ends (or earlier if they don't fit in the journal)
+    void beginBatch();
+    int endBatch();
+    // logs the staged blocks with a single sync, then writes them home.
+    // Waits until no operation is in flight, so only whole operations commit.
+    int commit();
+    // commits right away, for a caller holding operations() exclusively
+    int commitPending();
+    // commits from within an operation that needs the blocks freed so far,
+    // once no other operation in flight has staged anything, so only the
+    // calling one (and others waiting here) is partially committed. Returns
+    // -1 without committing if that takes longer than COMMIT_WAIT_MS, such
+    // an operation may be waiting for a lock the caller holds.
+    int commitWithin();
+    // commits if the oldest staged block is older than age and no operation
+    // or batch is in flight, otherwise leaves it to a later call
+    int commitIfOlder(std::chrono::milliseconds age);
+    // sets what every commit runs first, so data blocks reach the disk
+    // before the metadata that points at them (ordered mode)
+    void setFlush(std::function<int()> flush) { flushData = flush; }
+    std::shared_mutex& operations() { return operationLock; }
+};
+
+// Marks the end of an operation when it goes out of scope, whichever way
+// the operation returns. The blocks staged on the thread of an operation are
+// its own; the threads of a tree walk act for it by setting current.
+class JournalOperation {
+private:
+    friend class Journal;
+    Journal& journal;
+    JournalOperation* outer;
+    // guarded by the journal's mutex
+    bool dirty = false;   // staged or released a block
+    unsigned waiting = 0; // threads of it in commitWithin
+public:
+    static thread_local JournalOperation* current;
+    JournalOperation(Journal& journal) : journal(journal), outer(current)
+    {
+        journal.operations().lock_shared();
+        current = this;
+    }
+    ~JournalOperation() {
+        current = outer;
+        journal.operations().unlock_shared();
+        journal.endOperation(*this);
+    }
+};
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,174 @@
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fstest.h"
+
+// journaltest
+//
+// Checks what mount makes of the journal after a crash, simulated on the
+// disk itself: the home writes of the newest transaction are undone as if
+// the machine went down right after logging it. And that an operation short
+// of blocks gets the ones freed by the transaction that is still pending.
+
+// the newest complete-looking transaction header, seq 0 if there is none
+static journal_header
+newest(Disk& disk, unsigned& first)
+{
+    journal_header found = {};
+    BlockBuffer block;
+    for (unsigned half = 0; half < 2; ++half) {
+        journal_header header;
+        if (disk.read(JOURNAL_START + half * JOURNAL_HALF, block) != 0) continue;
+        std::memcpy(&header, block.data(), sizeof(header));
+        if (header.magic == JOURNAL_MAGIC && header.seq > found.seq) {
+            found = header;
+            first = JOURNAL_START + half * JOURNAL_HALF;
+        }
+    }
+    return found;
+}
+
+// Makes /d/old, then /d/new in a second mount, and undoes the home writes of
+// the transaction that made /d/new. With damage the logged transaction is
+// then damaged as well. Returns false if the image could not be prepared.
+static bool
+crash(ScratchDisk& scratch, const std::string& content, const std::function<void(Disk&, unsigned)>& damage)
+{
+    std::vector<BlockBuffer> before;
+    bool ok;
+    {
+        FS fs(CacheOptions(), scratch.options);
+        fs.format();
+        ok = fs.mkdir("/d") == 0 && fs.async_create("/d/old", "old\n").get().status == 0;
+    }
+    {
+        Disk disk(scratch.options);
+        for (unsigned b = 0; b < MAX_BLOCKS; ++b) {
+            before.emplace_back();
+            disk.read(b, before.back());
+        }
+    }
+    {
+        FS fs(CacheOptions(), scratch.options);
+        ok = ok && fs.async_create("/d/new", content).get().status == 0 && fs.sync() == 0;
+    }
+    Disk disk(scratch.options);
+    unsigned first = 0;
+    journal_header header = newest(disk, first);
+    ok = ok && header.seq != 0;
+    for (unsigned i = 0; ok && i < header.count; ++i) {
+        ok = disk.write(header.blocks[i], before[header.blocks[i]]) == 0;
+    }
+    if (ok && damage) {
+        damage(disk, first);
+    }
+    return check(ok, "make the image of the crash");
+}
+
+// /d/new of blocks only, of blocks and a packed tail, and inline only
+static void
+replayed()
+{
+    std::cout << "Testing mount after a crash between logging and the home writes..." << std::endl;
+    for (const std::string& content : { text(3 * BLOCK_SIZE, 'n'), text(3 * BLOCK_SIZE + 100, 'n'), text(100, 'n') }) {
+        ScratchDisk scratch("journaltest");
+        if (!crash(scratch, content, nullptr)) continue;
+        FS fs(CacheOptions(), scratch.options);
+        std::string size = " (" + std::to_string(content.size()) + " bytes)";
+        check(fsckQuiet(fs) == 0, "fsck finds nothing" + size);
+        check(output(fs.async_cat("/d/new")) == content, "/d/new is replayed" + size);
+        check(output(fs.async_cat("/d/old")) == "old\n", "/d/old is as it was" + size);
+    }
+}
+
+static void
+torn()
+{
+    std::cout << "Testing mount after a crash while logging..." << std::endl;
+    ScratchDisk scratch("journaltest");
+    bool damaged = false;
+    if (!crash(scratch, text(3 * BLOCK_SIZE + 100, 'n'), [&damaged](Disk& disk, unsigned first) {
+            // a logged image that never made it, the checksum doesn't match
+            BlockBuffer block;
+            damaged = disk.read(first + 1, block) == 0;
+            block.data()[BLOCK_SIZE / 2] ^= 0xff;
+            damaged = damaged && disk.write(first + 1, block) == 0;
+        }) ||
+        !check(damaged, "damage the logged transaction")) {
+        return;
+    }
+    FS fs(CacheOptions(), scratch.options);
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+    check(fs.async_cat("/d/new").get().status != 0, "/d/new is not there");
+    check(output(fs.async_cat("/d/old")) == "old\n", "/d/old is as it was");
+}
+
+// The disk filled up, a file removed and a new one written in its blocks
+// before the removal is committed
+static void
+reused()
+{
+    std::cout << "Testing a create that needs the blocks of a pending rm..." << std::endl;
+    ScratchDisk scratch("journaltest");
+    FS fs(CacheOptions(), scratch.options);
+    fs.format();
+    std::string content = text(64 * BLOCK_SIZE, 'f');
+    int files = 0;
+    while (files < (int)(MAX_BLOCKS / 64) && fs.async_create("/f" + std::to_string(files), content).get().status == 0) {
+        ++files;
+    }
+    check(files > 1 && fs.async_create("/f" + std::to_string(files), content).get().status != 0, "fill the disk");
+    check(fs.sync() == 0 && fs.rm("/f0") == 0, "rm a file");
+    check(fs.async_create("/g", content).get().status == 0, "create a file as large");
+    check(output(fs.async_cat("/g")) == content, "it reads back");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+}
+
+// Writers that keep needing the blocks their own rm just freed, with the
+// others in the middle of theirs
+static void
+contended()
+{
+    std::cout << "Testing writers short of blocks at once..." << std::endl;
+    ScratchDisk scratch("journaltest");
+    FS fs(CacheOptions(), scratch.options);
+    fs.format();
+    std::string content = text(64 * BLOCK_SIZE, 'f');
+    int files = 0;
+    while (files < (int)(MAX_BLOCKS / 64) && fs.async_create("/f" + std::to_string(files), content).get().status == 0) {
+        ++files;
+    }
+    const int writers = 4;
+    for (int i = 0; i < writers; ++i) {
+        fs.rm("/f" + std::to_string(i));
+    }
+    std::atomic<int> failed{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < writers; ++t) {
+        threads.emplace_back([&fs, &content, &failed, t] {
+            std::string name = "/w" + std::to_string(t);
+            for (int i = 0; i < 50; ++i) {
+                failed += fs.async_create(name, content).get().status != 0 || fs.async_rm(name).get().status != 0;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    check(files > writers && failed == 0, "every create finds its blocks");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+}
+
+int
+main()
+{
+    replayed();
+    torn();
+    reused();
+    contended();
+    return testFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,49 @@
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#ifndef __LOCKS_H__
+#define __LOCKS_H__
+
+// Number of reader/writer locks a LockTable spreads its keys over
+#define LOCK_STRIPES 64
+
+// Striped reader/writer locks, keyed by block number
+class LockTable {
+private:
+    std::shared_mutex stripes[LOCK_STRIPES];
+public:
+    std::shared_mutex& get(unsigned stripe) { return stripes[stripe]; }
+    static unsigned stripe(unsigned key) { return key % LOCK_STRIPES; }
+};
+
+// Holds shared or exclusive locks on several keys of a LockTable. The locks
+// are taken in stripe order so two LockSets never deadlock; a stripe that is
+// requested in both modes is locked exclusively.
+class LockSet {
+private:
+    LockTable& table;
+    std::map<unsigned, bool> wanted; // stripe -> exclusive
+    std::vector<std::pair<std::shared_mutex*, bool>> held;
+public:
+    LockSet(LockTable& table) : table(table) {}
+    ~LockSet() { unlock(); }
+    LockSet& shared(unsigned key) { wanted[LockTable::stripe(key)] |= false; return *this; }
+    LockSet& exclusive(unsigned key) { wanted[LockTable::stripe(key)] = true; return *this; }
+    void lock() {
+        for (auto& w : wanted) {
+            std::shared_mutex& m = table.get(w.first);
+            if (w.second) m.lock(); else m.lock_shared();
+            held.push_back(std::make_pair(&m, w.second));
+        }
+    }
+    void unlock() {
+        for (auto it = held.rbegin(); it != held.rend(); ++it) {
+            if (it->second) it->first->unlock(); else it->first->unlock_shared();
+        }
+        held.clear();
+    }
+};
+
+#endif // __LOCKS_H__
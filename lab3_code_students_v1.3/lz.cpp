@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cstring>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+// entries of the table of recent positions, by a hash of their next 4 bytes
+#define LZ_HASH_BITS 12
+
+static inline uint32_t
+load32(const uint8_t* p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline unsigned
+hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// the bytes after a token continuing a length of 15 or more
+static bool
+putLength(uint8_t*& op, const uint8_t* end, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (op == end) return false;
+        *op++ = 255;
+    }
+    if (op == end) return false;
+    *op++ = length;
+    return true;
+}
+
+static bool
+getLength(const uint8_t*& ip, const uint8_t* end, size_t& length)
+{
+    uint8_t byte;
+    do {
+        if (ip == end) return false;
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// one sequence, the last one when match is 0
+static bool
+putSequence(uint8_t*& op, const uint8_t* end, const uint8_t* literals, size_t count, size_t distance, size_t match)
+{
+    if (op == end) return false;
+    uint8_t* token = op++;
+    size_t extra = match ? match - LZ_MIN_MATCH : 0;
+    *token = std::min<size_t>(count, 15) << 4 | std::min<size_t>(extra, 15);
+    if (count >= 15 && !putLength(op, end, count - 15)) return false;
+    if ((size_t)(end - op) < count) return false;
+    std::memcpy(op, literals, count);
+    op += count;
+    if (match == 0) return true;
+    if (end - op < 2) return false;
+    *op++ = distance & 0xFF;
+    *op++ = distance >> 8;
+    return extra < 15 || putLength(op, end, extra - 15);
+}
+
+// Greedy matching against the last position with the same hash. Where
+// nothing matches the search steps further and further ahead, so data that
+// does not compress costs little time.
+size_t
+lzCompress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {}; // positions + 1, 0 for none
+    uint8_t* op = out;
+    const uint8_t* end = out + capacity;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ_MIN_MATCH <= length) {
+        uint32_t value = load32(in + i);
+        unsigned h = hash(value);
+        size_t candidate = table[h];
+        table[h] = i + 1;
+        if (candidate == 0 || i - (candidate - 1) > LZ_MAX_DISTANCE || load32(in + candidate - 1) != value) {
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        size_t from = candidate - 1;
+        size_t match = LZ_MIN_MATCH;
+        while (i + match < length && in[from + match] == in[i + match]) {
+            ++match;
+        }
+        if (!putSequence(op, end, in + anchor, i - anchor, i - from, match)) return 0;
+        i += match;
+        anchor = i;
+    }
+    if (!putSequence(op, end, in + anchor, length - anchor, 0, 0)) return 0;
+    return op - out;
+}
+
+bool
+lzDecompress(const uint8_t* in, size_t length, uint8_t* out, size_t expected)
+{
+    const uint8_t* ip = in;
+    const uint8_t* end = in + length;
+    size_t done = 0;
+    // the stream ends with a sequence of literals only, never after a match
+    while (true) {
+        if (ip == end) return false;
+        uint8_t token = *ip++;
+        size_t count = token >> 4;
+        if (count == 15 && !getLength(ip, end, count)) return false;
+        if ((size_t)(end - ip) < count || expected - done < count) return false;
+        std::memcpy(out + done, ip, count);
+        ip += count;
+        done += count;
+        if (ip == end) break;
+        if (end - ip < 2) return false;
+        size_t distance = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && !getLength(ip, end, match)) return false;
+        if (distance == 0 || distance > done || expected - done < match) return false;
+        // byte by byte, a match may overlap the bytes it produces
+        for (size_t k = 0; k < match; ++k) {
+            out[done + k] = out[done - distance + k];
+        }
+        done += match;
+    }
+    return done == expected;
+}
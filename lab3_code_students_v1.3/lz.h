@@ -0,0 +1,20 @@
+#include <cstddef>
+#include <cstdint>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// A small LZ77 codec writing the block format of LZ4: sequences of a token
+// (literal count << 4 | match length - 4, where 15 continues in the bytes
+// after it, each adding up to 255), the literals, the match distance as 16
+// bits and the extra length bytes of the match. The last sequence has
+// literals only. Matches reach back at most 64 KB, a block at most.
+
+// compresses length bytes of in into out, returns the compressed length,
+// or 0 if it does not fit in capacity bytes
+size_t lzCompress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity);
+// decompresses length bytes of in into out, false unless they are well
+// formed and decode to exactly expected bytes
+bool lzDecompress(const uint8_t* in, size_t length, uint8_t* out, size_t expected);
+
+#endif // __LZ_H__
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "fstest.h"
+#include "lz.h"
+
+// lztest
+//
+// Checks the LZ codec on blocks of all kinds and on damaged input, which it
+// has to refuse without reading or writing out of bounds, and the compressed
+// blocks of a disk: their slot map has to survive a remount, and a discard
+// or format has to leave no block compressed that is not written so again.
+
+static std::vector<uint8_t>
+bytesOf(const std::string& s)
+{
+    return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+// room for what the codec makes of length bytes that don't compress: a
+// literal count byte for every 255 of them and the token
+static size_t
+bound(size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+static bool
+roundTrip(const std::vector<uint8_t>& in)
+{
+    std::vector<uint8_t> packed(bound(in.size())), out(in.size());
+    size_t length = lzCompress(in.data(), in.size(), packed.data(), packed.size());
+    return length > 0 && lzDecompress(packed.data(), length, out.data(), out.size()) && out == in;
+}
+
+static void
+codec()
+{
+    std::cout << "Testing the LZ codec..." << std::endl;
+    std::mt19937 random(26);
+    std::vector<uint8_t> noise(BLOCK_SIZE);
+    for (auto& b : noise) {
+        b = random();
+    }
+    check(roundTrip(std::vector<uint8_t>(BLOCK_SIZE, 0)), "a block of zeros");
+    check(roundTrip(bytesOf(text(BLOCK_SIZE, 'x'))), "a block of text");
+    check(roundTrip(noise), "a block of noise");
+    check(roundTrip(bytesOf("abc")), "fewer bytes than a match");
+    std::string mixed;
+    while (mixed.size() < BLOCK_SIZE) {
+        mixed += std::to_string(mixed.size() * 7919) + "|" + std::string(random() % 300, 'm');
+    }
+    check(roundTrip(bytesOf(mixed.substr(0, BLOCK_SIZE))), "long matches and literal runs");
+
+    std::vector<uint8_t> small(BLOCK_SIZE / 2);
+    check(lzCompress(noise.data(), noise.size(), small.data(), small.size()) == 0,
+          "noise does not fit in half a block");
+
+    std::cout << "Testing the LZ codec on damaged input..." << std::endl;
+    std::vector<uint8_t> in = bytesOf(text(BLOCK_SIZE, 'y'));
+    std::vector<uint8_t> packed(bound(BLOCK_SIZE)), out(BLOCK_SIZE);
+    size_t length = lzCompress(in.data(), in.size(), packed.data(), packed.size());
+    check(length > 0 && !lzDecompress(packed.data(), length - 1, out.data(), out.size()), "a truncated stream");
+    check(!lzDecompress(packed.data(), length, out.data(), out.size() - 1), "a stream longer than expected");
+    check(lzDecompress(packed.data(), length, out.data(), out.size()) && out == in, "the stream itself");
+    // a match reaching back before the start of the output
+    const uint8_t before[] = { 0x10, 'a', 0x05, 0x00 };
+    check(!lzDecompress(before, sizeof(before), out.data(), 8), "a match before the start");
+    // a literal count running past the end of the stream
+    const uint8_t literals[] = { 0xf0, 0xff, 0xff, 'a' };
+    check(!lzDecompress(literals, sizeof(literals), out.data(), out.size()), "literals past the end");
+    // every byte of the stream damaged in turn, what comes out may be wrong
+    // but nothing past the expected bytes may be written
+    bool bounded = true;
+    for (size_t i = 0; i < length; ++i) {
+        std::vector<uint8_t> damaged(packed.begin(), packed.begin() + length);
+        damaged[i] ^= 0xa5;
+        std::vector<uint8_t> guarded(BLOCK_SIZE + 64, 0xee);
+        lzDecompress(damaged.data(), damaged.size(), guarded.data(), BLOCK_SIZE);
+        bounded = bounded && std::all_of(guarded.begin() + BLOCK_SIZE, guarded.end(), [](uint8_t b) { return b == 0xee; });
+    }
+    check(bounded, "every byte of the stream damaged");
+}
+
+// what metrics reports for key
+static std::string
+metric(FS& fs, const std::string& key)
+{
+    Session session;
+    std::ostringstream report;
+    session.out = &report;
+    session.err = &report;
+    FS::SessionScope scope(session);
+    fs.metrics();
+    std::istringstream lines(report.str());
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, key.size() + 2, key + ": ") == 0) {
+            return line.substr(key.size() + 2);
+        }
+    }
+    return "";
+}
+
+static void
+slots()
+{
+    std::cout << "Testing the slot map of a disk..." << std::endl;
+    ScratchDisk scratch("lztest");
+    std::string content = text(BLOCK_SIZE, 's');
+    unsigned b = FIRST_DATA_BLOCK;
+    BlockBuffer block, read;
+    std::memcpy(block.data(), content.data(), BLOCK_SIZE);
+    {
+        Disk disk(scratch.options);
+        disk.set_compressed(b, true);
+        check(disk.write(b, block) == 0 && disk.get_packed_blocks() == 1, "a block is stored compressed");
+    }
+    {
+        Disk disk(scratch.options);
+        check(disk.get_packed_blocks() == 1 && disk.read(b, read) == 0 &&
+              std::memcmp(read.data(), block.data(), BLOCK_SIZE) == 0, "it reads back after a remount");
+    }
+    {
+        Disk disk(scratch.options);
+        disk.set_compressed(b, true);
+        check(disk.write(b, block) == 0 && disk.discard(b) >= 0 && disk.get_packed_blocks() == 0,
+              "discard frees its slot");
+        check(disk.write(b, block) == 0 && disk.get_packed_blocks() == 0, "written again it is stored as it is");
+        disk.set_compressed(b, true);
+        disk.write(b, block);
+    }
+
+    std::cout << "Testing a damaged slot map..." << std::endl;
+    // the map follows the blocks and their checksums, see disk.h
+    off_t map = (off_t)MAX_BLOCKS * BLOCK_SIZE + (CHECKSUMS ? (MAX_BLOCKS + 1) * sizeof(uint32_t) : 0);
+    {
+        uint16_t length = BLOCK_SIZE - 1;
+        int fd = open(scratch.options.path.c_str(), O_WRONLY);
+        check(fd >= 0 && pwrite(fd, &length, sizeof(length), map + b * sizeof(uint16_t)) == sizeof(length),
+              "damage the slot of the block");
+        close(fd);
+        Disk disk(scratch.options);
+        check(disk.read(b, read) != 0, "the block can't be read");
+    }
+    {
+        // and its compressed bytes
+        Disk disk(scratch.options);
+        disk.set_compressed(b, true);
+        disk.write(b, block);
+    }
+    {
+        int fd = open(scratch.options.path.c_str(), O_RDWR);
+        uint16_t length = 0;
+        uint8_t byte = 0;
+        check(fd >= 0 && pread(fd, &length, sizeof(length), map + b * sizeof(uint16_t)) == sizeof(length) && length > 0,
+              "the block is stored compressed");
+        // in the middle of the stream, a block of text compresses to a few
+        // bytes in a small block
+        off_t at = (off_t)b * BLOCK_SIZE + length / 2;
+        check(pread(fd, &byte, 1, at) == 1 && (byte ^= 0x5a, pwrite(fd, &byte, 1, at) == 1),
+              "damage the compressed block");
+        close(fd);
+        Disk disk(scratch.options);
+        check(disk.read(b, read) != 0, "the block can't be read");
+    }
+
+    // the directories made after the format get the blocks of the file, as
+    // they are allocated on the same thread, and are never compressed. They
+    // are nested, a directory of a small block has room for few entries
+    std::cout << "Testing format after a compressed file..." << std::endl;
+    FS fs(CacheOptions(), scratch.options);
+    fs.format();
+    std::istringstream file(text(8 * BLOCK_SIZE, 'z') + "\n");
+    Session writer;
+    writer.in = &file;
+    bool created;
+    {
+        FS::SessionScope scope(writer);
+        created = fs.mkdir("/z") == 0 && fs.compress("on", "/z") == 0 && fs.create("/z/f") == 0;
+    }
+    check(created && fs.sync() == 0 && metric(fs, "disk.compressed_blocks") != "0", "a compressed file");
+    bool made = fs.format() == 0;
+    std::string dir;
+    for (int i = 0; i < 16; ++i) {
+        dir += "/d" + std::to_string(i);
+        made = made && fs.mkdir(dir) == 0;
+    }
+    check(made && fs.sync() == 0, "format, and directories in its blocks");
+    check(metric(fs, "disk.compressed_blocks") == "0", "nothing is stored compressed");
+}
+
+int
+main()
+{
+    codec();
+    slots();
+    return testFailures > 0 ? 1 : 0;
+}
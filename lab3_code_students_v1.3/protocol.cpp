@@ -0,0 +1,93 @@
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "protocol.h"
+
+void putString(std::string& body, const std::string& value)
+{
+    uint32_t length = value.size();
+    body.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    body.append(value);
+}
+
+bool getString(const std::string& body, size_t& pos, std::string& value)
+{
+    uint32_t length;
+    if (body.size() - pos < sizeof(length)) {
+        return false;
+    }
+    std::memcpy(&length, body.data() + pos, sizeof(length));
+    pos += sizeof(length);
+    if (body.size() - pos < length) {
+        return false;
+    }
+    value.assign(body, pos, length);
+    pos += length;
+    return true;
+}
+
+bool sendFrame(int fd, const std::string& body)
+{
+    uint32_t length = body.size();
+    std::string frame(reinterpret_cast<const char*>(&length), sizeof(length));
+    frame += body;
+    size_t sent = 0;
+    while (sent < frame.size()) {
+        ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd p = { fd, POLLOUT, 0 };
+            poll(&p, 1, -1);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// reads exactly size bytes
+static bool recvAll(int fd, char* data, size_t size)
+{
+    size_t received = 0;
+    while (received < size) {
+        ssize_t n = recv(fd, data + received, size - received, 0);
+        if (n > 0) {
+            received += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool recvFrame(int fd, std::string& body)
+{
+    uint32_t length;
+    if (!recvAll(fd, reinterpret_cast<char*>(&length), sizeof(length)) || length > MAX_FRAME) {
+        return false;
+    }
+    body.resize(length);
+    return recvAll(fd, &body[0], length);
+}
+
+bool takeFrame(std::string& buffer, std::string& body)
+{
+    uint32_t length;
+    if (buffer.size() < sizeof(length)) {
+        return false;
+    }
+    std::memcpy(&length, buffer.data(), sizeof(length));
+    if (buffer.size() - sizeof(length) < length) {
+        return false;
+    }
+    body.assign(buffer, sizeof(length), length);
+    buffer.erase(0, sizeof(length) + length);
+    return true;
+}
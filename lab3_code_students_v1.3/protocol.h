@@ -0,0 +1,55 @@
+#include <cstdint>
+#include <string>
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+// Path of the server's Unix domain socket, relative to its working directory
+#define DEFAULT_SOCKET "fs.sock"
+// Largest frame either side accepts
+#define MAX_FRAME (16 * 1024 * 1024)
+
+// Every message is a frame, a 4-byte body length followed by the body. The
+// socket is local, so integers are sent in host byte order.
+//
+// Request body:  1-byte opcode, then its arguments, each a 4-byte length
+//                followed by the bytes
+// Response body: 4-byte status (the return value of the FS call), then what
+//                the call printed
+enum Opcode : uint8_t {
+    OP_FORMAT = 1, // no arguments
+    OP_CREATE,     // path, content
+    OP_CAT,        // path
+    OP_LS,         // no arguments
+    OP_CP,         // source, destination
+    OP_MV,         // source, destination
+    OP_RM,         // path
+    OP_APPEND,     // source, destination
+    OP_MKDIR,      // path
+    OP_CD,         // path
+    OP_PWD,        // no arguments
+    OP_CHMOD,      // access rights, path
+    OP_SYNC,       // no arguments
+    OP_BEGIN,      // no arguments
+    OP_COMMIT,     // no arguments
+    OP_RM_TREE,    // path
+    OP_CP_TREE,    // source, destination
+    OP_DU,         // path
+    OP_FIND,       // path, name
+    OP_FSCK,       // no arguments
+    OP_FSCK_REPAIR, // no arguments
+    OP_COMPRESS     // on or off, path
+};
+
+// appends a length-prefixed argument to a request body
+void putString(std::string& body, const std::string& value);
+// reads the length-prefixed argument at pos and moves pos past it
+bool getString(const std::string& body, size_t& pos, std::string& value);
+// sends a whole frame, waiting for the socket if it is non-blocking
+bool sendFrame(int fd, const std::string& body);
+// receives a whole frame from a blocking socket
+bool recvFrame(int fd, std::string& body);
+// takes a complete frame off the front of buffer, if it holds one
+bool takeFrame(std::string& buffer, std::string& body);
+
+#endif // __PROTOCOL_H__
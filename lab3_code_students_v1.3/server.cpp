@@ -0,0 +1,329 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+
+// number of arguments of every opcode, indexed by opcode
+static const unsigned arity[] = {
+    0, 0, 2, 1, 0, 2, 2, 1, 2, 1, 1, 0, 2, 0, 0, 0, 1, 2, 1, 2, 0, 0, 2
+};
+
+Server::Server(FS& filesystem)
+    : filesystem(filesystem), listenFd(-1), stopping(false)
+{
+    if (pipe2(wakePipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        std::cerr << "Error: could not create the wake pipe\n";
+        wakePipe[0] = wakePipe[1] = -1;
+    }
+}
+
+Server::~Server()
+{
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(path.c_str());
+    }
+    if (wakePipe[0] >= 0) {
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+    }
+}
+
+int
+Server::listen(const std::string& path)
+{
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path too long.\n";
+        return -1;
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        std::cerr << "Error: socket: " << std::strerror(errno) << "\n";
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(listenFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listenFd, SOMAXCONN) != 0) {
+        std::cerr << "Error: listen on " << path << ": " << std::strerror(errno) << "\n";
+        close(listenFd);
+        listenFd = -1;
+        return -1;
+    }
+    this->path = path;
+    return 0;
+}
+
+int
+Server::run(unsigned count)
+{
+    if (listenFd < 0 || wakePipe[0] < 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < std::max(count, 1u); ++i) {
+        workers.emplace_back(&Server::work, this);
+    }
+
+    std::vector<struct pollfd> fds;
+    bool running = true;
+    while (running) {
+        // connections with a request in flight are not read from until it is answered
+        fds.clear();
+        fds.push_back({ listenFd, POLLIN, 0 });
+        fds.push_back({ wakePipe[0], POLLIN, 0 });
+        for (auto& c : connections) {
+            if (!c.second->busy) {
+                fds.push_back({ c.first, POLLIN, 0 });
+            }
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: poll: " << std::strerror(errno) << "\n";
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wakePipe[0], drain, sizeof(drain)) > 0) {
+            }
+            std::vector<Connection*> done;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.swap(finished);
+                running = !stopping;
+            }
+            for (Connection* c : done) {
+                c->busy = false;
+                dispatch(*c);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            accept();
+        }
+        for (size_t i = 2; i < fds.size(); ++i) {
+            if (fds[i].revents) {
+                auto it = connections.find(fds[i].fd);
+                if (it != connections.end()) {
+                    receive(*it->second);
+                }
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    finished.clear();
+    while (!connections.empty()) {
+        drop(connections.begin()->first);
+    }
+    return 0;
+}
+
+void
+Server::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    wake();
+}
+
+void
+Server::wake()
+{
+    char c = 0;
+    if (write(wakePipe[1], &c, 1) < 0 && errno != EAGAIN) {
+        std::cerr << "Error: could not wake the server\n";
+    }
+}
+
+void
+Server::accept()
+{
+    int fd;
+    while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        std::unique_ptr<Connection> connection(new Connection());
+        connection->fd = fd;
+        connections[fd] = std::move(connection);
+    }
+}
+
+// reads what the client sent and queues the next request
+void
+Server::receive(Connection& connection)
+{
+    BlockBuffer data(false);
+    while (true) {
+        ssize_t n = recv(connection.fd, data, BLOCK_SIZE, 0);
+        if (n > 0) {
+            connection.buffer.append(reinterpret_cast<char*>(data.data()), n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        // closed by the client or broken
+        drop(connection.fd);
+        return;
+    }
+    uint32_t length = 0;
+    if (connection.buffer.size() >= sizeof(length)) {
+        std::memcpy(&length, connection.buffer.data(), sizeof(length));
+    }
+    if (length > MAX_FRAME) {
+        drop(connection.fd);
+        return;
+    }
+    dispatch(connection);
+}
+
+// hands the connection's next complete request to the workers
+void
+Server::dispatch(Connection& connection)
+{
+    if (connection.busy || !takeFrame(connection.buffer, connection.request)) {
+        return;
+    }
+    connection.busy = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(&connection);
+    }
+    ready.notify_one();
+}
+
+// closes a connection, committing the batches it left open
+void
+Server::drop(int fd)
+{
+    auto it = connections.find(fd);
+    if (it == connections.end()) {
+        return;
+    }
+    Connection& connection = *it->second;
+    {
+        FS::SessionScope scope(connection.session);
+        for (; connection.batches > 0; --connection.batches) {
+            filesystem.commit();
+        }
+    }
+    close(fd);
+    connections.erase(it);
+}
+
+void
+Server::work()
+{
+    while (true) {
+        Connection* connection;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            connection = queue.front();
+            queue.pop_front();
+        }
+        execute(*connection);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.push_back(connection);
+        }
+        wake();
+    }
+}
+
+// runs one request in the connection's session and sends the response
+void
+Server::execute(Connection& connection)
+{
+    const std::string& request = connection.request;
+    uint8_t op = request.empty() ? 0 : request[0];
+    std::vector<std::string> args;
+    std::string arg;
+    size_t pos = 1;
+    while (pos < request.size() && getString(request, pos, arg)) {
+        args.push_back(arg);
+    }
+
+    std::ostringstream output;
+    std::istringstream input;
+    Session& session = connection.session;
+    session.in = &input;
+    session.out = &output;
+    session.err = &output;
+    int status = -1;
+    if (op < OP_FORMAT || op > OP_COMPRESS || pos != request.size() || args.size() != arity[op]) {
+        output << "Error: malformed request.\n";
+    } else {
+        FS::SessionScope scope(session);
+        switch (op) {
+        case OP_FORMAT: status = filesystem.format(); break;
+        case OP_CREATE:
+            input.str(args[1]);
+            status = filesystem.create(args[0]);
+            break;
+        case OP_CAT: status = filesystem.cat(args[0]); break;
+        case OP_LS: status = filesystem.ls(); break;
+        case OP_CP: status = filesystem.cp(args[0], args[1]); break;
+        case OP_MV: status = filesystem.mv(args[0], args[1]); break;
+        case OP_RM: status = filesystem.rm(args[0]); break;
+        case OP_APPEND: status = filesystem.append(args[0], args[1]); break;
+        case OP_MKDIR: status = filesystem.mkdir(args[0]); break;
+        case OP_CD: status = filesystem.cd(args[0]); break;
+        case OP_PWD: status = filesystem.pwd(); break;
+        case OP_CHMOD: status = filesystem.chmod(args[0], args[1]); break;
+        case OP_SYNC: status = filesystem.sync(); break;
+        case OP_RM_TREE: status = filesystem.rm(args[0], true); break;
+        case OP_CP_TREE: status = filesystem.cp(args[0], args[1], true); break;
+        case OP_DU: status = filesystem.du(args[0]); break;
+        case OP_FIND: status = filesystem.find(args[0], args[1]); break;
+        case OP_FSCK: status = filesystem.fsck(); break;
+        case OP_FSCK_REPAIR: status = filesystem.fsck(true); break;
+        case OP_COMPRESS: status = filesystem.compress(args[0], args[1]); break;
+        case OP_BEGIN:
+            status = filesystem.begin();
+            if (status == 0) ++connection.batches;
+            break;
+        case OP_COMMIT:
+            if (connection.batches > 0) {
+                --connection.batches;
+                status = filesystem.commit();
+            } else {
+                output << "Error: commit without begin.\n";
+            }
+            break;
+        }
+    }
+    session.in = &std::cin;
+    session.out = &std::cout;
+    session.err = &std::cerr;
+
+    int32_t code = status;
+    std::string response(reinterpret_cast<const char*>(&code), sizeof(code));
+    response += output.str();
+    // a failed send shows up as a closed connection on the next read
+    sendFrame(connection.fd, response);
+}
@@ -0,0 +1,64 @@
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fs.h"
+#include "protocol.h"
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+// Worker threads used when none are asked for
+#define DEFAULT_WORKERS 4
+
+// Serves one file system to many clients over a Unix domain socket. Every
+// connection is a session with its own working directory and open batches.
+// One thread polls the socket and hands complete requests to a pool of
+// workers that run them; a connection has at most one request running, so
+// its requests are answered in order.
+class Server {
+private:
+    struct Connection {
+        int fd;
+        Session session;
+        unsigned batches = 0; // batches begun and not yet committed
+        bool busy = false;    // a request of this connection is queued or running
+        std::string buffer;   // bytes received but not yet taken as a request
+        std::string request;
+    };
+    FS& filesystem;
+    std::string path;
+    int listenFd;
+    int wakePipe[2];
+    // connections, owned by the polling thread
+    std::map<int, std::unique_ptr<Connection>> connections;
+    // requests waiting for a worker, and connections whose request finished
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Connection*> queue;
+    std::vector<Connection*> finished;
+    bool stopping;
+    std::vector<std::thread> workers;
+    void work();
+    void execute(Connection& connection);
+    void accept();
+    void receive(Connection& connection);
+    void dispatch(Connection& connection);
+    void drop(int fd);
+    void wake();
+public:
+    Server(FS& filesystem);
+    ~Server();
+    // binds and listens on the socket at path, replacing a stale one
+    int listen(const std::string& path = DEFAULT_SOCKET);
+    // serves clients with the given number of workers until stop() is called
+    int run(unsigned workers = DEFAULT_WORKERS);
+    // makes run() return, may be called from any thread
+    void stop();
+};
+
+#endif // __SERVER_H__
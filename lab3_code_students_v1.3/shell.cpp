@@ -9,7 +9,9 @@ std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
+    "chmod", "compress", "sync", "batch",
+    "du", "find", "metrics", "fsck",
+    "stats", "record", "blocktrace",
     "help", "quit"
 };
 
@@ -33,8 +35,9 @@ Shell::run()
     std::vector<std::string> cmd_line;
     std::string cmd, arg1, arg2;
     int ret_val = 0;
+    unsigned batch_depth = 0;
     while (running) {
-        std::cout << "filesystem> ";
+        std::cout << (batch_depth ? "batch> " : "filesystem> ");
         std::getline(std::cin, line);
         std::stringstream linestream(line);
         cmd_line.clear();
@@ -119,14 +122,15 @@ Shell::run()
         }
 
         else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
+            bool recursive = cmd_line.size() == 4 && cmd_line[1] == "-r";
+            if (cmd_line.size() != 3 && !recursive) {
+                std::cout << "Usage: cp [-r] <oldfile> <newfile>\n";
                 continue;
             }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
+            arg1 = cmd_line[cmd_line.size() - 2];
+            arg2 = cmd_line[cmd_line.size() - 1];
             // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
+            ret_val = filesystem.cp(arg1, arg2, recursive);
             if (ret_val) {
                 std::cout << "Error: cp " << arg1 << " " << arg2;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -149,13 +153,14 @@ Shell::run()
         }
 
         else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
+            bool recursive = cmd_line.size() == 3 && cmd_line[1] == "-r";
+            if (cmd_line.size() != 2 && !recursive) {
+                std::cout << "Usage: rm [-r] <file>\n";
                 continue;
             }
-            arg1 = cmd_line[1];
+            arg1 = cmd_line[cmd_line.size() - 1];
             // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
+            ret_val = filesystem.rm(arg1, recursive);
             if (ret_val) {
                 std::cout << "Error: rm " << arg1;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -232,12 +237,154 @@ Shell::run()
             }
         }
 
+        else if (cmd == "compress") {
+            if (cmd_line.size() != 3) {
+                std::cout << "Usage: compress on|off <path>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            arg2 = cmd_line[2];
+            // check return value so everything is ok
+            ret_val = filesystem.compress(arg1, arg2);
+            if (ret_val) {
+                std::cout << "Error: compress " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "du") {
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: du [<path>]\n";
+                continue;
+            }
+            arg1 = cmd_line.size() == 2 ? cmd_line[1] : ".";
+            // check return value so everything is ok
+            ret_val = filesystem.du(arg1);
+            if (ret_val) {
+                std::cout << "Error: du " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "find") {
+            if (cmd_line.size() != 3) {
+                std::cout << "Usage: find <dirpath> <name>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            arg2 = cmd_line[2];
+            // check return value so everything is ok
+            ret_val = filesystem.find(arg1, arg2);
+            if (ret_val) {
+                std::cout << "Error: find " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "sync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "fsck") {
+            if (cmd_line.size() > 2 || (cmd_line.size() == 2 && cmd_line[1] != "-r")) {
+                std::cout << "Usage: fsck [-r]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.fsck(cmd_line.size() == 2);
+            if (ret_val) {
+                std::cout << "Error: fsck found problems it did not repair, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "metrics") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: metrics\n";
+                continue;
+            }
+            ret_val = filesystem.metrics();
+        }
+
+        else if (cmd == "stats") {
+            if (cmd_line.size() > 2 || (cmd_line.size() == 2 && cmd_line[1] != "-j" && cmd_line[1] != "-r")) {
+                std::cout << "Usage: stats [-j|-r]\n";
+                continue;
+            }
+            // -j prints JSON, -r resets the statistics
+            if (cmd_line.size() == 2 && cmd_line[1] == "-r") {
+                ret_val = filesystem.resetStats();
+            } else {
+                ret_val = filesystem.stats(cmd_line.size() == 2);
+            }
+            if (ret_val) {
+                std::cout << "Error: stats failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "record") {
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: record [<tracefile>]\n";
+                continue;
+            }
+            // without a file the recording is stopped
+            ret_val = filesystem.record(cmd_line.size() == 2 ? cmd_line[1] : "");
+            if (ret_val) {
+                std::cout << "Error: record failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "blocktrace") {
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: blocktrace [<file>]\n";
+                continue;
+            }
+            // without a file the tracing is stopped and the trace written
+            ret_val = filesystem.traceBlocks(cmd_line.size() == 2 ? cmd_line[1] : "");
+            if (ret_val) {
+                std::cout << "Error: blocktrace failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "batch") {
+            if (cmd_line.size() != 2 || cmd_line[1] != "{") {
+                std::cout << "Usage: batch {\n";
+                continue;
+            }
+            ret_val = filesystem.begin();
+            if (ret_val) {
+                std::cout << "Error: batch failed, error code " << ret_val << std::endl;
+            } else {
+                ++batch_depth;
+            }
+        }
+
+        else if (cmd == "}") {
+            if (cmd_line.size() != 1 || batch_depth == 0) {
+                std::cout << "Error: } without batch {\n";
+                continue;
+            }
+            --batch_depth;
+            // check return value so everything is ok
+            ret_val = filesystem.commit();
+            if (ret_val) {
+                std::cout << "Error: batch commit failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "quit")
             running = false;
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, compress, du, find, sync, batch, metrics, stats, fsck, record, blocktrace, help, quit\n";
         }
 
         else if (cmd == "") {
@@ -246,7 +393,7 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, compress, du, find, sync, batch, metrics, stats, fsck, record, blocktrace, help, quit\n";
         }
     }
 }
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cmath>
+#include "stats.h"
+
+// Values below HISTOGRAM_SUB_BUCKETS have a bucket each, above that every
+// power of two is split into HISTOGRAM_SUB_BUCKETS equal buckets
+unsigned
+LatencyHistogram::bucket(uint64_t ns)
+{
+    if (ns < HISTOGRAM_SUB_BUCKETS) {
+        return ns;
+    }
+    unsigned exponent = 63 - __builtin_clzll(ns);
+    unsigned sub = (ns >> (exponent - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS;
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t
+LatencyHistogram::lowest(unsigned bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+void
+LatencyHistogram::record(uint64_t ns)
+{
+    buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t longest = max.load(std::memory_order_relaxed);
+    while (ns > longest && !max.compare_exchange_weak(longest, ns, std::memory_order_relaxed)) {
+    }
+}
+
+// the highest value of the bucket holding the percentile, but no more than
+// the longest latency seen
+uint64_t
+LatencyHistogram::percentile(double p) const
+{
+    uint64_t n = calls();
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(p * n));
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+        seen += buckets[b].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t highest = b + 1 < HISTOGRAM_BUCKETS ? lowest(b + 1) - 1 : UINT64_MAX;
+            return std::min(highest, longest());
+        }
+    }
+    return longest();
+}
+
+// racing recorders may leave a call half counted, which a reset at run
+// time can live with
+void
+LatencyHistogram::reset()
+{
+    for (auto& b : buckets) {
+        b.store(0, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+LatencyStats::LatencyStats(std::vector<std::string> names)
+    : names(names), histograms(new LatencyHistogram[names.size()])
+{
+}
+
+void
+LatencyStats::summarize(const std::string& prefix, std::vector<LatencySummary>& summaries) const
+{
+    for (size_t i = 0; i < names.size(); ++i) {
+        const LatencyHistogram& h = histograms[i];
+        uint64_t calls = h.calls();
+        if (calls == 0) {
+            continue;
+        }
+        summaries.push_back({ prefix + names[i], calls, h.total() / calls, h.percentile(0.5),
+                              h.percentile(0.99), h.percentile(0.999), h.longest() });
+    }
+}
+
+void
+LatencyStats::reset()
+{
+    for (size_t i = 0; i < names.size(); ++i) {
+        histograms[i].reset();
+    }
+}
+
+void
+printLatencies(std::ostream& out, const std::vector<LatencySummary>& summaries, bool json)
+{
+    if (json) {
+        out << "{";
+        for (size_t i = 0; i < summaries.size(); ++i) {
+            const LatencySummary& s = summaries[i];
+            out << (i ? ",\n " : "\n ") << "\"" << s.name << "\": {\"calls\": " << s.calls
+                << ", \"mean_ns\": " << s.meanNs << ", \"p50_ns\": " << s.p50Ns << ", \"p99_ns\": " << s.p99Ns
+                << ", \"p999_ns\": " << s.p999Ns << ", \"max_ns\": " << s.maxNs << "}";
+        }
+        out << "\n}\n";
+        return;
+    }
+    out << "operation\tcalls\tmean_us\tp50_us\tp99_us\tp999_us\tmax_us\n";
+    auto us = [](uint64_t ns) { return std::to_string(ns / 1000) + "." + std::to_string(ns % 1000 / 100); };
+    for (const LatencySummary& s : summaries) {
+        out << s.name << "\t" << s.calls << "\t" << us(s.meanNs) << "\t" << us(s.p50Ns) << "\t"
+            << us(s.p99Ns) << "\t" << us(s.p999Ns) << "\t" << us(s.maxNs) << "\n";
+    }
+}
@@ -0,0 +1,91 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+// Count and time the operations of the file system and the disk; false
+// compiles the timers out
+#define STATS true
+
+// Sub-buckets per power of two of a histogram, so a percentile is within
+// 1/HISTOGRAM_SUB_BUCKETS of the true value
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Latencies in nanoseconds in log-linear buckets, as HDR histograms keep
+// them. Recording is a few relaxed atomic adds, no locks.
+class LatencyHistogram {
+private:
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+    static unsigned bucket(uint64_t ns);
+    static uint64_t lowest(unsigned bucket);
+public:
+    LatencyHistogram() { reset(); }
+    void record(uint64_t ns);
+    // the value below which fraction p of the recorded latencies are
+    uint64_t percentile(double p) const;
+    uint64_t calls() const { return count.load(std::memory_order_relaxed); }
+    uint64_t total() const { return sum.load(std::memory_order_relaxed); }
+    uint64_t longest() const { return max.load(std::memory_order_relaxed); }
+    void reset();
+};
+
+// What a histogram holds, under the name of its operation
+struct LatencySummary {
+    std::string name;
+    uint64_t calls;
+    uint64_t meanNs;
+    uint64_t p50Ns;
+    uint64_t p99Ns;
+    uint64_t p999Ns;
+    uint64_t maxNs;
+};
+
+// One histogram per operation of a component, by index
+class LatencyStats {
+private:
+    std::vector<std::string> names;
+    std::unique_ptr<LatencyHistogram[]> histograms;
+public:
+    LatencyStats(std::vector<std::string> names);
+    LatencyHistogram& operator[](unsigned op) { return histograms[op]; }
+    // the operations called since the last reset, names after prefix
+    void summarize(const std::string& prefix, std::vector<LatencySummary>& summaries) const;
+    void reset();
+};
+
+// Times a scope into a histogram
+class LatencyTimer {
+private:
+    LatencyHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+public:
+    LatencyTimer(LatencyHistogram& histogram) : histogram(histogram)
+    {
+        if (STATS) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~LatencyTimer()
+    {
+        if (STATS) {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+    }
+};
+
+// prints summaries as a table in microseconds, or as JSON in nanoseconds
+void printLatencies(std::ostream& out, const std::vector<LatencySummary>& summaries, bool json);
+
+#endif // __STATS_H__
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include "taskpool.h"
+
+thread_local int TaskPool::current = -1;
+thread_local const TaskPool* TaskPool::owner = nullptr;
+
+TaskPool::TaskPool(unsigned workers) : queued(0), next(0), stopping(false)
+{
+    if (workers == 0) {
+        workers = std::max(2u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < workers; ++i) {
+        queues.emplace_back(new Worker());
+    }
+    for (unsigned i = 0; i < workers; ++i) {
+        threads.emplace_back(&TaskPool::work, this, i);
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// queues task on the calling worker's deque, or spreads tasks submitted from
+// outside the pool over all deques
+void
+TaskPool::submit(TaskGroup& group, std::function<void()> task)
+{
+    ++group.pending;
+    std::function<void()> counted = [&group, task]() {
+        task();
+        // under the mutex, so wait() cannot return and drop the group first
+        std::lock_guard<std::mutex> lock(group.mutex);
+        if (--group.pending == 0) {
+            group.done.notify_all();
+        }
+    };
+    unsigned target = owner == this ? current : next++ % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back(std::move(counted));
+    }
+    ++queued;
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+    }
+    idle.notify_one();
+}
+
+// the newest task of worker self, else the oldest task of another worker
+bool
+TaskPool::take(unsigned self, std::function<void()>& task)
+{
+    {
+        Worker& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queued;
+            return true;
+        }
+    }
+    for (unsigned i = 1; i < queues.size(); ++i) {
+        Worker& victim = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+TaskPool::work(unsigned self)
+{
+    owner = this;
+    current = self;
+    std::function<void()> task;
+    while (true) {
+        if (take(self, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(idleMutex);
+        idle.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+// waits for the tasks of group. A worker waiting on a group runs queued
+// tasks meanwhile instead of blocking its thread.
+void
+TaskPool::wait(TaskGroup& group)
+{
+    std::function<void()> task;
+    while (owner == this && group.pending > 0 && take(current, task)) {
+        task();
+        task = nullptr;
+    }
+    std::unique_lock<std::mutex> lock(group.mutex);
+    group.done.wait(lock, [&group] { return group.pending == 0; });
+}
@@ -0,0 +1,78 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef __TASKPOOL_H__
+#define __TASKPOOL_H__
+
+// Tasks submitted together; wait() returns once all of them, and the tasks
+// they submitted to the same group, have run
+class TaskGroup {
+private:
+    std::atomic<long> pending;
+    std::mutex mutex;
+    std::condition_variable done;
+    friend class TaskPool;
+public:
+    TaskGroup() : pending(0) {}
+};
+
+// Work-stealing thread pool. Every worker has its own deque: tasks a worker
+// submits go to the back of its deque and it runs them newest first, which
+// keeps a tree walk depth first and its working set small. An idle worker
+// steals the oldest task of another worker, usually the root of a large
+// unexplored subtree.
+class TaskPool {
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<Worker>> queues;
+    std::vector<std::thread> threads;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    std::atomic<long> queued;
+    std::atomic<unsigned> next;
+    bool stopping;
+    // pool and index of the calling worker, none outside of the workers
+    static thread_local const TaskPool* owner;
+    static thread_local int current;
+    bool take(unsigned self, std::function<void()>& task);
+    void work(unsigned self);
+public:
+    // with 0 workers the pool has one per hardware thread, at least two
+    TaskPool(unsigned workers = 0);
+    ~TaskPool();
+    void submit(TaskGroup& group, std::function<void()> task);
+    void wait(TaskGroup& group);
+};
+
+// Counting semaphore, bounds how many tasks do I/O at the same time
+class Semaphore {
+private:
+    std::mutex mutex;
+    std::condition_variable available;
+    unsigned count;
+public:
+    Semaphore(unsigned count) : count(count) {}
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this] { return count > 0; });
+        --count;
+    }
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++count;
+        }
+        available.notify_one();
+    }
+};
+
+#endif // __TASKPOOL_H__
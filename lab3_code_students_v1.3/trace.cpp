@@ -0,0 +1,148 @@
+#include <sstream>
+#include "fs.h"
+#include "trace.h"
+
+int
+TraceRecorder::open(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (out.is_open()) {
+        out.close();
+    }
+    out.open(path, std::ios::trunc);
+    if (!out) {
+        recording = false;
+        return -1;
+    }
+    out << "// file system trace: @<start us> <duration us> <status> <session>, then the call\n";
+    started = std::chrono::steady_clock::now();
+    recording = true;
+    return 0;
+}
+
+void
+TraceRecorder::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    recording = false;
+    if (out.is_open()) {
+        out.close();
+    }
+}
+
+uint64_t
+TraceRecorder::now() const
+{
+    auto elapsed = std::chrono::steady_clock::now() - started;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void
+TraceRecorder::write(const TraceRecord& record)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!recording) {
+        return;
+    }
+    out << "@" << record.start << " " << record.duration << " " << record.status << " " << record.session << "\n"
+        << record.command << "\n";
+    if (record.command.compare(0, 7, "create ") == 0) {
+        out << record.content << "\n";
+    }
+    out.flush();
+}
+
+std::vector<TraceRecord>
+readTrace(std::istream& in)
+{
+    std::vector<TraceRecord> records;
+    TraceRecord next;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line.compare(0, 2, "//") == 0) {
+            continue;
+        }
+        if (line[0] == '@') {
+            std::istringstream header(line.substr(1));
+            header >> next.start >> next.duration >> next.status >> next.session;
+            next.timed = !header.fail();
+            continue;
+        }
+        next.command = line;
+        if (line.compare(0, 7, "create ") == 0) {
+            while (std::getline(in, line) && !line.empty()) {
+                next.content += line + "\n";
+            }
+        }
+        records.push_back(next);
+        next = TraceRecord();
+    }
+    return records;
+}
+
+bool
+replay(FS& fs, Session& session, const TraceRecord& record, int& status)
+{
+    std::vector<std::string> args;
+    std::istringstream words(record.command);
+    std::string word;
+    while (words >> word) {
+        args.push_back(word);
+    }
+    if (args.empty()) {
+        return false;
+    }
+    const std::string& cmd = args[0];
+    size_t n = args.size();
+    bool recursive = n > 1 && args[1] == "-r";
+    std::istringstream data(record.content + "\n");
+    std::istream* input = session.in;
+    session.in = &data;
+    FS::SessionScope scope(session);
+    bool known = true;
+    if (cmd == "format" && n == 1) {
+        status = fs.format();
+    } else if (cmd == "create" && n == 2) {
+        status = fs.create(args[1]);
+    } else if (cmd == "cat" && n == 2) {
+        status = fs.cat(args[1]);
+    } else if (cmd == "ls" && n == 1) {
+        status = fs.ls();
+    } else if (cmd == "cp" && (n == 3 || (n == 4 && recursive))) {
+        status = fs.cp(args[n - 2], args[n - 1], recursive);
+    } else if (cmd == "mv" && n == 3) {
+        status = fs.mv(args[1], args[2]);
+    } else if (cmd == "rm" && (n == 2 || (n == 3 && recursive))) {
+        status = fs.rm(args[n - 1], recursive);
+    } else if (cmd == "append" && n == 3) {
+        status = fs.append(args[1], args[2]);
+    } else if (cmd == "mkdir" && n == 2) {
+        status = fs.mkdir(args[1]);
+    } else if (cmd == "cd" && n == 2) {
+        status = fs.cd(args[1]);
+    } else if (cmd == "pwd" && n == 1) {
+        status = fs.pwd();
+    } else if (cmd == "chmod" && n == 3) {
+        status = fs.chmod(args[1], args[2]);
+    } else if (cmd == "compress" && n == 3) {
+        status = fs.compress(args[1], args[2]);
+    } else if (cmd == "du" && n <= 2) {
+        status = fs.du(n == 2 ? args[1] : ".");
+    } else if (cmd == "find" && n == 3) {
+        status = fs.find(args[1], args[2]);
+    } else if (cmd == "fsck" && (n == 1 || (n == 2 && recursive))) {
+        status = fs.fsck(recursive);
+    } else if (cmd == "sync" && n == 1) {
+        status = fs.sync();
+    } else if (cmd == "metrics" && n == 1) {
+        status = fs.metrics();
+    } else if (cmd == "batch" && n == 2 && args[1] == "{") {
+        status = fs.begin();
+    } else if (cmd == "}" && n == 1) {
+        status = fs.commit();
+    } else {
+        known = false;
+    }
+    session.in = input;
+    return known;
+}
@@ -0,0 +1,78 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+class FS;
+struct Session;
+
+// One call of the file system API. In a trace file it is a line
+//   @<start> <duration> <status> <session>
+// followed by the call as a shell command line, and for create by the data
+// it read and an empty line. Times are in microseconds from the start of the
+// recording. Without the @ line, as in test_commands.txt, it is a command
+// of session 0 with no timing; lines starting with // are comments.
+struct TraceRecord {
+    uint64_t start = 0;
+    uint64_t duration = 0;
+    int status = 0;
+    unsigned long session = 0;
+    bool timed = false;
+    std::string command;
+    std::string content;
+};
+
+// Writes the calls made on a file system to a trace file
+class TraceRecorder {
+private:
+    std::mutex mutex;
+    std::ofstream out;
+    std::atomic<bool> recording;
+    std::chrono::steady_clock::time_point started;
+public:
+    TraceRecorder() : recording(false) {}
+    // starts a new trace in the file at path
+    int open(const std::string& path);
+    void close();
+    bool active() const { return recording.load(std::memory_order_relaxed); }
+    // microseconds since the trace was started
+    uint64_t now() const;
+    void write(const TraceRecord& record);
+};
+
+// Reads through another stream buffer and keeps a copy of what was taken,
+// to record the data create reads
+class TeeBuffer : public std::streambuf {
+private:
+    std::streambuf* source;
+    std::string copy;
+protected:
+    int_type underflow() override { return source->sgetc(); }
+    int_type uflow() override
+    {
+        int_type c = source->sbumpc();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            copy += traits_type::to_char_type(c);
+        }
+        return c;
+    }
+public:
+    TeeBuffer(std::streambuf* source) : source(source) {}
+    const std::string& taken() const { return copy; }
+};
+
+// reads the calls of a trace, or the commands of a plain command list
+std::vector<TraceRecord> readTrace(std::istream& in);
+// Makes a recorded call on fs in session. Returns false if the command is
+// not one of the file system's, e.g. the expected output in a command list.
+bool replay(FS& fs, Session& session, const TraceRecord& record, int& status);
+
+#endif // __TRACE_H__
@@ -0,0 +1,119 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fstest.h"
+
+// treetest
+//
+// Checks the operations on whole trees: du, find, cp -r and rm -r. A copy
+// has to read back as the original, and a cp -r or rm -r that can't be done
+// completely has to leave nothing behind. fsck has to find nothing after
+// each of them.
+
+// path and content of the files of the tree under /t
+static const std::vector<std::pair<std::string, std::string>>&
+files()
+{
+    static const std::vector<std::pair<std::string, std::string>> tree = {
+        { "a", "hej heja hejare\n" },
+        { "b", text(3 * BLOCK_SIZE + INLINE_MAX / 2, 'b') },
+        { "sub/c", text(BLOCK_SIZE, 'c') },
+        { "sub/e.txt", "e\n" },
+        { "sub/deep/d.txt", text(2 * BLOCK_SIZE + 10, 'd') },
+    };
+    return tree;
+}
+
+static size_t
+treeBytes()
+{
+    size_t bytes = 0;
+    for (auto& file : files()) {
+        bytes += file.second.size();
+    }
+    return bytes;
+}
+
+// every file of the tree reads back under root as it was written
+static bool
+sameTree(FS& fs, const std::string& root)
+{
+    bool same = true;
+    for (auto& file : files()) {
+        AsyncResult read = fs.async_cat(root + "/" + file.first).get();
+        same = same && read.status == 0 && read.output == file.second;
+    }
+    return same;
+}
+
+static void
+walks(FS& fs)
+{
+    std::cout << "Testing du and find..." << std::endl;
+    bool made = fs.mkdir("/t") == 0 && fs.mkdir("/t/sub") == 0 && fs.mkdir("/t/sub/deep") == 0;
+    for (auto& file : files()) {
+        made = made && fs.async_create("/t/" + file.first, file.second).get().status == 0;
+    }
+    check(made, "make the tree");
+    check(output(fs.async_du("/t")) == std::to_string(treeBytes()) + "\t/t\n", "du adds up the files");
+    check(output(fs.async_find("/t", "*.txt")) == "/t/sub/deep/d.txt\n/t/sub/e.txt\n", "find lists the matches");
+}
+
+static void
+copies(FS& fs)
+{
+    std::cout << "Testing cp -r..." << std::endl;
+    check(fs.async_cp("/t", "/u", true).get().status == 0, "cp -r the tree");
+    check(sameTree(fs, "/u"), "the copy reads back as the tree");
+    check(output(fs.async_du("/u")) == std::to_string(treeBytes()) + "\t/u\n", "du of the copy");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+
+    std::cout << "Testing cp -r of a tree with an unreadable file..." << std::endl;
+    check(fs.chmod("2", "/t/sub/e.txt") == 0, "chmod the file");
+    check(fs.async_cp("/t", "/v", true).get().status != 0, "cp -r fails");
+    check(fs.async_du("/v").get().status != 0, "there is no partial copy");
+    check(fsckQuiet(fs) == 0, "fsck finds no leaked blocks");
+    fs.chmod("6", "/t/sub/e.txt");
+}
+
+static void
+removes(FS& fs)
+{
+    std::cout << "Testing rm -r of the working directory of another session..." << std::endl;
+    Session other;
+    {
+        FS::SessionScope scope(other);
+        check(fs.cd("/u/sub") == 0, "cd in the other session");
+    }
+    check(fs.async_rm("/u", true).get().status != 0, "rm -r fails");
+    check(sameTree(fs, "/u"), "the tree is as it was");
+    {
+        FS::SessionScope scope(other);
+        fs.cd("..");
+        fs.cd("..");
+    }
+    check(fs.async_rm("/u", true).get().status == 0, "rm -r once it left");
+    check(fs.async_du("/u").get().status != 0, "the tree is gone");
+    check(fsckQuiet(fs) == 0, "fsck finds nothing");
+
+    std::cout << "Testing rm -r of a tree with a read-only file..." << std::endl;
+    check(fs.chmod("4", "/t/sub/deep/d.txt") == 0, "chmod the file");
+    check(fs.async_rm("/t", true).get().status != 0, "rm -r fails");
+    check(sameTree(fs, "/t") && fsckQuiet(fs) == 0, "nothing of the tree is removed");
+    fs.chmod("6", "/t/sub/deep/d.txt");
+    check(fs.async_rm("/t", true).get().status == 0 && fsckQuiet(fs) == 0, "rm -r once it may");
+}
+
+int
+main()
+{
+    ScratchDisk scratch("treetest");
+    {
+        FS fs(CacheOptions(), scratch.options);
+        fs.format();
+        walks(fs);
+        copies(fs);
+        removes(fs);
+    }
+    return testFailures > 0 ? 1 : 0;
+}